@@ -0,0 +1,80 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+#include "../src/enn.h"
+#include "../src/linalg.h"
+#include "../src/linalgf.h"
+#include "../src/gemm.h"
+
+/* Compares the built-in kernels with the external BLAS (make bench ENN_BLAS=openblas). Without a BLAS
+only the built-in kernels are timed. */
+
+/* Each measurement repeats the operation for at least this many seconds */
+#define BENCH_SECONDS 0.25
+
+enum bench_op {BENCH_MMUL, BENCH_MMULF, BENCH_MADD, BENCH_MSCALE};
+
+/**
+* Returns a monotonic time in seconds.
+*/
+static double bench_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+* Times one operation on n x n matrices. madd and mscale run in place, which is what the BLAS handles.
+*
+* @returns The achieved rate in GFLOP/s (mmul) or Gelements/s (madd, mscale).
+*/
+static double bench_run(enum bench_op op, int n){
+	Matrix *a = mconst(n, n, 0.5, NULL), *b = mconst(n, n, 0.25, NULL), *c = mconst(n, n, 1.0, NULL);
+	Matrixf *af = mconvf(a, NULL), *bf = mconvf(b, NULL), *cf = mconvf(c, NULL);
+	double start, elapsed, work;
+	long reps = 0;
+
+	work = (op == BENCH_MMUL || op == BENCH_MMULF) ? 2.0 * n * n * n : (double)n * n;
+	start = bench_now();
+	do{
+		if(op == BENCH_MMUL)mmul(a, b, c);
+		else if(op == BENCH_MMULF)mmulf(af, bf, cf);
+		else if(op == BENCH_MADD)madd(c, b, c);
+		else mscale(c, 0.9999, c);
+		reps++;
+		elapsed = bench_now() - start;
+	}while(elapsed < BENCH_SECONDS);
+
+	mfree(a);
+	mfree(b);
+	mfree(c);
+	mfreef(af);
+	mfreef(bf);
+	mfreef(cf);
+	return work * reps / elapsed * 1e-9;
+}
+
+int main(void){
+	const char* names[] = {"mmul", "mmulf", "madd", "mscale"};
+	const char* units[] = {"GFLOP/s", "GFLOP/s", "Gelem/s", "Gelem/s"};
+	int sizes[] = {64, 256, 512, 1024};
+	int blas = gemm_set_blas(1);
+	int op, size;
+
+	printf("%-8s %6s %12s %12s\n", "op", "n", "built-in", blas ? "blas" : "(no blas)");
+	for(op = BENCH_MMUL; op <= BENCH_MSCALE; op++){
+		for(size = 0; size < (int)(sizeof(sizes) / sizeof(sizes[0])); size++){
+			double builtin, external = 0.0;
+			gemm_set_blas(0);
+			builtin = bench_run(op, sizes[size]);
+			if(blas){
+				gemm_set_blas(1);
+				external = bench_run(op, sizes[size]);
+			}
+			printf("%-8s %6d %12.3f %12.3f %s\n", names[op], sizes[size], builtin, external, units[op]);
+		}
+	}
+	gemm_set_blas(blas);
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <math.h>
+#include "../src/enn.h"
+#include "../src/linalg.h"
+#include "../src/nn.h"
+#include "../src/nfile.h"
+#include "iris.h"
+#include "wide.h"
+
+/* Checks that the executors enn_codegen generated for the networks of enn_models give the outputs of
+npred_rows(). Run by make codegen-check.
+Usage: enn_codegen_check directory */
+
+#define CHECK_SAMPLES 10
+#define CHECK_TOLERANCE 1e-12
+
+/* Iris samples (see test/test.c) */
+static const double iris_X[CHECK_SAMPLES][4] = {
+	{6.1, 2.8, 4.7, 1.2},
+	{5.7, 3.8, 1.7, 0.3},
+	{7.7, 2.6, 6.9, 2.3},
+	{6.0, 2.9, 4.5, 1.5},
+	{6.8, 2.8, 4.8, 1.4},
+	{5.4, 3.4, 1.5, 0.4},
+	{5.6, 2.9, 3.6, 1.3},
+	{6.9, 3.1, 5.1, 2.3},
+	{6.2, 2.2, 4.5, 1.5},
+	{5.8, 2.7, 3.9, 1.2}
+};
+
+typedef void (*check_batch)(int samples, const double* X, double* out);
+
+/**
+* Runs a saved network with npred_rows() and with its generated executor on the same samples.
+*
+* @param dir Directory of the saved network, directory/name.bin.
+* @param name Name of the network.
+* @param X The inputs, CHECK_SAMPLES x inputs.
+* @param batch The generated name_pred_batch().
+*
+* @returns 1 if every output agrees within CHECK_TOLERANCE, 0 otherwise or on error.
+*/
+static int check(const char* dir, const char* name, const double* X, int inputs, int outputs, check_batch batch){
+	double gen[CHECK_SAMPLES * 8];
+	char path[4096];
+	neural_network* nn;
+	Matrix *in, *out;
+	double diff, max_diff = 0;
+	int i, j;
+
+	if(outputs > 8 || sprintf(path, "%.4000s/%.80s.bin", dir, name) < 0)return 0;
+	nn = nload(path);
+	if(!nn){
+		fprintf(stderr, "Could not load %s\n", path);
+		return 0;
+	}
+
+	/* Both take one sample per row */
+	in = mnew(CHECK_SAMPLES, inputs);
+	if(!in){
+		nfree(nn);
+		return 0;
+	}
+	for(i = 0; i < CHECK_SAMPLES; i++){
+		for(j = 0; j < inputs; j++){
+			in->data[i][j] = X[i * inputs + j];
+		}
+	}
+	out = npred_rows(nn, in, NULL);
+	batch(CHECK_SAMPLES, X, gen);
+	if(!out || out->cols != outputs){
+		fprintf(stderr, "npred_rows failed on %s\n", path);
+		mfree(in);
+		mfree(out);
+		nfree(nn);
+		return 0;
+	}
+
+	for(i = 0; i < CHECK_SAMPLES; i++){
+		for(j = 0; j < outputs; j++){
+			diff = fabs(out->data[i][j] - gen[i * outputs + j]);
+			/* Also catches NaN */
+			if(!(diff <= max_diff))max_diff = diff;
+		}
+	}
+	mfree(in);
+	mfree(out);
+	nfree(nn);
+
+	printf("%s: largest difference from npred_rows %g\n", name, max_diff);
+	return max_diff <= CHECK_TOLERANCE;
+}
+
+int main(int argc, char** argv){
+	double wide_X[CHECK_SAMPLES][WIDE_INPUTS];
+	int i, j, ok;
+
+	if(argc != 2){
+		fprintf(stderr, "Usage: %s directory\n", argv[0]);
+		return 1;
+	}
+
+	for(i = 0; i < CHECK_SAMPLES; i++){
+		for(j = 0; j < WIDE_INPUTS; j++){
+			wide_X[i][j] = cos(0.9 * i - 1.3 * j);
+		}
+	}
+
+	ok = check(argv[1], "iris", &iris_X[0][0], IRIS_INPUTS, IRIS_OUTPUTS, iris_pred_batch);
+	ok = check(argv[1], "wide", &wide_X[0][0], WIDE_INPUTS, WIDE_OUTPUTS, wide_pred_batch) && ok;
+	if(!ok){
+		fprintf(stderr, "Generated executors do not match npred_rows\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include "../src/enn.h"
+#include "../src/nn.h"
+#include "../src/nfile.h"
+#include "../src/ngen.h"
+
+/* Generates a C executor specialized to a network saved with nsave(), see ngen().
+Usage: enn_codegen model.bin name directory (make codegen MODEL=model.bin NAME=name) */
+
+int main(int argc, char** argv){
+	neural_network* nn;
+	int ok;
+
+	if(argc != 4){
+		fprintf(stderr, "Usage: %s model.bin name directory\n", argv[0]);
+		return 1;
+	}
+	nn = nload(argv[1]);
+	if(!nn){
+		fprintf(stderr, "Could not load a network from %s\n", argv[1]);
+		return 1;
+	}
+	ok = ngen(nn, argv[2], argv[3]);
+	nfree(nn);
+	if(!ok){
+		fprintf(stderr, "Could not generate %s/%s.c and %s/%s.h\n", argv[3], argv[2], argv[3], argv[2]);
+		return 1;
+	}
+	printf("Wrote %s/%s.c and %s/%s.h\n", argv[3], argv[2], argv[3], argv[2]);
+	return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <math.h>
+#include "../src/enn.h"
+#include "../src/nn.h"
+#include "../src/nfile.h"
+#include "../src/ngen.h"
+
+/* Writes the networks make codegen-check generates executors for: the iris network of the tests, whose
+layers are unrolled, and a wider one whose middle layer has more than NGEN_UNROLL weights.
+Usage: enn_models directory */
+
+/* Weights and biases of the Keras iris model (see test/test.c) */
+static const double iris_w[3][4][4] = {
+	{
+		{-0.5206975, 0.5338802, -0.5602411, -0.09294045},
+		{-0.81646407, 0.07859222, 0.8910857, 0.9753645},
+		{0.0776132, -0.71796286, 1.0895936, 0.40837875},
+		{-0.46662232, 0.19200796, 0.38742024, -0.2863772}
+	},
+	{
+		{0.2019741, -0.71195257, -0.8410556, 0.6462495},
+		{-0.636823, 1.4791069, 0.25363532, -0.30699533},
+		{-0.7421215, 1.5144516, 0.48467913, 0.81691414},
+		{-0.62316686, -0.7518175, 0.7958357, -0.5908574}
+	},
+	{
+		{0.24331057, -1.0454109, -1.8839567, -1.2707748},
+		{-0.88661844, -1.3611857, 0.29023024, 1.1938326},
+		{0.01811641, 0.8420355, 0.980748, -0.07365165},
+		{0.0, 0.0, 0.0, 0.0}
+	}
+};
+static const double iris_b[3][4] = {
+	{0.0, -0.563959, -0.06092859, 0.0},
+	{0.0, -0.82546085, -0.3782354, -0.00169147},
+	{1.9372896, -0.7055002, -1.4840443, 0.0}
+};
+
+/**
+* Saves a network to directory/name.bin.
+*
+* @returns 1 on success, 0 on error.
+*/
+static int models_save(const neural_network* nn, const char* dir, const char* name){
+	char path[4096];
+
+	if(sprintf(path, "%.4000s/%.80s.bin", dir, name) < 0)return 0;
+	if(!nsave(nn, path)){
+		fprintf(stderr, "Could not save %s\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char** argv){
+	neural_network *iris, *wide;
+	int layer, row, col, ok;
+
+	if(argc != 2){
+		fprintf(stderr, "Usage: %s directory\n", argv[0]);
+		return 1;
+	}
+
+	iris = ninit(4, 2, 4, 3, arelu, asmax);
+	/* 48 x 48 weights in the middle layer, so it is generated as loops */
+	wide = ninit(4, 2, 48, 3, atnh, asmax);
+	if(!iris || !wide)return 1;
+
+	for(layer = 0; layer < 3; layer++){
+		for(row = 0; row < iris->weights[layer]->rows; row++){
+			for(col = 0; col < 4; col++){
+				iris->weights[layer]->data[row][col] = iris_w[layer][row][col];
+			}
+			iris->biases[layer]->data[row][0] = iris_b[layer][row];
+		}
+		for(row = 0; row < wide->weights[layer]->rows; row++){
+			for(col = 0; col < wide->weights[layer]->cols; col++){
+				wide->weights[layer]->data[row][col] = 0.5 * sin(1.7 * row + 0.3 * col + layer);
+			}
+			wide->biases[layer]->data[row][0] = 0.1 * cos(row + layer);
+		}
+	}
+
+	ok = models_save(iris, argv[1], "iris") && models_save(wide, argv[1], "wide");
+	nfree(iris);
+	nfree(wide);
+	return !ok;
+}
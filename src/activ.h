@@ -1,10 +1,44 @@
 #ifndef ACTIV_H
 #define ACTIV_H
+#include <stddef.h>
+#include "linalgf.h"
+/* Activation function IDs, stored in saved networks (see nfile.h), so they must never be renumbered */
+enum activ_id {ACTIV_NONE, ACTIV_RELU, ACTIV_LRELU, ACTIV_LIN, ACTIV_SIGM, ACTIV_SMAX, ACTIV_TANH, ACTIV_GELU,
+			   ACTIV_ELU};
+/* Elements the whole-buffer activations (see avec()) work on at a time, in a buffer on the stack */
+#define ACTIV_CHUNK 256
+/* An activation function over n contiguous doubles, out may be the same buffer as a */
+typedef void (*vfunc)(size_t n, const double* a, double* out);
+/* Directions for asmax2() */
+#define ASMAX_ROWS 0 /* Softmax of each row */
+#define ASMAX_COLS 1 /* Softmax of each column */
 double arelu(double x);
 double drelu(double output);
 double alrelu(double x);
+double dlrelu(double output);
 double alin(double x);
+double dlin(double output);
 double asigm(double x);
-double dsigm(double x);
+double dsigm(double output);
+double atnh(double x);
+double dtnh(double output);
+double agelu(double x);
+double aelu(double x);
+double delu(double output);
+dfunc aderiv(dfunc activ);
 Matrix* asmax(const Matrix* a);
+void asmaxc(Matrix* a);
+Matrix* asmax2(const Matrix* a, int axis, Matrix* out);
+float areluf(float x);
+float alreluf(float x);
+float alinf(float x);
+float asigmf(float x);
+float atnhf(float x);
+float ageluf(float x);
+float aeluf(float x);
+ffunc afloat(dfunc activ);
+vfunc avec(dfunc activ);
+int aid(dfunc activ);
+dfunc abyid(int id);
+void asmaxcf(Matrixf* a);
 #endif
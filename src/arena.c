@@ -0,0 +1,203 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <pthread.h>
+#include "enn.h"
+#include "linalg.h"
+#include "arena.h"
+
+/* Arena allocator. An arena is a chain of blocks, each filled from the front; allocating is bumping an
+offset, and freeing is moving the offset back. Restoring a mark only rewinds the current block: later
+blocks are rewound when the allocator reaches them again, so both reset and restore are O(1).
+
+Every thread has an active arena (NULL by default). While one is active, mnew() takes its matrices from
+it and mfree() leaves them alone, so whole computations can be cleaned up with a single restore. */
+
+struct arena_block {
+	struct arena_block* next;
+	size_t size; /* Usable bytes at base */
+	size_t used;
+	char* base; /* Aligned to ENN_ALIGN bytes */
+};
+
+struct arena {
+	struct arena_block* first;
+	struct arena_block* current; /* The block allocations are made from */
+};
+
+/* The arena mnew() allocates from on this thread */
+static ENN_TLS arena* arena_active = NULL;
+/* This thread's scratch arena, also registered with arena_key so it is freed when the thread exits */
+static ENN_TLS arena* arena_thread_scratch = NULL;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+/**
+* Allocates a block with size usable bytes, or NULL on error.
+*/
+static struct arena_block* arena_block_new(size_t size){
+	struct arena_block* block = malloc(sizeof(struct arena_block) + ENN_ALIGN - 1 + size);
+
+	if(!block)return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	block->base = (char*)(((size_t)(block + 1) + ENN_ALIGN - 1) & ~(size_t)(ENN_ALIGN - 1));
+	return block;
+}
+
+/**
+* Creates an arena.
+*
+* @param size Size in bytes of the first block, or 0 for ARENA_BLOCK. The arena grows as needed.
+*
+* @returns A pointer to the arena, or NULL on error.
+*/
+arena* arena_new(size_t size){
+	arena* a = malloc(sizeof(arena));
+
+	if(!a)return NULL;
+	a->first = arena_block_new(size ? size : ARENA_BLOCK);
+	if(!a->first){
+		free(a);
+		return NULL;
+	}
+	a->current = a->first;
+	return a;
+}
+
+/**
+* Frees an arena and everything allocated from it.
+*
+* @param a A pointer to the arena to free.
+*/
+void arena_free(arena* a){
+	struct arena_block *block, *next;
+
+	if(!a)return;
+	if(arena_active == a)arena_active = NULL;
+	for(block = a->first; block; block = next){
+		next = block->next;
+		free(block);
+	}
+	free(a);
+}
+
+/**
+* Allocates memory from an arena. The memory is aligned to ENN_ALIGN bytes and stays valid until the
+* arena is reset, restored to a mark saved before the allocation, or freed.
+*
+* @param a A pointer to the arena.
+* @param size Number of bytes.
+*
+* @returns A pointer to the memory, or NULL on error.
+*/
+void* arena_alloc(arena* a, size_t size){
+	struct arena_block* block;
+	char* ptr;
+
+	if(!a)return NULL;
+	/* Keep every allocation aligned */
+	size = (size + ENN_ALIGN - 1) & ~(size_t)(ENN_ALIGN - 1);
+
+	/* Move on to the next block (appending one twice as large at the end of the chain) until one fits */
+	block = a->current;
+	while(block->size - block->used < size){
+		if(!block->next){
+			block->next = arena_block_new(block->size * 2 > size ? block->size * 2 : size);
+			if(!block->next)return NULL;
+		}
+		block = block->next;
+		block->used = 0;
+	}
+
+	a->current = block;
+	ptr = block->base + block->used;
+	block->used += size;
+	return ptr;
+}
+
+/**
+* Saves the current position of an arena, to give back everything allocated after it with
+* arena_restore().
+*
+* @param a A pointer to the arena.
+*
+* @returns The mark.
+*/
+arena_mark arena_save(const arena* a){
+	arena_mark mark;
+
+	mark.block = a->current;
+	mark.used = a->current->used;
+	return mark;
+}
+
+/**
+* Gives back everything allocated from an arena since a mark was saved. Marks must be restored in the
+* reverse order they were saved in.
+*
+* @param a A pointer to the arena.
+* @param mark A mark from arena_save() on the same arena.
+*/
+void arena_restore(arena* a, arena_mark mark){
+	if(!a || !mark.block)return;
+	a->current = mark.block;
+	a->current->used = mark.used;
+}
+
+/**
+* Gives back everything allocated from an arena. The blocks are kept for the next allocations.
+*
+* @param a A pointer to the arena.
+*/
+void arena_reset(arena* a){
+	if(!a)return;
+	a->current = a->first;
+	a->current->used = 0;
+}
+
+/**
+* Makes mnew() on the calling thread allocate from an arena.
+*
+* @param a A pointer to the arena, or NULL to go back to malloc.
+*
+* @returns The arena that was active before, to pass back to arena_use() when done.
+*/
+arena* arena_use(arena* a){
+	arena* previous = arena_active;
+	arena_active = a;
+	return previous;
+}
+
+/**
+* Returns the arena mnew() allocates from on the calling thread, or NULL if it uses malloc.
+*/
+arena* arena_current(void){
+	return arena_active;
+}
+
+/**
+* Thread exit destructor for the scratch arenas.
+*/
+static void arena_scratch_destroy(void* a){
+	arena_free(a);
+}
+
+static void arena_key_create(void){
+	pthread_key_create(&arena_key, arena_scratch_destroy);
+}
+
+/**
+* Returns the calling thread's scratch arena, creating it on first use. Library functions use it for
+* their temporaries, always between arena_save() and arena_restore(), so it can be shared by nested
+* calls. It is freed when the thread exits.
+*
+* @returns A pointer to the arena, or NULL on error.
+*/
+arena* arena_scratch(void){
+	if(arena_thread_scratch)return arena_thread_scratch;
+	pthread_once(&arena_key_once, arena_key_create);
+	arena_thread_scratch = arena_new(ARENA_BLOCK);
+	if(arena_thread_scratch)pthread_setspecific(arena_key, arena_thread_scratch);
+	return arena_thread_scratch;
+}
@@ -0,0 +1,28 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+/* Size in bytes of the first block of a thread's scratch arena */
+#define ARENA_BLOCK 65536
+
+/* A bump allocator: memory is handed out from large blocks in order and given back all at once, by
+resetting the arena or restoring it to a saved mark. Blocks are kept for reuse until arena_free() */
+typedef struct arena arena;
+struct arena_block;
+
+/* A position in an arena, from arena_save() */
+struct arena_mark {
+	struct arena_block* block;
+	size_t used;
+};
+typedef struct arena_mark arena_mark;
+
+arena* arena_new(size_t size);
+void arena_free(arena* a);
+void* arena_alloc(arena* a, size_t size);
+arena_mark arena_save(const arena* a);
+void arena_restore(arena* a, arena_mark mark);
+void arena_reset(arena* a);
+arena* arena_use(arena* a);
+arena* arena_current(void);
+arena* arena_scratch(void);
+#endif
@@ -0,0 +1,651 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "enn.h"
+#include "linalg.h"
+#include "dataset.h"
+
+/* Streaming datasets. A dataset is read DATASET_CHUNK bytes at a time by a prefetch thread, which parses
+the samples straight into a ring of DATASET_DEPTH preallocated batch matrices while the caller works on
+the previous batch. Memory use is bounded by the batch size and the chunk size (plus the longest line),
+never by the size of the file.
+
+Preparing a batch for training (normalizing the inputs, shuffling through a window of samples) is done
+on the prefetch thread too, so the consumer only ever waits when reading and preparing the data is
+slower than what it does with a batch. dsstats() tells which side waits. */
+
+#define DATASET_BYTE_ORDER 0x01020304
+
+struct dataset {
+	FILE* file;
+	long data_start; /* Offset of the first sample in the file */
+	int format;
+	int inputs;
+	int outputs;
+	int batch;
+
+	/* Read buffer, only touched by the prefetch thread: bytes [pos, len) are not parsed yet, and
+	chunk[len] is always NUL so the last line of the file is terminated too */
+	char* chunk;
+	size_t size, pos, len;
+	int eof; /* The rest of the file is in the buffer */
+	int error; /* A read or allocation failed */
+	long line; /* Lines read so far */
+
+	/* Batch preparation on the prefetch thread, see dsnormalize() and dsshuffle() */
+	double* shift; /* Subtracted from each input, NULL for none */
+	double* scale; /* Then each input is multiplied by this */
+	int window; /* Shuffle window in samples, 0 for none */
+	Matrix *pool_X, *pool_Y; /* The samples in the window */
+	int pooled; /* Number of samples in the window */
+	int drained; /* The file has been read to the end into the window */
+	unsigned long state; /* State of the shuffle's random number generator */
+
+	/* The ring of batches. The prefetch thread fills slot (head + ready) % DATASET_DEPTH, dsnext() hands
+	out slot head, and the slot handed out last (held) is not refilled until the next dsnext() */
+	Matrix* X[DATASET_DEPTH];
+	Matrix* Y[DATASET_DEPTH];
+	int rows[DATASET_DEPTH]; /* Samples in each filled batch, 0 at the end of the file, -1 on error */
+	int head, ready, held;
+	int finished, last; /* The end was handed out, and what dsnext() returns from then on */
+	Matrix views[2]; /* The views of slot held returned by dsnext() */
+
+	dataset_stats stats;
+	int stop, running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled; /* Signalled when a batch is ready */
+	pthread_cond_t emptied; /* Signalled when a slot is free, or the thread should stop */
+};
+
+/* Powers of ten that are exact in double precision */
+static const double ds_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define DS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/**
+* The slow path of dsparse(): strtod() from start, with end set to text if there is no number.
+*/
+static double ds_strtod(const char* text, const char* start, char** end){
+	char* stop;
+	double value = strtod(start, &stop);
+
+	if(end)*end = (stop == start) ? (char*)text : stop;
+	return value;
+}
+
+/**
+* Parses a decimal number, like strtod(). Numbers of at most 15 significant digits and a decimal
+* exponent of at most 22 (which covers nearly all data files) are converted with one exact integer and
+* one multiplication or division by an exact power of ten, which rounds correctly. Anything else is
+* handed to strtod().
+*
+* @param text The text to parse. Leading spaces and tabs are skipped.
+* @param end Set to the first character after the number, or to text if there is none (optional).
+*
+* @returns The number, or 0 if there is none.
+*/
+double dsparse(const char* text, char** end){
+	const char *p = text, *start;
+	double mantissa = 0.0, value;
+	int digits = 0, exponent = 0, scale = 0, negative = 0, exp_negative = 0, any = 0;
+
+	while(*p == ' ' || *p == '\t')p++;
+	start = p;
+	if(*p == '-' || *p == '+')negative = *p++ == '-';
+	for(; DS_DIGIT(*p); p++, any = 1){
+		if(mantissa == 0.0 && *p == '0')continue;
+		mantissa = mantissa * 10.0 + (*p - '0');
+		digits++;
+	}
+	if(*p == '.'){
+		for(p++; DS_DIGIT(*p); p++, any = 1){
+			scale--;
+			if(mantissa == 0.0 && *p == '0')continue;
+			mantissa = mantissa * 10.0 + (*p - '0');
+			digits++;
+		}
+	}
+	if(!any || digits > 15)return ds_strtod(text, start, end);
+
+	if((*p == 'e' || *p == 'E') && (DS_DIGIT(p[1]) || ((p[1] == '-' || p[1] == '+') && DS_DIGIT(p[2])))){
+		p++;
+		if(*p == '-' || *p == '+')exp_negative = *p++ == '-';
+		for(; DS_DIGIT(*p); p++){
+			if(exponent < 10000)exponent = exponent * 10 + (*p - '0');
+		}
+	}
+	scale += exp_negative ? -exponent : exponent;
+
+	if(mantissa == 0.0)value = 0.0;
+	else if(scale > 22 || scale < -22)return ds_strtod(text, start, end);
+	else value = (scale < 0) ? mantissa / ds_pow10[-scale] : mantissa * ds_pow10[scale];
+
+	if(end)*end = (char*)p;
+	return negative ? -value : value;
+}
+
+/**
+* Returns the next line of the file, NUL terminated, reading more of the file into the buffer as
+* needed, or NULL at the end of the file or on error.
+*/
+static char* ds_line(dataset* ds){
+	size_t n;
+
+	for(;;){
+		char* start = ds->chunk + ds->pos;
+		char* newline = memchr(start, '\n', ds->len - ds->pos);
+		if(newline){
+			*newline = '\0';
+			ds->pos = newline - ds->chunk + 1;
+			ds->line++;
+			return start;
+		}
+		if(ds->eof){
+			if(ds->pos == ds->len)return NULL;
+			ds->pos = ds->len;
+			ds->line++;
+			return start;
+		}
+
+		/* Move the partial line to the front, growing the buffer if it is longer than the buffer */
+		memmove(ds->chunk, start, ds->len - ds->pos);
+		ds->len -= ds->pos;
+		ds->pos = 0;
+		if(ds->len == ds->size){
+			char* grown = realloc(ds->chunk, ds->size * 2 + 1);
+			if(!grown){
+				ds->error = 1;
+				return NULL;
+			}
+			ds->chunk = grown;
+			ds->size *= 2;
+		}
+		n = fread(ds->chunk + ds->len, 1, ds->size - ds->len, ds->file);
+		if(n < ds->size - ds->len){
+			ds->eof = 1;
+			if(ferror(ds->file))ds->error = 1;
+		}
+		ds->len += n;
+		ds->chunk[ds->len] = '\0';
+	}
+}
+
+/**
+* Parses one CSV line into row row of X and Y.
+*
+* @returns 1 for a sample, 0 for a line to skip (blank, or a header as the first line), -1 on error.
+*/
+static int ds_csv_row(const dataset* ds, char* line, Matrix* X, Matrix* Y, int row){
+	char *p = line, *end;
+	int col;
+
+	while(*p == ' ' || *p == '\t' || *p == '\r')p++;
+	if(!*p)return 0;
+	for(col = 0; col < ds->inputs + ds->outputs; col++){
+		double value = dsparse(p, &end);
+		if(end == p)return (ds->line == 1 && col == 0) ? 0 : -1;
+		if(col < ds->inputs)X->data[row][col] = value;
+		else Y->data[row][col - ds->inputs] = value;
+		for(p = end; *p == ' ' || *p == '\t'; p++);
+		if(col < ds->inputs + ds->outputs - 1){
+			if(*p != ',')return -1;
+			p++;
+		}
+	}
+	while(*p == ' ' || *p == '\t' || *p == '\r')p++;
+	return *p ? -1 : 1;
+}
+
+/**
+* Reads up to count samples from a CSV file into rows first, first + 1, ... of X and Y.
+*
+* @returns The number of samples read, or -1 on error.
+*/
+static int ds_csv_read(dataset* ds, Matrix* X, Matrix* Y, int first, int count){
+	char* line;
+	int row = 0, status;
+
+	while(row < count && (line = ds_line(ds))){
+		status = ds_csv_row(ds, line, X, Y, first + row);
+		if(status < 0)return -1;
+		row += status;
+	}
+	return ds->error ? -1 : row;
+}
+
+/**
+* Reads up to count samples from a binary row file into rows first, first + 1, ... of X and Y, as many
+* rows at a time as fit in the buffer.
+*
+* @returns The number of samples read, or -1 on error.
+*/
+static int ds_binary_read(dataset* ds, Matrix* X, Matrix* Y, int first, int count){
+	size_t width = ds->inputs + ds->outputs, per_chunk = ds->size / (width * sizeof(double)), want, n, i;
+	const double* values;
+	int row = first;
+
+	while(row < first + count){
+		want = (size_t)(first + count - row) < per_chunk ? (size_t)(first + count - row) : per_chunk;
+		n = fread(ds->chunk, width * sizeof(double), want, ds->file);
+		values = (const double*)ds->chunk;
+		for(i = 0; i < n; i++, row++, values += width){
+			memcpy(X->data[row], values, ds->inputs * sizeof(double));
+			memcpy(Y->data[row], values + ds->inputs, ds->outputs * sizeof(double));
+		}
+		if(n < want)return ferror(ds->file) ? -1 : row - first;
+	}
+	return count;
+}
+
+/**
+* Reads up to count samples from the file into rows first, first + 1, ... of X and Y.
+*
+* @returns The number of samples read, or -1 on error.
+*/
+static int ds_read(dataset* ds, Matrix* X, Matrix* Y, int first, int count){
+	return (ds->format == DATASET_CSV) ? ds_csv_read(ds, X, Y, first, count) : ds_binary_read(ds, X, Y, first, count);
+}
+
+/**
+* Tops the shuffle window up from the file.
+*
+* @returns 1 on success, 0 on error.
+*/
+static int ds_refill(dataset* ds){
+	int rows;
+
+	if(ds->drained || ds->pooled == ds->window)return 1;
+	rows = ds_read(ds, ds->pool_X, ds->pool_Y, ds->pooled, ds->window - ds->pooled);
+	if(rows < 0)return 0;
+	if(rows < ds->window - ds->pooled)ds->drained = 1;
+	ds->pooled += rows;
+	return 1;
+}
+
+/**
+* Fills a batch: reads it from the file, or with a shuffle window draws each sample at random from the
+* window and reads the next sample of the file into its place, then normalizes the inputs.
+*
+* @returns The number of samples in the batch, less than the batch size only at the end of the file, or
+* -1 on error.
+*/
+static int ds_fill(dataset* ds, Matrix* X, Matrix* Y){
+	int rows, row, col, pick;
+
+	if(!ds->window)rows = ds_read(ds, X, Y, 0, ds->batch);
+	else{
+		for(rows = 0; rows < ds->batch; rows++){
+			if((rows == 0 || ds->pooled == 0) && !ds_refill(ds))return -1;
+			if(ds->pooled == 0)break;
+			/* Linear congruential generator, as in ntrain() */
+			ds->state = ds->state * 1103515245UL + 12345UL;
+			pick = (int)((ds->state >> 16) % (unsigned long)ds->pooled);
+			ds->pooled--;
+			memcpy(X->data[rows], ds->pool_X->data[pick], ds->inputs * sizeof(double));
+			memcpy(Y->data[rows], ds->pool_Y->data[pick], ds->outputs * sizeof(double));
+			memcpy(ds->pool_X->data[pick], ds->pool_X->data[ds->pooled], ds->inputs * sizeof(double));
+			memcpy(ds->pool_Y->data[pick], ds->pool_Y->data[ds->pooled], ds->outputs * sizeof(double));
+		}
+	}
+
+	for(row = 0; ds->shift && row < rows; row++){
+		double* x = X->data[row];
+		for(col = 0; col < ds->inputs; col++){
+			x[col] = (x[col] - ds->shift[col]) * ds->scale[col];
+		}
+	}
+	return rows;
+}
+
+/**
+* The prefetch thread: fills free slots of the ring until the end of the file, an error, or ds_stop().
+*/
+static void* ds_prefetch(void* arg){
+	dataset* ds = arg;
+	int slot, rows;
+
+	for(;;){
+		pthread_mutex_lock(&ds->lock);
+		if(ds->ready + (ds->held >= 0) >= DATASET_DEPTH)ds->stats.idle++;
+		while(!ds->stop && ds->ready + (ds->held >= 0) >= DATASET_DEPTH){
+			pthread_cond_wait(&ds->emptied, &ds->lock);
+		}
+		if(ds->stop){
+			pthread_mutex_unlock(&ds->lock);
+			break;
+		}
+		slot = (ds->head + ds->ready) % DATASET_DEPTH;
+		pthread_mutex_unlock(&ds->lock);
+
+		rows = ds_fill(ds, ds->X[slot], ds->Y[slot]);
+
+		pthread_mutex_lock(&ds->lock);
+		ds->rows[slot] = rows;
+		ds->ready++;
+		pthread_cond_signal(&ds->filled);
+		pthread_mutex_unlock(&ds->lock);
+		if(rows < ds->batch)break;
+	}
+	return NULL;
+}
+
+/**
+* Returns a monotonic time in seconds.
+*/
+static double ds_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+* Starts prefetching from the first sample of the file.
+*
+* @returns 1 on success, 0 on error.
+*/
+static int ds_start(dataset* ds){
+	ds->pos = ds->len = 0;
+	ds->chunk[0] = '\0';
+	ds->eof = ds->error = 0;
+	ds->line = 0;
+	ds->head = ds->ready = 0;
+	ds->held = -1;
+	ds->finished = 0;
+	ds->pooled = 0;
+	ds->drained = 0;
+	ds->stop = 0;
+	if(fseek(ds->file, ds->data_start, SEEK_SET) != 0)return 0;
+	ds->running = pthread_create(&ds->thread, NULL, ds_prefetch, ds) == 0;
+	return ds->running;
+}
+
+/**
+* Stops the prefetch thread.
+*/
+static void ds_stop(dataset* ds){
+	if(!ds->running)return;
+	pthread_mutex_lock(&ds->lock);
+	ds->stop = 1;
+	pthread_cond_signal(&ds->emptied);
+	pthread_mutex_unlock(&ds->lock);
+	pthread_join(ds->thread, NULL);
+	ds->running = 0;
+}
+
+/**
+* Opens a dataset file for streaming and starts prefetching its first batches.
+*
+* @param path The file to read.
+* @param format DATASET_CSV or DATASET_BINARY.
+* @param inputs Number of inputs per sample (the first values of each row).
+* @param outputs Number of desired outputs per sample (the values after the inputs), may be 0.
+* @param batch Maximum number of samples per batch.
+*
+* @returns A pointer to the dataset, or NULL on error or if a binary file has another shape.
+*/
+dataset* dsopen(const char* path, int format, int inputs, int outputs, int batch){
+	dataset* ds;
+	size_t row_size = (size_t)(inputs + outputs) * sizeof(double);
+	int slot, ok;
+
+	if(!path || inputs < 1 || outputs < 0 || batch < 1 || (format != DATASET_CSV && format != DATASET_BINARY))
+		return NULL;
+	ds = calloc(1, sizeof(dataset));
+	if(!ds)return NULL;
+	pthread_mutex_init(&ds->lock, NULL);
+	pthread_cond_init(&ds->filled, NULL);
+	pthread_cond_init(&ds->emptied, NULL);
+	ds->format = format;
+	ds->inputs = inputs;
+	ds->outputs = outputs;
+	ds->batch = batch;
+	ds->size = (row_size > DATASET_CHUNK) ? row_size : DATASET_CHUNK;
+	ds->chunk = malloc(ds->size + 1);
+	ds->file = fopen(path, "rb");
+	ok = ds->chunk && ds->file;
+
+	/* A binary file must hold whole rows of the given shape */
+	if(ok && format == DATASET_BINARY){
+		dataset_header header;
+		long end;
+		ok = fread(&header, sizeof(header), 1, ds->file) == 1 && !memcmp(header.magic, DATASET_MAGIC, 8)
+			 && header.version == DATASET_VERSION && header.byte_order == DATASET_BYTE_ORDER
+			 && header.value_size == sizeof(double) && header.inputs == inputs && header.outputs == outputs;
+		ds->data_start = sizeof(header);
+		ok = ok && fseek(ds->file, 0, SEEK_END) == 0 && (end = ftell(ds->file)) >= ds->data_start
+			 && (size_t)(end - ds->data_start) % row_size == 0;
+	}
+	for(slot = 0; ok && slot < DATASET_DEPTH; slot++){
+		ds->X[slot] = mnew(batch, inputs);
+		ds->Y[slot] = mnew(batch, outputs);
+		ok = ds->X[slot] && ds->Y[slot];
+	}
+	if(!ok || !ds_start(ds)){
+		dsclose(ds);
+		return NULL;
+	}
+
+	return ds;
+}
+
+/**
+* Takes the next batch of a dataset, waiting for the prefetch thread if it is not ready yet. The batch
+* stays valid until the next call to dsnext(), dsrewind() or dsclose(), and the slot it was in is then
+* refilled.
+*
+* @param ds A pointer to the dataset.
+* @param X Set to the inputs of the batch, one sample per row (samples x inputs).
+* @param Y Set to the desired outputs of the batch, one sample per row (samples x outputs).
+*
+* @returns The number of samples in the batch (less than the batch size only for the last batch), 0 at
+* the end of the dataset, or -1 on error (such as a malformed line).
+*/
+int dsnext(dataset* ds, const Matrix** X, const Matrix** Y){
+	int slot, rows;
+
+	if(!ds || !X || !Y)return -1;
+	pthread_mutex_lock(&ds->lock);
+	if(ds->held >= 0){
+		ds->held = -1;
+		pthread_cond_signal(&ds->emptied);
+	}
+	if(ds->finished || (!ds->ready && !ds->running)){
+		pthread_mutex_unlock(&ds->lock);
+		return ds->finished ? ds->last : -1;
+	}
+	if(!ds->ready){
+		double start = ds_now();
+		ds->stats.stalls++;
+		while(!ds->ready){
+			pthread_cond_wait(&ds->filled, &ds->lock);
+		}
+		ds->stats.stall_seconds += ds_now() - start;
+	}
+	slot = ds->head;
+	ds->head = (ds->head + 1) % DATASET_DEPTH;
+	ds->ready--;
+	rows = ds->rows[slot];
+	if(rows < ds->batch){
+		ds->finished = 1;
+		ds->last = (rows < 0) ? -1 : 0;
+	}
+	if(rows > 0){
+		ds->held = slot;
+		ds->stats.batches++;
+	}
+	pthread_mutex_unlock(&ds->lock);
+	if(rows <= 0)return rows;
+
+	*X = mrows(ds->X[slot], 0, rows, &ds->views[0]);
+	*Y = mrows(ds->Y[slot], 0, rows, &ds->views[1]);
+	return rows;
+}
+
+/**
+* Goes back to the first sample of a dataset, e.g. for the next epoch.
+*
+* @param ds A pointer to the dataset.
+*
+* @returns 1 on success, 0 on error.
+*/
+int dsrewind(dataset* ds){
+	if(!ds)return 0;
+	ds_stop(ds);
+	return ds_start(ds);
+}
+
+/**
+* Normalizes the inputs of every sample from now on, x' = (x - shift) * scale per input, on the prefetch
+* thread. Typically shift is the mean and scale is 1 / standard deviation of each input over the
+* training set. Batches that were already prefetched are discarded and the dataset is rewound.
+*
+* @param ds A pointer to the dataset.
+* @param shift The values to subtract (1 x inputs), or NULL to stop normalizing.
+* @param scale The values to multiply by (1 x inputs), or NULL to stop normalizing.
+*
+* @returns 1 on success, 0 on error.
+*/
+int dsnormalize(dataset* ds, const Matrix* shift, const Matrix* scale){
+	int col;
+
+	if(!ds || (shift && (shift->rows != 1 || shift->cols != ds->inputs))
+	   || (scale && (scale->rows != 1 || scale->cols != ds->inputs)) || !shift != !scale)return 0;
+	ds_stop(ds);
+	free(ds->shift);
+	ds->shift = NULL;
+	ds->scale = NULL;
+	if(shift){
+		ds->shift = malloc(2 * ds->inputs * sizeof(double));
+		if(!ds->shift){
+			ds_start(ds);
+			return 0;
+		}
+		ds->scale = ds->shift + ds->inputs;
+		for(col = 0; col < ds->inputs; col++){
+			ds->shift[col] = shift->data[0][col];
+			ds->scale[col] = scale->data[0][col];
+		}
+	}
+	return ds_start(ds);
+}
+
+/**
+* Shuffles the samples from now on, on the prefetch thread: the thread keeps a window of samples from
+* the file and fills each batch with samples drawn at random from it, reading the next sample of the
+* file into the place of each. A sample can move at most window places ahead, but no further, so the
+* window should be large compared to the batch size; the whole file never has to fit in memory. Each
+* pass over the file is shuffled differently. Batches that were already prefetched are discarded and
+* the dataset is rewound.
+*
+* @param ds A pointer to the dataset.
+* @param window Number of samples in the window, 0 to stop shuffling.
+* @param seed Seed for the shuffle.
+*
+* @returns 1 on success, 0 on error.
+*/
+int dsshuffle(dataset* ds, int window, unsigned long seed){
+	if(!ds || window < 0)return 0;
+	ds_stop(ds);
+	mfree(ds->pool_X);
+	mfree(ds->pool_Y);
+	ds->pool_X = ds->pool_Y = NULL;
+	ds->window = 0;
+	if(window){
+		ds->pool_X = mnew(window, ds->inputs);
+		ds->pool_Y = mnew(window, ds->outputs);
+		if(!ds->pool_X || !ds->pool_Y){
+			ds_start(ds);
+			return 0;
+		}
+		ds->window = window;
+		ds->state = seed;
+	}
+	return ds_start(ds);
+}
+
+/**
+* Reads the prefetching counters of a dataset.
+*
+* @param ds A pointer to the dataset.
+* @param stats Pointer to the counters to fill in.
+*/
+void dsstats(dataset* ds, dataset_stats* stats){
+	if(!ds || !stats)return;
+	pthread_mutex_lock(&ds->lock);
+	*stats = ds->stats;
+	pthread_mutex_unlock(&ds->lock);
+}
+
+/**
+* Returns the maximum number of samples per batch of a dataset, as given to dsopen(), or 0 if ds is NULL.
+*/
+int dsbatch(const dataset* ds){
+	return ds ? ds->batch : 0;
+}
+
+/**
+* Stops reading a dataset and frees it.
+*
+* @param ds A pointer to the dataset to close.
+*/
+void dsclose(dataset* ds){
+	int slot;
+
+	if(!ds)return;
+	ds_stop(ds);
+	for(slot = 0; slot < DATASET_DEPTH; slot++){
+		mfree(ds->X[slot]);
+		mfree(ds->Y[slot]);
+	}
+	mfree(ds->pool_X);
+	mfree(ds->pool_Y);
+	if(ds->file)fclose(ds->file);
+	free(ds->chunk);
+	free(ds->shift);
+	pthread_mutex_destroy(&ds->lock);
+	pthread_cond_destroy(&ds->filled);
+	pthread_cond_destroy(&ds->emptied);
+	free(ds);
+}
+
+/**
+* Writes samples to a packed binary row file, which dsopen() reads without parsing.
+*
+* @param path The file to (over)write.
+* @param X The inputs, one sample per row (samples x inputs).
+* @param Y The desired outputs, one sample per row (samples x outputs), or NULL for none.
+*
+* @returns 1 on success, 0 on error.
+*/
+int dssave(const char* path, const Matrix* X, const Matrix* Y){
+	dataset_header header;
+	FILE* file;
+	int row, ok;
+
+	if(!path || !X || (Y && Y->rows != X->rows))return 0;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+	header.version = DATASET_VERSION;
+	header.byte_order = DATASET_BYTE_ORDER;
+	header.inputs = X->cols;
+	header.outputs = Y ? Y->cols : 0;
+	header.value_size = sizeof(double);
+
+	file = fopen(path, "wb");
+	if(!file)return 0;
+	ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for(row = 0; ok && row < X->rows; row++){
+		ok = fwrite(X->data[row], sizeof(double), X->cols, file) == (size_t)X->cols
+			 && (!Y || fwrite(Y->data[row], sizeof(double), Y->cols, file) == (size_t)Y->cols);
+	}
+	if(fclose(file) != 0)ok = 0;
+
+	return ok;
+}
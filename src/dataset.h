@@ -0,0 +1,52 @@
+#ifndef DATASET_H
+#define DATASET_H
+#include "linalg.h"
+/* Bytes read from the file at a time */
+#define DATASET_CHUNK 65536
+/* Batches in flight: one being read by the caller, the others filled ahead by the prefetch thread */
+#define DATASET_DEPTH 3
+/* Packed binary row files, see dssave() */
+#define DATASET_MAGIC "ENNROWS"
+#define DATASET_VERSION 1
+
+/* Formats dsopen() reads */
+enum dataset_format {
+	DATASET_CSV, /* One sample per line, inputs then outputs, comma separated. A header line is skipped */
+	DATASET_BINARY /* A dataset_header, then one row of inputs + outputs doubles per sample */
+};
+
+/* The start of a packed binary row file */
+struct dataset_header {
+	char magic[8]; /* DATASET_MAGIC, NUL terminated */
+	int version; /* DATASET_VERSION */
+	int byte_order; /* 0x01020304 as written, files from a machine of another byte order are rejected */
+	int inputs;
+	int outputs;
+	int value_size; /* sizeof(double) */
+};
+typedef struct dataset_header dataset_header;
+
+/* A dataset streamed from a file in batches, see dsopen() */
+typedef struct dataset dataset;
+
+/* Counters of the prefetching of a dataset since dsopen(), see dsstats() */
+struct dataset_stats {
+	long batches; /* Batches handed out by dsnext() */
+	long stalls; /* dsnext() calls that had to wait for the prefetch thread: the consumer is input bound */
+	double stall_seconds; /* Time spent waiting in those calls */
+	long idle; /* Times the prefetch thread found no free slot: the consumer is compute bound */
+};
+typedef struct dataset_stats dataset_stats;
+
+dataset* dsopen(const char* path, int format, int inputs, int outputs, int batch);
+/* Batches hold one sample per row (samples x inputs), see npred_rows() */
+int dsnext(dataset* ds, const Matrix** X, const Matrix** Y);
+int dsrewind(dataset* ds);
+int dsnormalize(dataset* ds, const Matrix* shift, const Matrix* scale);
+int dsshuffle(dataset* ds, int window, unsigned long seed);
+void dsstats(dataset* ds, dataset_stats* stats);
+int dsbatch(const dataset* ds);
+void dsclose(dataset* ds);
+int dssave(const char* path, const Matrix* X, const Matrix* Y);
+double dsparse(const char* text, char** end);
+#endif
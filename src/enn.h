@@ -7,6 +7,12 @@
 #else
 #define UNUSED_VAR
 #endif
+/* Thread local storage class, for per-thread scratch buffers */
+#ifdef __GNUC__
+#define ENN_TLS __thread
+#else
+#define ENN_TLS
+#endif
 static const char* UNUSED_VAR check_if_fmt = "**** Assertion <%s> failed at %s:%d ****\n";
 /* Source https://ocw.cs.pub.ro/courses/so/laboratoare/resurse/die */
 #define ASSERTM(assertion, msg)				\
@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include "enn.h"
+#include "gemm.h"
+#include "simd.h"
+#include "pool.h"
+#include "arena.h"
+#ifdef ENN_BLAS
+#include <cblas.h>
+#endif
+
+/* Cache-blocked matrix multiplication, following the layout of Goto and van de Geijn,
+"Anatomy of High-Performance Matrix Multiplication" (2008).
+C is split into NC wide column blocks, the shared dimension into KC deep slices and A into MC tall
+row blocks. Each block of A and B is copied ("packed") into a buffer laid out in exactly the order
+the micro-kernel reads it, so the innermost loop only ever walks memory sequentially.
+Transposed operands are handled while packing, by reading them in the transposed order, so a product
+like A^T * B never needs a transposed copy of A. */
+
+#ifdef ENN_BLAS
+/* Nonzero while large multiplications go to the external BLAS, see gemm_set_blas() */
+static int gemm_blas_enabled = 1;
+#endif
+
+/* Element (i, p) of op(A), where A is stored row-major with leading dimension lda */
+#define GEMM_AT(a, lda, trans, i, p) ((trans) ? (a)[(size_t)(p) * (lda) + (i)] : (a)[(size_t)(i) * (lda) + (p)])
+
+/**
+* Copies an mc x kc block of op(A) into MR row panels. Within a panel, the MR values of each column
+* are stored next to each other. Rows past mc are padded with zeros.
+*/
+static void gemm_pack_a(int transa, int mc, int kc, const double* a, int lda, double* pa){
+	int i0, i, p;
+
+	for(i0 = 0; i0 < mc; i0 += GEMM_MR){
+		for(p = 0; p < kc; p++){
+			for(i = 0; i < GEMM_MR; i++){
+				*pa++ = (i0 + i < mc) ? GEMM_AT(a, lda, transa, i0 + i, p) : 0.0;
+			}
+		}
+	}
+}
+
+/**
+* Copies a kc x nc block of op(B) into NR column panels. Within a panel, the NR values of each row
+* are stored next to each other. Columns past nc are padded with zeros.
+*/
+static void gemm_pack_b(int transb, int kc, int nc, const double* b, int ldb, double* pb){
+	int j0, j, p;
+
+	for(j0 = 0; j0 < nc; j0 += GEMM_NR){
+		for(p = 0; p < kc; p++){
+			if(transb){
+				for(j = 0; j < GEMM_NR; j++){
+					*pb++ = (j0 + j < nc) ? b[(size_t)(j0 + j) * ldb + p] : 0.0;
+				}
+			}
+			else{
+				const double* brow = b + (size_t)p * ldb + j0;
+				for(j = 0; j < GEMM_NR; j++){
+					*pb++ = (j0 + j < nc) ? brow[j] : 0.0;
+				}
+			}
+		}
+	}
+}
+
+/**
+* Applies an epilogue to one row of C.
+*
+* @param ep The epilogue.
+* @param crow The first element to update.
+* @param row Row of C that crow is in.
+* @param col Column of C that crow points to.
+* @param n Number of elements to update.
+*/
+static void gemm_epilogue_row(const gemm_epilogue* ep, double* crow, int row, int col, int n){
+	int j;
+
+	if(ep->bias){
+		double bias = ep->bias[(size_t)row * ep->bias_stride];
+		for(j = 0; j < n; j++)crow[j] += bias;
+	}
+	if(ep->vactiv){
+		ep->vactiv(n, crow, crow);
+	}
+	else if(ep->activ){
+		for(j = 0; j < n; j++)crow[j] = ep->activ(crow[j]);
+	}
+	if(ep->deriv){
+		const double* srow = ep->scale + (size_t)row * ep->ldscale + col;
+		for(j = 0; j < n; j++)crow[j] *= ep->deriv(srow[j]);
+	}
+}
+
+/**
+* Writes (or adds) the valid mr x nr part of an accumulated tile to C, then applies the epilogue (if any)
+* while the tile is still in L1.
+*/
+static void gemm_store(double acc[GEMM_MR][GEMM_NR], double* c, int ldc, int mr, int nr, int first,
+					   const gemm_epilogue* ep, int row, int col){
+	int i, j;
+
+	for(i = 0; i < mr; i++){
+		double* crow = c + (size_t)i * ldc;
+		for(j = 0; j < nr; j++){
+			crow[j] = first ? acc[i][j] : crow[j] + acc[i][j];
+		}
+		if(ep)gemm_epilogue_row(ep, crow, row + i, col, nr);
+	}
+}
+
+/**
+* Micro-kernel: multiplies an MR x kc panel of A by a kc x NR panel of B. The MR x NR tile of C
+* is accumulated in local variables (registers) and only written once at the end.
+*
+* @param kc Depth of the panels.
+* @param pa Packed panel of A.
+* @param pb Packed panel of B.
+* @param c Top left of the tile of C.
+* @param ldc Row stride of C.
+* @param mr Number of valid rows in the tile (<= MR).
+* @param nr Number of valid columns in the tile (<= NR).
+* @param first If nonzero, C is overwritten, otherwise the tile is added to C.
+* @param ep Epilogue to apply to the finished tile, NULL if none or if more slices of k follow.
+* @param row Row of C the tile starts at (for the epilogue).
+* @param col Column of C the tile starts at (for the epilogue).
+*/
+static void gemm_kernel(int kc, const double* pa, const double* pb, double* c, int ldc, int mr, int nr,
+						int first, const gemm_epilogue* ep, int row, int col){
+	double acc[GEMM_MR][GEMM_NR];
+	int i, j, p;
+
+	for(i = 0; i < GEMM_MR; i++){
+		for(j = 0; j < GEMM_NR; j++){
+			acc[i][j] = 0.0;
+		}
+	}
+
+	for(p = 0; p < kc; p++){
+		for(i = 0; i < GEMM_MR; i++){
+			double av = pa[i];
+			for(j = 0; j < GEMM_NR; j++){
+				acc[i][j] += av * pb[j];
+			}
+		}
+		pa += GEMM_MR;
+		pb += GEMM_NR;
+	}
+
+	gemm_store(acc, c, ldc, mr, nr, first, ep, row, col);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86
+#include <immintrin.h>
+
+/**
+* AVX2/FMA version of gemm_kernel(). Each row of the 4 x 8 tile is held in two 256-bit registers,
+* so the 8 independent accumulators keep both FMA units busy.
+*/
+static __attribute__((target("avx2,fma"))) void gemm_kernel_avx2(int kc, const double* pa, const double* pb,
+																double* c, int ldc, int mr, int nr, int first,
+																const gemm_epilogue* ep, int row, int col){
+	__m256d c00, c01, c10, c11, c20, c21, c30, c31;
+	__m256d b0, b1, av;
+	double acc[GEMM_MR][GEMM_NR];
+	int p;
+
+	c00 = c01 = c10 = c11 = c20 = c21 = c30 = c31 = _mm256_setzero_pd();
+	for(p = 0; p < kc; p++){
+		b0 = _mm256_loadu_pd(pb);
+		b1 = _mm256_loadu_pd(pb + 4);
+		av = _mm256_broadcast_sd(pa);
+		c00 = _mm256_fmadd_pd(av, b0, c00);
+		c01 = _mm256_fmadd_pd(av, b1, c01);
+		av = _mm256_broadcast_sd(pa + 1);
+		c10 = _mm256_fmadd_pd(av, b0, c10);
+		c11 = _mm256_fmadd_pd(av, b1, c11);
+		av = _mm256_broadcast_sd(pa + 2);
+		c20 = _mm256_fmadd_pd(av, b0, c20);
+		c21 = _mm256_fmadd_pd(av, b1, c21);
+		av = _mm256_broadcast_sd(pa + 3);
+		c30 = _mm256_fmadd_pd(av, b0, c30);
+		c31 = _mm256_fmadd_pd(av, b1, c31);
+		pa += GEMM_MR;
+		pb += GEMM_NR;
+	}
+
+	_mm256_storeu_pd(acc[0], c00);
+	_mm256_storeu_pd(acc[0] + 4, c01);
+	_mm256_storeu_pd(acc[1], c10);
+	_mm256_storeu_pd(acc[1] + 4, c11);
+	_mm256_storeu_pd(acc[2], c20);
+	_mm256_storeu_pd(acc[2] + 4, c21);
+	_mm256_storeu_pd(acc[3], c30);
+	_mm256_storeu_pd(acc[3] + 4, c31);
+	gemm_store(acc, c, ldc, mr, nr, first, ep, row, col);
+}
+#endif
+
+/**
+* Unblocked multiplication for small or thin shapes, in i-k-j order so that B and C are read along
+* their rows. A transposed B is read along its rows too, one dot product per element of C.
+*/
+static void gemm_small(int transa, int transb, int m, int n, int k, const double* a, int lda, const double* b,
+					   int ldb, double* c, int ldc, const gemm_epilogue* ep){
+	int i, j, p;
+
+	for(i = 0; i < m; i++){
+		double* crow = c + (size_t)i * ldc;
+		if(!ep || !ep->accumulate){
+			for(j = 0; j < n; j++){
+				crow[j] = 0.0;
+			}
+		}
+		if(transb){
+			for(j = 0; j < n; j++){
+				const double* bcol = b + (size_t)j * ldb;
+				double sum = 0.0;
+				for(p = 0; p < k; p++){
+					sum += GEMM_AT(a, lda, transa, i, p) * bcol[p];
+				}
+				crow[j] += sum;
+			}
+		}
+		else{
+			for(p = 0; p < k; p++){
+				const double* brow = b + (size_t)p * ldb;
+				double av = GEMM_AT(a, lda, transa, i, p);
+				for(j = 0; j < n; j++){
+					crow[j] += av * brow[j];
+				}
+			}
+		}
+		if(ep)gemm_epilogue_row(ep, crow, i, 0, n);
+	}
+}
+
+/**
+* Returns nonzero if large multiplications (and large additions and scalings in linalg.c) are handed to
+* an external BLAS library, selected at build time with make ENN_BLAS=openblas or ENN_BLAS=blis.
+*/
+int gemm_blas(void){
+#ifdef ENN_BLAS
+	return gemm_blas_enabled;
+#else
+	return 0;
+#endif
+}
+
+/**
+* Switches between the external BLAS and the built-in kernels, e.g. to compare them. Has no effect
+* unless enn was built with a BLAS.
+*
+* @param enable Nonzero to use the external BLAS.
+*
+* @returns The new setting, as gemm_blas() would return it.
+*/
+int gemm_set_blas(int enable){
+#ifdef ENN_BLAS
+	gemm_blas_enabled = enable != 0;
+#else
+	(void)enable;
+#endif
+	return gemm_blas();
+}
+
+/**
+* Calculates C = A * B for row-major matrices given as raw buffers.
+*
+* @param m Number of rows of A and C.
+* @param n Number of columns of B and C.
+* @param k Number of columns of A and rows of B.
+* @param a Pointer to the first element of A.
+* @param lda Distance (in doubles) between the rows of A.
+* @param b Pointer to the first element of B.
+* @param ldb Distance (in doubles) between the rows of B.
+* @param c Pointer to the first element of C, which must not overlap A or B.
+* @param ldc Distance (in doubles) between the rows of C.
+*/
+void gemm(int m, int n, int k, const double* a, int lda, const double* b, int ldb, double* c, int ldc){
+	gemm_ex(0, 0, m, n, k, a, lda, b, ldb, c, ldc, NULL);
+}
+
+/**
+* Single threaded gemm_ex().
+*/
+static void gemm_serial(int transa, int transb, int m, int n, int k, const double* a, int lda, const double* b,
+						int ldb, double* c, int ldc, const gemm_epilogue* ep){
+	void (*kernel)(int, const double*, const double*, double*, int, int, int, int, const gemm_epilogue*, int,
+				   int) = gemm_kernel;
+	double *pa, *pb;
+	arena* scratch;
+	arena_mark mark;
+	int jc, pc, ic, jr, ir, accumulate = ep && ep->accumulate;
+
+	if(m <= 0 || n <= 0)return;
+
+	/* Packing costs O(mk + kn) and only pays off once there is enough O(mnk) work to amortize it */
+	if(m < GEMM_MR || n < GEMM_NR || k <= 0 || (double)m * n * k < GEMM_SMALL){
+		gemm_small(transa, transb, m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+
+	/* The packing buffers come from the thread's scratch arena, which keeps its blocks between calls, so
+	steady-state multiplications do not allocate */
+	scratch = arena_scratch();
+	if(!scratch){
+		gemm_small(transa, transb, m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+	mark = arena_save(scratch);
+	pa = arena_alloc(scratch, sizeof(double) * GEMM_MC * GEMM_KC);
+	pb = arena_alloc(scratch, sizeof(double) * GEMM_KC * (GEMM_NC + GEMM_NR));
+	if(!pa || !pb){
+		arena_restore(scratch, mark);
+		gemm_small(transa, transb, m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+
+#ifdef GEMM_X86
+	if(simd_level() >= SIMD_AVX2)kernel = gemm_kernel_avx2;
+#endif
+
+	for(jc = 0; jc < n; jc += GEMM_NC){
+		int nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+		for(pc = 0; pc < k; pc += GEMM_KC){
+			int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+			gemm_pack_b(transb, kc, nc, transb ? b + (size_t)jc * ldb + pc : b + (size_t)pc * ldb + jc, ldb, pb);
+			for(ic = 0; ic < m; ic += GEMM_MC){
+				int mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+				gemm_pack_a(transa, mc, kc, transa ? a + (size_t)pc * lda + ic : a + (size_t)ic * lda + pc, lda, pa);
+				/* Sweep the MR x NR tiles of this block of C */
+				for(jr = 0; jr < nc; jr += GEMM_NR){
+					int nr = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+					for(ir = 0; ir < mc; ir += GEMM_MR){
+						int mr = (mc - ir < GEMM_MR) ? mc - ir : GEMM_MR;
+						kernel(kc, pa + (size_t)ir * kc, pb + (size_t)jr * kc,
+							   c + (size_t)(ic + ir) * ldc + jc + jr, ldc, mr, nr, pc == 0 && !accumulate,
+							   (pc + kc == k) ? ep : NULL, ic + ir, jc + jr);
+					}
+				}
+			}
+		}
+	}
+	arena_restore(scratch, mark);
+}
+
+#ifdef ENN_BLAS
+/**
+* gemm_ex() through cblas_dgemm. The BLAS does its own blocking and threading, so the epilogue (if any)
+* is applied in a second pass over C.
+*/
+static void gemm_cblas(int transa, int transb, int m, int n, int k, const double* a, int lda, const double* b,
+					   int ldb, double* c, int ldc, const gemm_epilogue* ep){
+	int i;
+
+	cblas_dgemm(CblasRowMajor, transa ? CblasTrans : CblasNoTrans, transb ? CblasTrans : CblasNoTrans, m, n, k,
+				1.0, a, lda, b, ldb, (ep && ep->accumulate) ? 1.0 : 0.0, c, ldc);
+	if(ep && (ep->bias || ep->activ || ep->vactiv || ep->deriv)){
+		for(i = 0; i < m; i++){
+			gemm_epilogue_row(ep, c + (size_t)i * ldc, i, 0, n);
+		}
+	}
+}
+#endif
+
+/* A multiplication split across the thread pool, along the rows or the columns of C */
+struct gemm_job {
+	int transa, transb;
+	int m, n, k;
+	const double* a;
+	int lda;
+	const double* b;
+	int ldb;
+	double* c;
+	int ldc;
+	const gemm_epilogue* ep;
+	int by_rows;
+};
+
+/**
+* Pool task: multiplies the rows (or columns) [begin, end) of C.
+*/
+static void gemm_task(void* arg, int begin, int end){
+	const struct gemm_job* job = arg;
+	gemm_epilogue ep;
+	int row = job->by_rows ? begin : 0;
+	int col = job->by_rows ? 0 : begin;
+	int m = job->by_rows ? end - begin : job->m;
+	int n = job->by_rows ? job->n : end - begin;
+
+	/* Shift the epilogue inputs to the block's top left corner */
+	if(job->ep){
+		ep = *job->ep;
+		if(ep.bias)ep.bias += (size_t)row * ep.bias_stride;
+		if(ep.scale)ep.scale += (size_t)row * ep.ldscale + col;
+	}
+	gemm_serial(job->transa, job->transb, m, n, job->k,
+				job->transa ? job->a + row : job->a + (size_t)row * job->lda, job->lda,
+				job->transb ? job->b + (size_t)col * job->ldb : job->b + col, job->ldb,
+				job->c + (size_t)row * job->ldc + col, job->ldc, job->ep ? &ep : NULL);
+}
+
+/**
+* Calculates C = op(A) * op(B), where op(X) is X or its transpose, then applies an epilogue (bias,
+* activation function and/or derivative factor) to each tile of C as soon as it is complete. Like the
+* BLAS trans arguments, transposed operands are read in transposed order rather than copied. Large
+* multiplications are split across the thread pool, or handed to the external BLAS if enn was built with
+* one (see gemm_blas()).
+*
+* @param transa Nonzero to use the transpose of A.
+* @param transb Nonzero to use the transpose of B.
+* @param m Number of rows of op(A) and C.
+* @param n Number of columns of op(B) and C.
+* @param k Number of columns of op(A) and rows of op(B).
+* @param a Pointer to the first element of A (m x k, or k x m if transposed).
+* @param lda Distance (in doubles) between the rows of A.
+* @param b Pointer to the first element of B (k x n, or n x k if transposed).
+* @param ldb Distance (in doubles) between the rows of B.
+* @param c Pointer to the first element of C, which must not overlap A or B.
+* @param ldc Distance (in doubles) between the rows of C.
+* @param ep The epilogue, or NULL for none.
+*/
+void gemm_ex(int transa, int transb, int m, int n, int k, const double* a, int lda, const double* b, int ldb,
+			 double* c, int ldc, const gemm_epilogue* ep){
+	struct gemm_job job;
+	double work = (double)m * n * k;
+	int grain;
+
+	if(m <= 0 || n <= 0)return;
+#ifdef ENN_BLAS
+	/* Small products stay on the built-in kernels, where the call overhead of the BLAS would dominate */
+	if(gemm_blas_enabled && work >= GEMM_SMALL){
+		gemm_cblas(transa, transb, m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+#endif
+	if(work < GEMM_PARALLEL || pool_threads() < 2){
+		gemm_serial(transa, transb, m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+
+	/* Split the longer side of C, in pieces of at least GEMM_PARALLEL multiply-adds */
+	job.transa = transa;
+	job.transb = transb;
+	job.m = m;
+	job.n = n;
+	job.k = k;
+	job.a = a;
+	job.lda = lda;
+	job.b = b;
+	job.ldb = ldb;
+	job.c = c;
+	job.ldc = ldc;
+	job.ep = ep;
+	job.by_rows = m >= n;
+	grain = (int)(GEMM_PARALLEL / (work / (job.by_rows ? m : n))) + 1;
+	pool_for(job.by_rows ? m : n, grain, gemm_task, &job);
+}
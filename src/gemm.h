@@ -0,0 +1,51 @@
+#ifndef GEMM_H
+#define GEMM_H
+#include <stddef.h>
+/* Register tile computed by the micro-kernel (MR rows x NR cols of C) */
+#define GEMM_MR 4
+#define GEMM_NR 8
+/* Cache blocking: a KC x NR panel of B stays in L1, an MC x KC block of A in L2
+and a KC x NC block of B in L3 */
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 2048
+/* Below this many multiply-adds (m * n * k) packing does not pay off */
+#define GEMM_SMALL 32768
+/* Below this many multiply-adds a multiplication is not split across threads */
+#define GEMM_PARALLEL 1048576
+
+/* Optional element-wise work done on C as each tile is finished, while it is still in cache.
+For every element: c = activ(c + bias[row]), then c = c * deriv(scale[row][col]). Unused parts are NULL.
+vactiv, if set, replaces activ and is applied to each row of a tile in one call (see avec()). */
+struct gemm_epilogue {
+	int accumulate; /* Nonzero to add the product to C (BLAS beta = 1) instead of overwriting C */
+	const double* bias; /* Added to every element of a row: bias[row * bias_stride] */
+	int bias_stride;
+	double (*activ)(double); /* Applied after the bias */
+	const double* scale; /* Element-wise factor source: scale[row * ldscale + col] */
+	int ldscale;
+	double (*deriv)(double); /* Applied to scale before multiplying */
+	void (*vactiv)(size_t n, const double* a, double* out); /* Applied after the bias, n elements at a time */
+};
+typedef struct gemm_epilogue gemm_epilogue;
+
+/* Single precision: the register tile is twice as wide, since a 256-bit register holds 8 floats */
+#define GEMMF_MR 4
+#define GEMMF_NR 16
+
+/* Epilogue of gemmf_ex(): c = activ(c + bias[row]). Unused parts are NULL */
+struct gemmf_epilogue {
+	const float* bias; /* Added to every element of a row: bias[row * bias_stride] */
+	int bias_stride;
+	float (*activ)(float); /* Applied after the bias */
+};
+typedef struct gemmf_epilogue gemmf_epilogue;
+
+int gemm_blas(void);
+int gemm_set_blas(int enable);
+void gemm(int m, int n, int k, const double* a, int lda, const double* b, int ldb, double* c, int ldc);
+void gemm_ex(int transa, int transb, int m, int n, int k, const double* a, int lda, const double* b, int ldb,
+			 double* c, int ldc, const gemm_epilogue* ep);
+void gemmf_ex(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc,
+			  const gemmf_epilogue* ep);
+#endif
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include "enn.h"
+#include "gemm.h"
+#include "simd.h"
+#include "pool.h"
+#include "arena.h"
+#ifdef ENN_BLAS
+#include <cblas.h>
+#endif
+
+/* Single precision version of the cache-blocked multiplication in gemm.c, for the float network
+(see linalgf.h). The blocking is the same; the micro-kernel tile is GEMMF_MR x GEMMF_NR, twice as wide
+as in double precision, so each FMA does twice the work and each packed panel needs half the memory
+traffic. Only plain A * B with an optional bias and activation epilogue is needed for inference. */
+
+/**
+* Copies an mc x kc block of A into MR row panels, padding rows past mc with zeros.
+*/
+static void gemmf_pack_a(int mc, int kc, const float* a, int lda, float* pa){
+	int i0, i, p;
+
+	for(i0 = 0; i0 < mc; i0 += GEMMF_MR){
+		for(p = 0; p < kc; p++){
+			for(i = 0; i < GEMMF_MR; i++){
+				*pa++ = (i0 + i < mc) ? a[(size_t)(i0 + i) * lda + p] : 0.0f;
+			}
+		}
+	}
+}
+
+/**
+* Copies a kc x nc block of B into NR column panels, padding columns past nc with zeros.
+*/
+static void gemmf_pack_b(int kc, int nc, const float* b, int ldb, float* pb){
+	int j0, j, p;
+
+	for(j0 = 0; j0 < nc; j0 += GEMMF_NR){
+		for(p = 0; p < kc; p++){
+			const float* brow = b + (size_t)p * ldb + j0;
+			for(j = 0; j < GEMMF_NR; j++){
+				*pb++ = (j0 + j < nc) ? brow[j] : 0.0f;
+			}
+		}
+	}
+}
+
+/**
+* Applies an epilogue to n elements of row row of C.
+*/
+static void gemmf_epilogue_row(const gemmf_epilogue* ep, float* crow, int row, int n){
+	int j;
+
+	if(ep->bias){
+		float bias = ep->bias[(size_t)row * ep->bias_stride];
+		for(j = 0; j < n; j++)crow[j] += bias;
+	}
+	if(ep->activ){
+		for(j = 0; j < n; j++)crow[j] = ep->activ(crow[j]);
+	}
+}
+
+/**
+* Writes (or adds) the valid mr x nr part of an accumulated tile to C, then applies the epilogue.
+*/
+static void gemmf_store(float acc[GEMMF_MR][GEMMF_NR], float* c, int ldc, int mr, int nr, int first,
+						const gemmf_epilogue* ep, int row){
+	int i, j;
+
+	for(i = 0; i < mr; i++){
+		float* crow = c + (size_t)i * ldc;
+		for(j = 0; j < nr; j++){
+			crow[j] = first ? acc[i][j] : crow[j] + acc[i][j];
+		}
+		if(ep)gemmf_epilogue_row(ep, crow, row + i, nr);
+	}
+}
+
+/**
+* Micro-kernel, see gemm_kernel() in gemm.c.
+*/
+static void gemmf_kernel(int kc, const float* pa, const float* pb, float* c, int ldc, int mr, int nr, int first,
+						 const gemmf_epilogue* ep, int row){
+	float acc[GEMMF_MR][GEMMF_NR];
+	int i, j, p;
+
+	for(i = 0; i < GEMMF_MR; i++){
+		for(j = 0; j < GEMMF_NR; j++){
+			acc[i][j] = 0.0f;
+		}
+	}
+
+	for(p = 0; p < kc; p++){
+		for(i = 0; i < GEMMF_MR; i++){
+			float av = pa[i];
+			for(j = 0; j < GEMMF_NR; j++){
+				acc[i][j] += av * pb[j];
+			}
+		}
+		pa += GEMMF_MR;
+		pb += GEMMF_NR;
+	}
+
+	gemmf_store(acc, c, ldc, mr, nr, first, ep, row);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMMF_X86
+#include <immintrin.h>
+
+/**
+* AVX2/FMA version of gemmf_kernel(). Each row of the 4 x 16 tile is held in two 256-bit registers of
+* 8 floats.
+*/
+static __attribute__((target("avx2,fma"))) void gemmf_kernel_avx2(int kc, const float* pa, const float* pb,
+																  float* c, int ldc, int mr, int nr, int first,
+																  const gemmf_epilogue* ep, int row){
+	__m256 c00, c01, c10, c11, c20, c21, c30, c31;
+	__m256 b0, b1, av;
+	float acc[GEMMF_MR][GEMMF_NR];
+	int p;
+
+	c00 = c01 = c10 = c11 = c20 = c21 = c30 = c31 = _mm256_setzero_ps();
+	for(p = 0; p < kc; p++){
+		b0 = _mm256_loadu_ps(pb);
+		b1 = _mm256_loadu_ps(pb + 8);
+		av = _mm256_broadcast_ss(pa);
+		c00 = _mm256_fmadd_ps(av, b0, c00);
+		c01 = _mm256_fmadd_ps(av, b1, c01);
+		av = _mm256_broadcast_ss(pa + 1);
+		c10 = _mm256_fmadd_ps(av, b0, c10);
+		c11 = _mm256_fmadd_ps(av, b1, c11);
+		av = _mm256_broadcast_ss(pa + 2);
+		c20 = _mm256_fmadd_ps(av, b0, c20);
+		c21 = _mm256_fmadd_ps(av, b1, c21);
+		av = _mm256_broadcast_ss(pa + 3);
+		c30 = _mm256_fmadd_ps(av, b0, c30);
+		c31 = _mm256_fmadd_ps(av, b1, c31);
+		pa += GEMMF_MR;
+		pb += GEMMF_NR;
+	}
+
+	_mm256_storeu_ps(acc[0], c00);
+	_mm256_storeu_ps(acc[0] + 8, c01);
+	_mm256_storeu_ps(acc[1], c10);
+	_mm256_storeu_ps(acc[1] + 8, c11);
+	_mm256_storeu_ps(acc[2], c20);
+	_mm256_storeu_ps(acc[2] + 8, c21);
+	_mm256_storeu_ps(acc[3], c30);
+	_mm256_storeu_ps(acc[3] + 8, c31);
+	gemmf_store(acc, c, ldc, mr, nr, first, ep, row);
+}
+#endif
+
+/**
+* Unblocked multiplication for small or thin shapes, in i-k-j order.
+*/
+static void gemmf_small(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc,
+						const gemmf_epilogue* ep){
+	int i, j, p;
+
+	for(i = 0; i < m; i++){
+		float* crow = c + (size_t)i * ldc;
+		const float* arow = a + (size_t)i * lda;
+		for(j = 0; j < n; j++){
+			crow[j] = 0.0f;
+		}
+		for(p = 0; p < k; p++){
+			const float* brow = b + (size_t)p * ldb;
+			float av = arow[p];
+			for(j = 0; j < n; j++){
+				crow[j] += av * brow[j];
+			}
+		}
+		if(ep)gemmf_epilogue_row(ep, crow, i, n);
+	}
+}
+
+/**
+* Single threaded gemmf_ex().
+*/
+static void gemmf_serial(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc,
+						 const gemmf_epilogue* ep){
+	void (*kernel)(int, const float*, const float*, float*, int, int, int, int, const gemmf_epilogue*, int) =
+		gemmf_kernel;
+	float *pa, *pb;
+	arena* scratch;
+	arena_mark mark;
+	int jc, pc, ic, jr, ir;
+
+	if(m <= 0 || n <= 0)return;
+	if(m < GEMMF_MR || n < GEMMF_NR || k <= 0 || (double)m * n * k < GEMM_SMALL){
+		gemmf_small(m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+
+	scratch = arena_scratch();
+	if(!scratch){
+		gemmf_small(m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+	mark = arena_save(scratch);
+	pa = arena_alloc(scratch, sizeof(float) * GEMM_MC * GEMM_KC);
+	pb = arena_alloc(scratch, sizeof(float) * GEMM_KC * (GEMM_NC + GEMMF_NR));
+	if(!pa || !pb){
+		arena_restore(scratch, mark);
+		gemmf_small(m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+
+#ifdef GEMMF_X86
+	if(simd_level() >= SIMD_AVX2)kernel = gemmf_kernel_avx2;
+#endif
+
+	for(jc = 0; jc < n; jc += GEMM_NC){
+		int nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+		for(pc = 0; pc < k; pc += GEMM_KC){
+			int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+			gemmf_pack_b(kc, nc, b + (size_t)pc * ldb + jc, ldb, pb);
+			for(ic = 0; ic < m; ic += GEMM_MC){
+				int mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+				gemmf_pack_a(mc, kc, a + (size_t)ic * lda + pc, lda, pa);
+				for(jr = 0; jr < nc; jr += GEMMF_NR){
+					int nr = (nc - jr < GEMMF_NR) ? nc - jr : GEMMF_NR;
+					for(ir = 0; ir < mc; ir += GEMMF_MR){
+						int mr = (mc - ir < GEMMF_MR) ? mc - ir : GEMMF_MR;
+						kernel(kc, pa + (size_t)ir * kc, pb + (size_t)jr * kc, c + (size_t)(ic + ir) * ldc + jc + jr,
+							   ldc, mr, nr, pc == 0, (pc + kc == k) ? ep : NULL, ic + ir);
+					}
+				}
+			}
+		}
+	}
+	arena_restore(scratch, mark);
+}
+
+/* A multiplication split across the thread pool along the rows of C */
+struct gemmf_job {
+	int n, k;
+	const float* a;
+	int lda;
+	const float* b;
+	int ldb;
+	float* c;
+	int ldc;
+	const gemmf_epilogue* ep;
+};
+
+/**
+* Pool task: multiplies the rows [begin, end) of C.
+*/
+static void gemmf_task(void* arg, int begin, int end){
+	const struct gemmf_job* job = arg;
+	gemmf_epilogue ep;
+
+	if(job->ep){
+		ep = *job->ep;
+		if(ep.bias)ep.bias += (size_t)begin * ep.bias_stride;
+	}
+	gemmf_serial(end - begin, job->n, job->k, job->a + (size_t)begin * job->lda, job->lda, job->b, job->ldb,
+				 job->c + (size_t)begin * job->ldc, job->ldc, job->ep ? &ep : NULL);
+}
+
+/**
+* Calculates C = A * B in single precision, then applies an epilogue (bias and/or activation function)
+* to each tile of C as soon as it is complete. Large multiplications are split across the thread pool
+* by rows, or handed to the external BLAS if enn was built with one.
+*
+* @param m Number of rows of A and C.
+* @param n Number of columns of B and C.
+* @param k Number of columns of A and rows of B.
+* @param a Pointer to the first element of A.
+* @param lda Distance (in floats) between the rows of A.
+* @param b Pointer to the first element of B.
+* @param ldb Distance (in floats) between the rows of B.
+* @param c Pointer to the first element of C, which must not overlap A or B.
+* @param ldc Distance (in floats) between the rows of C.
+* @param ep The epilogue, or NULL for none.
+*/
+void gemmf_ex(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc,
+			  const gemmf_epilogue* ep){
+	struct gemmf_job job;
+	double work = (double)m * n * k;
+
+	if(m <= 0 || n <= 0)return;
+#ifdef ENN_BLAS
+	if(gemm_blas() && work >= GEMM_SMALL){
+		int i;
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0f, a, lda, b, ldb, 0.0f, c, ldc);
+		for(i = 0; ep && i < m; i++){
+			gemmf_epilogue_row(ep, c + (size_t)i * ldc, i, n);
+		}
+		return;
+	}
+#endif
+	if(work < GEMM_PARALLEL || pool_threads() < 2){
+		gemmf_serial(m, n, k, a, lda, b, ldb, c, ldc, ep);
+		return;
+	}
+
+	job.n = n;
+	job.k = k;
+	job.a = a;
+	job.lda = lda;
+	job.b = b;
+	job.ldb = ldb;
+	job.c = c;
+	job.ldc = ldc;
+	job.ep = ep;
+	pool_for(m, (int)(GEMM_PARALLEL / ((double)n * k)) + 1, gemmf_task, &job);
+}
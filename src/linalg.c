@@ -1,8 +1,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 #include "enn.h"
 #include "linalg.h"
+#include "activ.h"
+#include "gemm.h"
+#include "simd.h"
+#include "pool.h"
+#include "arena.h"
+#include "mpool.h"
+#ifdef ENN_BLAS
+#include <cblas.h>
+#endif
+
+/* Nonzero if the rows of a Matrix follow each other without padding, so its elements can be
+processed as one flat array */
+#define MCONTIG(a) ((a)->stride == (a)->cols)
+#ifdef ENN_BLAS
+/* Nonzero if a contiguous Matrix is large enough to hand to the external BLAS as one flat vector */
+#define MBLAS(a) (gemm_blas() && MCONTIG(a) && (double)(a)->rows * (a)->cols >= LINALG_PARALLEL && \
+				  (double)(a)->rows * (a)->cols <= INT_MAX)
+#endif
 
 /**
 * Prints out a Matrix to the screen.
@@ -27,7 +46,10 @@ void mprint(const Matrix* x){
 }
 
 /**
-* Creates and allocates memory for a new Matrix.
+* Creates and allocates memory for a new Matrix. The Matrix structure, the row pointers and the
+* (aligned) element storage are all carved out of a single allocation, taken from the thread's active
+* arena if there is one (see arena_use()). Otherwise a freed Matrix of the same shape is reused if the
+* thread's pool has one (see mpool.h), and a new one is allocated with malloc if not.
 *
 * @param rows Number of rows for the matrix.
 * @param cols Number of columns for the matrix.
@@ -36,27 +58,36 @@ void mprint(const Matrix* x){
 */
 Matrix* mnew(int rows, int cols){
 	Matrix* output;
+	size_t header_size, data_size;
+	arena* active = arena_current();
+	char* block;
 	int row;
 
-	/* Allocate a Matrix object and set the number of rows and cols */
-	output = malloc(sizeof(Matrix));
-	if(!output)return NULL;
+	if(rows < 0 || cols < 0)return NULL;
+	if(!active && (output = mpool_get(rows, cols)))return output;
+
+	/* Layout of the block: [Matrix][rows row pointers][padding][rows * cols doubles]
+	The padding is at most ENN_ALIGN - 1 bytes and lets the storage start on an ENN_ALIGN boundary */
+	header_size = sizeof(Matrix) + rows * sizeof(double*);
+	data_size = (size_t)rows * cols * sizeof(double);
+	block = active ? arena_alloc(active, header_size + ENN_ALIGN - 1 + data_size)
+				   : malloc(header_size + ENN_ALIGN - 1 + data_size);
+	if(!block)return NULL;
+
+	/* Set the number of rows and cols */
+	output = (Matrix*)block;
 	output->rows = rows;
 	output->cols = cols;
+	output->stride = cols;
+	output->flags = active ? MATRIX_ARENA : 0;
 
 	/* The data is accessed as Matrix->data[row][col]
-	Therefore, we allocate an array of rows first
-	Each row is an array of ncol doubles (double*).
+	Therefore, each entry of the row table points to the start of that row in the buffer.
 	*/
-	output->data = malloc(rows * sizeof(double*));
-	if(!output->data){
-		free(output->data);
-		free(output);
-		return NULL;
-	}
+	output->data = (double**)(block + sizeof(Matrix));
+	output->buf = (double*)(((size_t)(block + header_size) + ENN_ALIGN - 1) & ~(size_t)(ENN_ALIGN - 1));
 	for(row = 0; row < rows; row++){
-		/* Set each row to have cols number of spots (one spot for each column in the row) */
-		output->data[row] = malloc(cols * sizeof(double));
+		output->data[row] = output->buf + (size_t)row * output->stride;
 	}
 	return output;
 }
@@ -79,22 +110,131 @@ Matrix* mnew2(int rows, int cols, Matrix* a){
 }
 
 /**
-* Frees memory for a Matrix.
+* Frees memory for a Matrix. Matrices allocated from an arena are given back with the arena instead,
+* so this does nothing for them, and common shapes are kept in the thread's pool for mnew() to reuse.
+* For a Matrix made by mwrap() only the Matrix itself is freed, not the storage it points to.
 *
 * @param x Pointer to a Matrix to free.
 */
 void mfree(Matrix* x){
+	/* The rows and storage were allocated together with the Matrix, see mnew() */
+	if(!x || (x->flags & MATRIX_ARENA))return;
+	if(!(x->flags & MATRIX_EXTERN) && mpool_put(x))return;
+	free(x);
+}
+
+/**
+* Creates a Matrix over existing storage, such as a memory mapped file, without copying it. The caller
+* keeps ownership of the storage, which must outlive the Matrix.
+*
+* @param rows Number of rows for the matrix.
+* @param cols Number of columns for the matrix.
+* @param stride Number of doubles between the start of one row and the start of the next.
+* @param buf Pointer to the first element, ideally aligned to ENN_ALIGN bytes.
+*
+* @returns A pointer to the Matrix, or NULL on error.
+*/
+Matrix* mwrap(int rows, int cols, int stride, double* buf){
+	Matrix* output;
 	int row;
-	if(!x) return;
-	for(row = 0; row < x->rows; row++){
-		free(x->data[row]);
+
+	if(rows < 0 || cols < 0 || stride < cols || (!buf && rows && cols))return NULL;
+	output = malloc(sizeof(Matrix) + rows * sizeof(double*));
+	if(!output)return NULL;
+	output->rows = rows;
+	output->cols = cols;
+	output->stride = stride;
+	output->flags = MATRIX_EXTERN;
+	output->data = (double**)(output + 1);
+	output->buf = buf;
+	for(row = 0; row < rows; row++){
+		output->data[row] = buf + (size_t)row * stride;
 	}
-	free(x->data);
-	free(x);
+	return output;
+}
+
+/* An element-wise kernel over a flat buffer: exactly one of binary, scale and fill is set */
+struct mflat_job {
+	void (*binary)(size_t, const double*, const double*, double*);
+	void (*scale)(size_t, const double*, double, double*);
+	void (*fill)(size_t, double, double*);
+	const double *a, *b;
+	double value;
+	double* out;
+};
+
+/**
+* Runs an element-wise kernel on n elements, starting at element begin.
+*/
+static void mflat_run(const struct mflat_job* job, size_t begin, size_t n){
+	if(job->binary)job->binary(n, job->a + begin, job->b + begin, job->out + begin);
+	else if(job->scale)job->scale(n, job->a + begin, job->value, job->out + begin);
+	else job->fill(n, job->value, job->out + begin);
+}
+
+/**
+* Pool task: runs an element-wise kernel on the elements [begin, end).
+*/
+static void mflat_task(void* arg, int begin, int end){
+	mflat_run(arg, begin, end - begin);
+}
+
+/**
+* Runs an element-wise kernel over n contiguous elements, split across the thread pool when there are
+* at least LINALG_PARALLEL elements per thread.
+*/
+static void mflat(struct mflat_job* job, size_t n){
+	if(n > (size_t)INT_MAX)mflat_run(job, 0, n);
+	else pool_for((int)n, LINALG_PARALLEL, mflat_task, job);
 }
 
 /**
-* Applies a function (type dfunc) to a Matrix and returns the result
+* Makes a view of a range of rows of a Matrix. The view shares the storage and row pointers of a, so
+* writes through it change a, and it must not be passed to mfree().
+*
+* @param a Pointer to the Matrix to view.
+* @param row First row of the view.
+* @param rows Number of rows in the view.
+* @param view Pointer to the Matrix structure to fill in (e.g. a local variable).
+*
+* @returns view, or NULL if the rows are out of range.
+*/
+Matrix* mrows(const Matrix* a, int row, int rows, Matrix* view){
+	if(!a || !view || row < 0 || rows < 0 || row + rows > a->rows)return NULL;
+	view->rows = rows;
+	view->cols = a->cols;
+	view->stride = a->stride;
+	view->data = a->data + row;
+	view->buf = a->buf + (size_t)row * a->stride;
+	view->flags = a->flags;
+	return view;
+}
+
+/**
+* Applies an element-wise kernel to out = a op b, as one call over the whole buffer when all three
+* matrices are contiguous, or one call per row otherwise.
+*/
+static void mbinary(void (*op)(size_t, const double*, const double*, double*), const Matrix* a,
+					const Matrix* b, Matrix* out){
+	struct mflat_job job = {NULL, NULL, NULL, NULL, NULL, 0.0, NULL};
+	int row;
+
+	if(MCONTIG(a) && MCONTIG(b) && MCONTIG(out)){
+		job.binary = op;
+		job.a = a->buf;
+		job.b = b->buf;
+		job.out = out->buf;
+		mflat(&job, (size_t)a->rows * a->cols);
+		return;
+	}
+	for(row = 0; row < a->rows; row++){
+		op(a->cols, a->data[row], b->data[row], out->data[row]);
+	}
+}
+
+/**
+* Applies a function (type dfunc) to a Matrix and returns the result. Activation functions that have a
+* whole-buffer version (see avec()) are applied a row at a time with it.
 *
 * @param a Matrix* to apply the function to.
 * @param func A function pointer (type dfunc) to apply to the Matrix.
@@ -105,6 +245,7 @@ void mfree(Matrix* x){
 
 Matrix* mapply(const Matrix* a, dfunc func, Matrix* out){
 	int row, col;
+	vfunc vec;
 
 	if(!a || !func)return NULL;
 
@@ -112,6 +253,14 @@ Matrix* mapply(const Matrix* a, dfunc func, Matrix* out){
 	out = mnew2(a->rows, a->cols, out);
 	if(!out)return NULL;
 
+	vec = avec(func);
+	if(vec){
+		for(row = 0; row < a->rows; row++){
+			vec(a->cols, a->data[row], out->data[row]);
+		}
+		return out;
+	}
+
 	/* Set each cell of the output matrix to func(input matrix cell) */
 	for(row = 0; row < a->rows; row++){
 		for(col = 0; col < a->cols; col++){
@@ -132,18 +281,15 @@ Matrix* mapply(const Matrix* a, dfunc func, Matrix* out){
 */
 Matrix* meye(int n, Matrix* out) {
 	int row;
-	int col;
 
 	/* Allocate output matrix and check for null */
 	out = mnew2(n, n, out);
 	if(!out)return NULL;
 
-	/* Fill with 1 for every diagonal, 0 otherwise */
+	/* Fill with 0, then set every diagonal to 1 */
+	mconst(n, n, 0.0, out);
 	for(row = 0; row < n; row++){
-		for(col = 0; col < n; col++){
-			if(row == col) out->data[row][col] = 1.0;
-			else out->data[row][col] = 0.0;
-		}
+		out->data[row][row] = 1.0;
 	}
 
 	return out;
@@ -160,17 +306,23 @@ Matrix* meye(int n, Matrix* out) {
 * @returns A pointer to the matrix with the scalar value.
 */
 Matrix* mconst(int rows, int cols, double value, Matrix* out){
+	struct mflat_job job = {NULL, NULL, NULL, NULL, NULL, 0.0, NULL};
 	int row;
-	int col;
 
 	/* Allocate output matrix and check for null */
 	out = mnew2(rows, cols, out);
 	if(!out)return NULL;
 
 	/* Fill with constant value */
-	for(row = 0; row < rows; row++){
-		for(col = 0; col < cols; col++){
-			out->data[row][col] = value;
+	if(MCONTIG(out)){
+		job.fill = simd()->fill;
+		job.value = value;
+		job.out = out->buf;
+		mflat(&job, (size_t)rows * cols);
+	}
+	else{
+		for(row = 0; row < rows; row++){
+			simd()->fill(cols, value, out->data[row]);
 		}
 	}
 
@@ -186,30 +338,144 @@ Matrix* mconst(int rows, int cols, double value, Matrix* out){
 * @returns A pointer to the product of the matrices
 */
 Matrix* mmul(const Matrix* a, const Matrix* b, Matrix* out){
-	int row, col, index;
-
 	/* Make sure matrices are comformable and not NULL */
 	if(!a || !b) return NULL;
 	if(a->cols != b->rows){
 		return NULL;
 	}
 
-	/* (n x m) * (m x k) -> (m x k) */
+	/* (n x m) * (m x k) -> (n x k) */
 	out = mnew2(a->rows, b->cols, out);
 	if(!out)return NULL;
 
-	/* For each row in matrix a */
-	for(row = 0; row < a->rows; row++){
-		/* For each column matrix b */
-		for(col = 0; col < b->cols; col++){
-			/* Set the output cell to the sum of the products of the entries in the row of a
-			and the column of b. */
-			out->data[row][col] = 0;
-			for(index = 0; index < a->cols; index++){
-				out->data[row][col] += a->data[row][index] * b->data[index][col];
-			}
-		}
+	/* Each output cell is the sum of the products of the entries in the row of a and the column of b.
+	gemm() computes these with a cache-blocked kernel, see gemm.c */
+	gemm(a->rows, b->cols, a->cols, a->buf, a->stride, b->buf, b->stride, out->buf, out->stride);
+
+	return out;
+}
+
+/**
+* Calculates op(a) * op(b), either overwriting or adding to out. Shared by mmult() and mmacc().
+*/
+static Matrix* mgemm(const Matrix* a, int ta, const Matrix* b, int tb, int accumulate, Matrix* out){
+	gemm_epilogue ep = {0, NULL, 0, NULL, NULL, 0, NULL, NULL};
+	int m, n, k;
+
+	if(!a || !b)return NULL;
+	m = ta ? a->cols : a->rows;
+	k = ta ? a->rows : a->cols;
+	n = tb ? b->rows : b->cols;
+	if(k != (tb ? b->cols : b->rows))return NULL;
+	if(accumulate && !out)return NULL;
+
+	out = mnew2(m, n, out);
+	if(!out)return NULL;
+
+	ep.accumulate = accumulate;
+	gemm_ex(ta, tb, m, n, k, a->buf, a->stride, b->buf, b->stride, out->buf, out->stride, &ep);
+
+	return out;
+}
+
+/**
+* Multiply two matrices, either of which may be transposed. The transposes are never built: gemm
+* reads the operands in transposed order instead.
+*
+* @param a Pointer to first matrix to be multiplied
+* @param ta Nonzero to multiply by the transpose of a
+* @param b Pointer to second matrix to be multiplied
+* @param tb Nonzero to multiply by the transpose of b
+* @param out Pointer to output matrix (optional)
+*
+* @returns A pointer to the product op(a) * op(b)
+*/
+Matrix* mmult(const Matrix* a, int ta, const Matrix* b, int tb, Matrix* out){
+	return mgemm(a, ta, b, tb, 0, out);
+}
+
+/**
+* Adds the product of two matrices, either of which may be transposed, to a matrix in place:
+* out = out + op(a) * op(b), without a temporary for the product.
+*
+* @param a Pointer to first matrix to be multiplied
+* @param ta Nonzero to multiply by the transpose of a
+* @param b Pointer to second matrix to be multiplied
+* @param tb Nonzero to multiply by the transpose of b
+* @param out Pointer to the matrix to add to
+*
+* @returns out, or NULL on error
+*/
+Matrix* mmacc(const Matrix* a, int ta, const Matrix* b, int tb, Matrix* out){
+	return mgemm(a, ta, b, tb, 1, out);
+}
+
+/**
+* Calculates a dense (fully connected) layer, activ(w * x + bias), in one pass: the bias and
+* activation function are applied to each block of the product as soon as it is computed. Activation
+* functions that have a whole-buffer version (see avec()) are applied with it.
+*
+* @param w Pointer to the weight matrix (outputs x inputs).
+* @param x Pointer to the input matrix (inputs x samples).
+* @param bias Pointer to the bias column vector (outputs x 1), added to every column (optional).
+* @param activ Activation function to apply (optional).
+* @param out Pointer to output matrix (optional)
+*
+* @returns A pointer to the layer output (outputs x samples).
+*/
+Matrix* mdense(const Matrix* w, const Matrix* x, const Matrix* bias, dfunc activ, Matrix* out){
+	gemm_epilogue ep = {0, NULL, 0, NULL, NULL, 0, NULL, NULL};
+
+	/* Make sure matrices are comformable and not NULL */
+	if(!w || !x || w->cols != x->rows)return NULL;
+	if(bias && (bias->rows != w->rows || bias->cols != 1))return NULL;
+
+	/* Allocate output matrix and check for NULL */
+	out = mnew2(w->rows, x->cols, out);
+	if(!out)return NULL;
+
+	if(bias){
+		ep.bias = bias->buf;
+		ep.bias_stride = bias->stride;
 	}
+	ep.vactiv = avec(activ);
+	if(!ep.vactiv)ep.activ = activ;
+	gemm_ex(0, 0, w->rows, x->cols, w->cols, w->buf, w->stride, x->buf, x->stride, out->buf, out->stride, &ep);
+
+	return out;
+}
+
+/**
+* Calculates the delta of a layer in backpropagation, (op(a) * b) (Hadamard) deriv(act), in one pass: the
+* derivative factor is applied to each block of the product as soon as it is computed.
+*
+* @param a Pointer to first matrix to be multiplied (the weights of the next layer)
+* @param ta Nonzero to multiply by the transpose of a, read in place (as backpropagation does)
+* @param b Pointer to second matrix to be multiplied (the delta of the next layer)
+* @param act Pointer to the matrix deriv is applied to (the activations of this layer)
+* @param deriv Derivative of the activation function, in terms of the activation output
+* @param out Pointer to output matrix (optional)
+*
+* @returns A pointer to the delta
+*/
+Matrix* mdelta(const Matrix* a, int ta, const Matrix* b, const Matrix* act, dfunc deriv, Matrix* out){
+	gemm_epilogue ep = {0, NULL, 0, NULL, NULL, 0, NULL, NULL};
+	int m, k;
+
+	/* Make sure matrices are comformable and not NULL */
+	if(!a || !b || !act || !deriv)return NULL;
+	m = ta ? a->cols : a->rows;
+	k = ta ? a->rows : a->cols;
+	if(k != b->rows || act->rows != m || act->cols != b->cols)return NULL;
+
+	/* Allocate output matrix and check for NULL */
+	out = mnew2(m, b->cols, out);
+	if(!out)return NULL;
+
+	ep.scale = act->buf;
+	ep.ldscale = act->stride;
+	ep.deriv = deriv;
+	gemm_ex(ta, 0, m, b->cols, k, a->buf, a->stride, b->buf, b->stride, out->buf, out->stride, &ep);
 
 	return out;
 }
@@ -224,8 +490,6 @@ Matrix* mmul(const Matrix* a, const Matrix* b, Matrix* out){
 * @returns A pointer to the Hadamard product of the two matrices
 */
 Matrix* mhad(const Matrix* a, const Matrix* b, Matrix* out){
-	int row, col;
-
 	/* Make sure matrices have same dimensions and not NULL */
 	if(!a || !b || (a->rows != b->rows) || (a->cols != b->cols)) return NULL;
 
@@ -234,11 +498,7 @@ Matrix* mhad(const Matrix* a, const Matrix* b, Matrix* out){
 	if(!out)return NULL;
 
 	/* Calculate the Hadamard product */
-	for(row = 0; row < a->rows; row++){
-		for(col = 0; col < a->cols; col++){
-			out->data[row][col] = a->data[row][col] * b->data[row][col];
-		}
-	}
+	mbinary(simd()->mul, a, b, out);
 
 	return out;
 }
@@ -253,9 +513,6 @@ Matrix* mhad(const Matrix* a, const Matrix* b, Matrix* out){
 * @return A pointer to the matrix sum of the matrices
 */
 Matrix* madd(const Matrix* a, const Matrix* b, Matrix* out){
-	int row;
-	int col;
-
 	/* Make sure both have the same number of rows and columns and not NULL */
 	if(!a || !b || a->rows != b->rows || a->cols != b->cols)return NULL;
 
@@ -264,11 +521,14 @@ Matrix* madd(const Matrix* a, const Matrix* b, Matrix* out){
 	if(!out)return NULL;
 
 	/* Set output matrix to the sum of the input matrices */
-	for(row = 0; row < a->rows; row++){
-		for(col = 0; col < a->cols; col++){
-			out->data[row][col] = a->data[row][col] + b->data[row][col];
-		}
+#ifdef ENN_BLAS
+	/* Only in-place additions are a single daxpy pass; out = a + b would need a copy first */
+	if(MBLAS(a) && MCONTIG(b) && (out == a || out == b)){
+		cblas_daxpy(a->rows * a->cols, 1.0, (out == a) ? b->buf : a->buf, 1, out->buf, 1);
+		return out;
 	}
+#endif
+	mbinary(simd()->add, a, b, out);
 	return out;
 }
 /**
@@ -281,10 +541,15 @@ Matrix* madd(const Matrix* a, const Matrix* b, Matrix* out){
 * @return A pointer to the matrix difference of the matrices
 */
 Matrix* msub(const Matrix* a, const Matrix* b, Matrix* out){
-	Matrix *neg_b;
-	neg_b = mscale(b, -1.0, NULL);
-	out = madd(a, neg_b, out);
-	mfree(neg_b);
+	/* Make sure both have the same number of rows and columns and not NULL */
+	if(!a || !b || a->rows != b->rows || a->cols != b->cols)return NULL;
+
+	/* Allocate output matrix and check for NULL */
+	out = mnew2(a->rows, a->cols, out);
+	if(!out)return NULL;
+
+	/* Set output matrix to the difference of the input matrices */
+	mbinary(simd()->sub, a, b, out);
 	return out;
 }
 
@@ -299,7 +564,8 @@ Matrix* msub(const Matrix* a, const Matrix* b, Matrix* out){
 * @returns The scaled Matrix.
 */
 Matrix* mscale(const Matrix* a, double b, Matrix* out){
-	int row, col;
+	struct mflat_job job = {NULL, NULL, NULL, NULL, NULL, 0.0, NULL};
+	int row;
 
 	if(!a)return NULL;
 
@@ -308,9 +574,23 @@ Matrix* mscale(const Matrix* a, double b, Matrix* out){
 	if(!out)return NULL;
 
 	/* Set output matrix to input matrix a scaled by the scalar b */
-	for(row = 0; row < a->rows; row++){
-		for(col = 0; col < a->cols; col++){
-			out->data[row][col] = a->data[row][col] * b;
+#ifdef ENN_BLAS
+	/* In place only, like madd() */
+	if(MBLAS(a) && out == a){
+		cblas_dscal(a->rows * a->cols, b, out->buf, 1);
+		return out;
+	}
+#endif
+	if(MCONTIG(a) && MCONTIG(out)){
+		job.scale = simd()->scale;
+		job.a = a->buf;
+		job.value = b;
+		job.out = out->buf;
+		mflat(&job, (size_t)a->rows * a->cols);
+	}
+	else{
+		for(row = 0; row < a->rows; row++){
+			simd()->scale(a->cols, a->data[row], b, out->data[row]);
 		}
 	}
 
@@ -1,11 +1,24 @@
 #ifndef LINALG_H
 #define LINALG_H
+/* Alignment (in bytes) of Matrix storage, one cache line */
+#define ENN_ALIGN 64
+/* Minimum number of elements per thread for element-wise operations to be split across threads */
+#define LINALG_PARALLEL 65536
+/* Matrix flags */
+#define MATRIX_ARENA 1 /* Allocated from an arena (see arena.h), mfree() leaves it alone */
+#define MATRIX_EXTERN 2 /* Storage owned by someone else (see mwrap()), mfree() frees only the Matrix */
+
 /* Define data structures */
 /* Matrix is addressed in matrix[row][col] format like matrix notation and NumPy */
+/* The elements live in one contiguous row-major buffer, and data holds a pointer to the
+start of each row in that buffer, so both data[row][col] and buf[row * stride + col] work */
 struct Matrix {
 	int rows;
 	int cols;
-	double** data; /* A 2d double array */
+	int stride; /* Number of doubles between the start of one row and the start of the next */
+	double** data; /* A 2d double array (row pointers into buf) */
+	double* buf; /* Contiguous row-major storage, aligned to ENN_ALIGN bytes */
+	int flags; /* MATRIX_* flags */
 };
 typedef struct Matrix Matrix;
 typedef double (*dfunc)(double);
@@ -16,10 +29,16 @@ void mprint(const Matrix* x);
 Matrix* mnew(int rows, int cols);
 Matrix* mnew2(int rows, int cols, Matrix* a);
 void mfree(Matrix* x);
+Matrix* mrows(const Matrix* a, int row, int rows, Matrix* view);
+Matrix* mwrap(int rows, int cols, int stride, double* buf);
 Matrix* mapply(const Matrix* x, dfunc func, Matrix* out);
 Matrix* meye(int n, Matrix* out);
 Matrix* mconst(int rows, int cols, double value, Matrix* out);
 Matrix* mmul(const Matrix* a, const Matrix* b, Matrix* out);
+Matrix* mmult(const Matrix* a, int ta, const Matrix* b, int tb, Matrix* out);
+Matrix* mmacc(const Matrix* a, int ta, const Matrix* b, int tb, Matrix* out);
+Matrix* mdense(const Matrix* w, const Matrix* x, const Matrix* bias, dfunc activ, Matrix* out);
+Matrix* mdelta(const Matrix* a, int ta, const Matrix* b, const Matrix* act, dfunc deriv, Matrix* out);
 Matrix* mhad(const Matrix* a, const Matrix* b, Matrix* out);
 Matrix* madd(const Matrix* a, const Matrix* b, Matrix* out);
 Matrix* msub(const Matrix* a, const Matrix* b, Matrix* out);
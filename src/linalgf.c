@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include "enn.h"
+#include "linalg.h"
+#include "linalgf.h"
+#include "gemm.h"
+#include "arena.h"
+
+/**
+* Creates and allocates memory for a new single precision Matrix, laid out like mnew() does: the
+* structure, row pointers and aligned storage in one allocation, from the thread's active arena if
+* there is one.
+*
+* @param rows Number of rows for the matrix.
+* @param cols Number of columns for the matrix.
+*
+* @returns A pointer to the allocated Matrixf.
+*/
+Matrixf* mnewf(int rows, int cols){
+	Matrixf* output;
+	size_t header_size, data_size;
+	arena* active = arena_current();
+	char* block;
+	int row;
+
+	if(rows < 0 || cols < 0)return NULL;
+
+	header_size = sizeof(Matrixf) + rows * sizeof(float*);
+	data_size = (size_t)rows * cols * sizeof(float);
+	block = active ? arena_alloc(active, header_size + ENN_ALIGN - 1 + data_size)
+				   : malloc(header_size + ENN_ALIGN - 1 + data_size);
+	if(!block)return NULL;
+
+	output = (Matrixf*)block;
+	output->rows = rows;
+	output->cols = cols;
+	output->stride = cols;
+	output->flags = active ? MATRIX_ARENA : 0;
+	output->data = (float**)(block + sizeof(Matrixf));
+	output->buf = (float*)(((size_t)(block + header_size) + ENN_ALIGN - 1) & ~(size_t)(ENN_ALIGN - 1));
+	for(row = 0; row < rows; row++){
+		output->data[row] = output->buf + (size_t)row * output->stride;
+	}
+	return output;
+}
+
+/**
+* Passes back a, if it has the given shape, or allocates a new Matrixf if a is NULL. See mnew2().
+*
+* @returns A pointer to the Matrixf, or NULL if a has the wrong shape.
+*/
+Matrixf* mnew2f(int rows, int cols, Matrixf* a){
+	if(a){
+		if(rows != a->rows || cols != a->cols)return NULL;
+		return a;
+	}
+	return mnewf(rows, cols);
+}
+
+/**
+* Frees memory for a Matrixf (nothing is done for matrices allocated from an arena).
+*
+* @param x Pointer to a Matrixf to free.
+*/
+void mfreef(Matrixf* x){
+	if(!x || (x->flags & MATRIX_ARENA))return;
+	free(x);
+}
+
+/**
+* Converts a double precision Matrix to single precision, rounding each element to the nearest float.
+*
+* @param a Pointer to the Matrix to convert.
+* @param out Pointer to output matrix (optional).
+*
+* @returns A pointer to the converted Matrixf.
+*/
+Matrixf* mconvf(const Matrix* a, Matrixf* out){
+	int row, col;
+
+	if(!a)return NULL;
+	out = mnew2f(a->rows, a->cols, out);
+	if(!out)return NULL;
+
+	for(row = 0; row < a->rows; row++){
+		for(col = 0; col < a->cols; col++){
+			out->data[row][col] = (float)a->data[row][col];
+		}
+	}
+	return out;
+}
+
+/**
+* Converts a single precision Matrixf to double precision.
+*
+* @param a Pointer to the Matrixf to convert.
+* @param out Pointer to output matrix (optional).
+*
+* @returns A pointer to the converted Matrix.
+*/
+Matrix* mconvd(const Matrixf* a, Matrix* out){
+	int row, col;
+
+	if(!a)return NULL;
+	out = mnew2(a->rows, a->cols, out);
+	if(!out)return NULL;
+
+	for(row = 0; row < a->rows; row++){
+		for(col = 0; col < a->cols; col++){
+			out->data[row][col] = a->data[row][col];
+		}
+	}
+	return out;
+}
+
+/**
+* Multiply two single precision matrices, see mmul().
+*
+* @param a Pointer to first matrix to be multiplied
+* @param b Pointer to second matrix to be multiplied
+* @param out Pointer to output matrix (optional)
+*
+* @returns A pointer to the product of the matrices
+*/
+Matrixf* mmulf(const Matrixf* a, const Matrixf* b, Matrixf* out){
+	if(!a || !b || a->cols != b->rows)return NULL;
+
+	out = mnew2f(a->rows, b->cols, out);
+	if(!out)return NULL;
+
+	gemmf_ex(a->rows, b->cols, a->cols, a->buf, a->stride, b->buf, b->stride, out->buf, out->stride, NULL);
+	return out;
+}
+
+/**
+* Calculates a single precision dense layer, activ(w * x + bias), in one pass, see mdense().
+*
+* @param w Pointer to the weight matrix (outputs x inputs).
+* @param x Pointer to the input matrix (inputs x samples).
+* @param bias Pointer to the bias column vector (outputs x 1), added to every column (optional).
+* @param activ Activation function to apply (optional).
+* @param out Pointer to output matrix (optional)
+*
+* @returns A pointer to the layer output (outputs x samples).
+*/
+Matrixf* mdensef(const Matrixf* w, const Matrixf* x, const Matrixf* bias, ffunc activ, Matrixf* out){
+	gemmf_epilogue ep = {NULL, 0, NULL};
+
+	if(!w || !x || w->cols != x->rows)return NULL;
+	if(bias && (bias->rows != w->rows || bias->cols != 1))return NULL;
+
+	out = mnew2f(w->rows, x->cols, out);
+	if(!out)return NULL;
+
+	if(bias){
+		ep.bias = bias->buf;
+		ep.bias_stride = bias->stride;
+	}
+	ep.activ = activ;
+	gemmf_ex(w->rows, x->cols, w->cols, w->buf, w->stride, x->buf, x->stride, out->buf, out->stride, &ep);
+
+	return out;
+}
@@ -0,0 +1,26 @@
+#ifndef LINALGF_H
+#define LINALGF_H
+#include "linalg.h"
+/* Single precision (float) matrices, a parallel type family to Matrix for fast inference. A Matrixf
+has exactly the layout of a Matrix (see linalg.h) with float elements, so it takes half the memory and
+bandwidth, and each SIMD register holds twice as many elements. Convert to and from double precision
+with mconvf() and mconvd(). */
+struct Matrixf {
+	int rows;
+	int cols;
+	int stride; /* Number of floats between the start of one row and the start of the next */
+	float** data; /* A 2d float array (row pointers into buf) */
+	float* buf; /* Contiguous row-major storage, aligned to ENN_ALIGN bytes */
+	int flags; /* MATRIX_* flags */
+};
+typedef struct Matrixf Matrixf;
+typedef float (*ffunc)(float);
+
+Matrixf* mnewf(int rows, int cols);
+Matrixf* mnew2f(int rows, int cols, Matrixf* a);
+void mfreef(Matrixf* x);
+Matrixf* mconvf(const Matrix* a, Matrixf* out);
+Matrix* mconvd(const Matrixf* a, Matrix* out);
+Matrixf* mmulf(const Matrixf* a, const Matrixf* b, Matrixf* out);
+Matrixf* mdensef(const Matrixf* w, const Matrixf* x, const Matrixf* bias, ffunc activ, Matrixf* out);
+#endif
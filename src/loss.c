@@ -1,7 +1,11 @@
 #include <stdio.h>
+#include <math.h>
 #include "enn.h"
 #include "linalg.h"
+#include "activ.h"
 #include "loss.h"
+#include "simd.h"
+#include "arena.h"
 
 /**
 * Calculates mean squared error of two column vectors.
@@ -32,3 +36,144 @@ double lmse(const Matrix* actual, const Matrix* pred){
 Matrix* dmse(const Matrix* actual, const Matrix* pred){
 	return msub(actual, pred, NULL);
 }
+
+/**
+* Calculates the mean softmax cross-entropy of a batch, for classifiers whose output activation is
+* softmax. Takes the raw outputs, see lxent2().
+*
+* @param logits The raw outputs (before softmax), one sample per column (outputs x samples).
+* @param Y The desired outputs (e.g. one-hot), one sample per column.
+*
+* @returns The mean cross-entropy over the samples.
+*/
+double lxent(const Matrix* logits, const Matrix* Y){
+	return lxent2(logits, Y, ASMAX_COLS, NULL);
+}
+
+/**
+* Calculates the derivative of the softmax cross-entropy wrt the raw outputs, softmax(logits) - Y, in
+* one pass. Used as the dloss_func of nbprop_batch() and ntrain(), which pass the outputs of the last
+* layer before the output activation.
+*
+* @param logits The raw outputs (before softmax), one sample per column (outputs x samples).
+* @param Y The desired outputs (e.g. one-hot), one sample per column.
+*
+* @returns The gradient, one sample per column, or NULL on error.
+*/
+Matrix* dxent(const Matrix* logits, const Matrix* Y){
+	Matrix* grad;
+
+	if(!logits || !Y || logits->rows != Y->rows || logits->cols != Y->cols)return NULL;
+	grad = mnew(logits->rows, logits->cols);
+	if(grad)lxent2(logits, Y, ASMAX_COLS, grad);
+	return grad;
+}
+
+/**
+* Softmax cross-entropy of one sample of n logits, as a row: returns -sum(y * log(softmax(x))) using the
+* log-sum-exp of x, and writes softmax(x) - y to grad. work (n doubles) may be grad.
+*/
+static double xent_row(int n, const double* x, const double* y, double* work, double* grad){
+	double max = x[0], sum, log_sum, loss = 0.0;
+	int i;
+
+	for(i = 1; i < n; i++){
+		if(x[i] > max)max = x[i];
+	}
+	for(i = 0; i < n; i++){
+		work[i] = x[i] - max;
+	}
+	simd()->expv(n, work, work);
+	sum = simd()->sum(n, work);
+	/* The log-sum-exp of x is max + log_sum, kept apart so that large logits lose no precision */
+	log_sum = log(sum);
+	for(i = 0; i < n; i++){
+		loss += y[i] * ((max - x[i]) + log_sum);
+	}
+	if(grad){
+		simd()->scale(n, work, 1.0 / sum, grad);
+		simd()->sub(n, grad, y, grad);
+	}
+	return loss;
+}
+
+/**
+* Fused softmax and categorical cross-entropy of a batch of logits, with its gradient. The softmax is
+* never formed on its own: the loss of each sample is log-sum-exp(x) - sum(y * x) (for y summing to 1),
+* and the gradient with respect to the logits is softmax(x) - y, so neither the log of a softmax nor the
+* softmax Jacobian is ever computed. The maximum logit of each sample is subtracted before exp.
+*
+* @param logits The raw outputs (before softmax), one sample per row or per column.
+* @param Y The desired outputs (e.g. one-hot), the same shape as logits.
+* @param axis ASMAX_ROWS if each row is a sample, ASMAX_COLS if each column is (see asmax2()).
+* @param grad Pointer to a matrix the shape of logits for the gradient (optional, may be logits).
+*
+* @returns The mean cross-entropy over the samples, or 0 on error.
+*/
+double lxent2(const Matrix* logits, const Matrix* Y, int axis, Matrix* grad){
+	arena* scratch;
+	arena_mark mark;
+	double *work, *max, *sum, *log_sum, loss = 0.0;
+	int row, col, samples;
+
+	if(!logits || !Y || logits->rows != Y->rows || logits->cols != Y->cols || logits->rows == 0 || logits->cols == 0
+	   || (grad && (grad->rows != logits->rows || grad->cols != logits->cols))
+	   || (axis != ASMAX_ROWS && axis != ASMAX_COLS))return 0.0;
+	samples = (axis == ASMAX_ROWS) ? logits->rows : logits->cols;
+	scratch = arena_scratch();
+	if(!scratch)return 0.0;
+	mark = arena_save(scratch);
+
+	if(axis == ASMAX_ROWS){
+		work = arena_alloc(scratch, logits->cols * sizeof(double));
+		for(row = 0; work && row < logits->rows; row++){
+			loss += xent_row(logits->cols, logits->data[row], Y->data[row], work, grad ? grad->data[row] : NULL);
+		}
+		arena_restore(scratch, mark);
+		return work ? loss / samples : 0.0;
+	}
+
+	/* One sample per column: the passes run a row at a time, over contiguous memory, as in asmax2() */
+	max = arena_alloc(scratch, 4 * logits->cols * sizeof(double));
+	if(!max){
+		arena_restore(scratch, mark);
+		return 0.0;
+	}
+	sum = max + logits->cols;
+	log_sum = sum + logits->cols;
+	work = log_sum + logits->cols;
+	for(col = 0; col < logits->cols; col++){
+		max[col] = logits->data[0][col];
+		sum[col] = 0.0;
+	}
+	for(row = 1; row < logits->rows; row++){
+		for(col = 0; col < logits->cols; col++){
+			if(logits->data[row][col] > max[col])max[col] = logits->data[row][col];
+		}
+	}
+	for(row = 0; row < logits->rows; row++){
+		simd()->sub(logits->cols, logits->data[row], max, work);
+		simd()->expv(logits->cols, work, work);
+		simd()->add(logits->cols, sum, work, sum);
+	}
+	/* The log-sum-exp of a column is max + log_sum, and its softmax is exp(x - max) / sum */
+	for(col = 0; col < logits->cols; col++){
+		log_sum[col] = log(sum[col]);
+		sum[col] = 1.0 / sum[col];
+	}
+	for(row = 0; row < logits->rows; row++){
+		const double *x = logits->data[row], *y = Y->data[row];
+		for(col = 0; col < logits->cols; col++){
+			loss += y[col] * ((max[col] - x[col]) + log_sum[col]);
+		}
+		/* Written after reading the row, so grad may be logits */
+		if(grad){
+			simd()->sub(logits->cols, x, max, work);
+			simd()->expv(logits->cols, work, work);
+			simd()->mul(logits->cols, work, sum, work);
+			simd()->sub(logits->cols, work, y, grad->data[row]);
+		}
+	}
+	arena_restore(scratch, mark);
+	return loss / samples;
+}
@@ -2,6 +2,9 @@
 #define LOSS_H
 double lmse(const Matrix* actual, const Matrix* pred);
 Matrix* dmse(const Matrix* actual, const Matrix* pred);
+double lxent(const Matrix* logits, const Matrix* Y);
+Matrix* dxent(const Matrix* logits, const Matrix* Y);
+double lxent2(const Matrix* logits, const Matrix* Y, int axis, Matrix* grad);
 typedef double (*lfunc)(const Matrix*, const Matrix*);
 typedef Matrix* (*lfuncd)(const Matrix*, const Matrix*);
 #endif
@@ -0,0 +1,152 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <pthread.h>
+#include "enn.h"
+#include "linalg.h"
+#include "mpool.h"
+
+/* Size-class pool of freed matrices. Programs tend to create and free matrices of the same few shapes
+(the layer sizes of their networks) over and over, so instead of going back to malloc, mfree() keeps up
+to MPOOL_DEPTH matrices of each shape and mnew() hands them out again. Each thread has its own pool, so
+no locking is needed; a matrix freed on another thread than it was made on simply joins that thread's
+pool. The shapes are direct-mapped onto MPOOL_CLASSES slots, and a slot is taken over by a new shape
+once it is empty. A thread keeps at most MPOOL_BYTES of storage. */
+
+/* Bytes of storage of a pooled matrix (which has no padding) */
+#define MPOOL_SIZE(x) ((size_t)(x)->rows * (x)->cols * sizeof(double))
+
+/* Freed matrices of one shape */
+struct mpool_class {
+	int rows;
+	int cols;
+	int count;
+	Matrix* items[MPOOL_DEPTH];
+};
+
+struct mpool {
+	struct mpool_class classes[MPOOL_CLASSES];
+	mpool_stats stats;
+};
+
+/* The calling thread's pool, also registered with mpool_key so it is emptied when the thread exits */
+static ENN_TLS struct mpool* mpool_local = NULL;
+static pthread_key_t mpool_key;
+static pthread_once_t mpool_key_once = PTHREAD_ONCE_INIT;
+
+#define MPOOL_SLOT(rows, cols) (((unsigned)(rows) * 31u + (unsigned)(cols)) % MPOOL_CLASSES)
+
+/**
+* Frees the matrices held by a pool.
+*/
+static void mpool_empty(struct mpool* pool){
+	int slot;
+
+	for(slot = 0; slot < MPOOL_CLASSES; slot++){
+		struct mpool_class* shape = &pool->classes[slot];
+		while(shape->count > 0){
+			free(shape->items[--shape->count]);
+		}
+	}
+	pool->stats.bytes = 0;
+}
+
+/**
+* Thread exit destructor for the pools.
+*/
+static void mpool_destroy(void* pool){
+	mpool_empty(pool);
+	free(pool);
+	mpool_local = NULL;
+}
+
+static void mpool_key_create(void){
+	pthread_key_create(&mpool_key, mpool_destroy);
+}
+
+/**
+* Returns the calling thread's pool, creating it on first use, or NULL on error.
+*/
+static struct mpool* mpool_this(void){
+	if(mpool_local)return mpool_local;
+	pthread_once(&mpool_key_once, mpool_key_create);
+	mpool_local = calloc(1, sizeof(struct mpool));
+	if(mpool_local)pthread_setspecific(mpool_key, mpool_local);
+	return mpool_local;
+}
+
+/**
+* Takes a freed matrix of the given shape from the calling thread's pool. Used by mnew().
+*
+* @param rows Number of rows.
+* @param cols Number of columns.
+*
+* @returns A pointer to the Matrix (with undefined contents), or NULL if there is none.
+*/
+Matrix* mpool_get(int rows, int cols){
+	struct mpool* pool = mpool_this();
+	struct mpool_class* shape;
+
+	if(!pool)return NULL;
+	shape = &pool->classes[MPOOL_SLOT(rows, cols)];
+	if(shape->count > 0 && shape->rows == rows && shape->cols == cols){
+		Matrix* x = shape->items[--shape->count];
+		pool->stats.hits++;
+		pool->stats.bytes -= MPOOL_SIZE(x);
+		return x;
+	}
+	pool->stats.misses++;
+	return NULL;
+}
+
+/**
+* Offers a matrix being freed to the calling thread's pool. Used by mfree().
+*
+* @param x A pointer to a Matrix allocated with malloc by mnew().
+*
+* @returns 1 if the pool kept the matrix, 0 if the caller has to free it.
+*/
+int mpool_put(Matrix* x){
+	struct mpool* pool = mpool_this();
+	struct mpool_class* shape;
+
+	if(!pool || !x)return 0;
+	if((size_t)x->rows * x->cols > MPOOL_MAX || x->stride != x->cols
+	   || pool->stats.bytes + MPOOL_SIZE(x) > (size_t)MPOOL_BYTES){
+		pool->stats.released++;
+		return 0;
+	}
+	shape = &pool->classes[MPOOL_SLOT(x->rows, x->cols)];
+	if(shape->count == 0){
+		shape->rows = x->rows;
+		shape->cols = x->cols;
+	}
+	if(shape->rows != x->rows || shape->cols != x->cols || shape->count == MPOOL_DEPTH){
+		pool->stats.released++;
+		return 0;
+	}
+	shape->items[shape->count++] = x;
+	pool->stats.recycled++;
+	pool->stats.bytes += MPOOL_SIZE(x);
+	return 1;
+}
+
+/**
+* Reads the counters of the calling thread's pool.
+*
+* @param stats Pointer to the counters to fill in.
+*/
+void mpool_stats_get(mpool_stats* stats){
+	struct mpool* pool = mpool_this();
+	mpool_stats zero = {0, 0, 0, 0, 0};
+
+	if(!stats)return;
+	*stats = pool ? pool->stats : zero;
+}
+
+/**
+* Gives every matrix held by the calling thread's pool back to the system allocator. The counters (other
+* than bytes) are kept.
+*/
+void mpool_clear(void){
+	if(mpool_local)mpool_empty(mpool_local);
+}
@@ -0,0 +1,29 @@
+#ifndef MPOOL_H
+#define MPOOL_H
+#include "linalg.h"
+/* Number of shapes each thread keeps freed matrices of */
+#define MPOOL_CLASSES 64
+/* Freed matrices kept per shape */
+#define MPOOL_DEPTH 4
+/* Matrices with more elements than this always go back to the system allocator */
+#define MPOOL_MAX 65536
+/* Most bytes of matrix storage each thread keeps, so long running programs with many threads do not
+hold on to large amounts of freed memory (without it, up to MPOOL_CLASSES * MPOOL_DEPTH * MPOOL_MAX
+doubles, 128 MB, per thread) */
+#define MPOOL_BYTES (8L << 20)
+
+/* Counters of the calling thread's pool */
+struct mpool_stats {
+	unsigned long hits; /* mnew() calls served from the pool */
+	unsigned long misses; /* mnew() calls that had to call malloc */
+	unsigned long recycled; /* mfree() calls that kept the matrix for reuse */
+	unsigned long released; /* mfree() calls that gave the matrix back to the system allocator */
+	size_t bytes; /* Bytes of matrix storage the pool holds now, at most MPOOL_BYTES */
+};
+typedef struct mpool_stats mpool_stats;
+
+Matrix* mpool_get(int rows, int cols);
+int mpool_put(Matrix* x);
+void mpool_stats_get(mpool_stats* stats);
+void mpool_clear(void);
+#endif
@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "enn.h"
+#include "linalg.h"
+#include "activ.h"
+#include "nn.h"
+#include "nfile.h"
+
+/* Binary save and zero-copy load of networks. nload() maps the file and points the weight and bias
+matrices straight into the mapping, so loading a model does not parse or copy it, and every process
+that loads the same file shares its pages in the page cache. The mapping is private: writing to the
+weights (e.g. training a loaded network) copies only the pages written, and never changes the file. */
+
+#define NFILE_BYTE_ORDER 0x01020304
+
+/**
+* Rounds a file offset up to the next NFILE_ALIGN boundary.
+*/
+static size_t nfile_align(size_t offset){
+	return (offset + NFILE_ALIGN - 1) / NFILE_ALIGN * NFILE_ALIGN;
+}
+
+/**
+* Writes zeros up to the next NFILE_ALIGN boundary.
+*
+* @returns The new offset, or 0 on error.
+*/
+static size_t nfile_pad(FILE* file, size_t offset){
+	static const char zeros[NFILE_ALIGN] = {0};
+	size_t padding = nfile_align(offset) - offset;
+
+	if(padding && fwrite(zeros, 1, padding, file) != padding)return 0;
+	return offset + padding;
+}
+
+/**
+* Writes the rows of a Matrix, without the padding between them.
+*
+* @returns The new offset, or 0 on error.
+*/
+static size_t nfile_write(FILE* file, size_t offset, const Matrix* a){
+	int row;
+
+	offset = nfile_pad(file, offset);
+	if(!offset)return 0;
+	for(row = 0; row < a->rows; row++){
+		if(fwrite(a->data[row], sizeof(double), a->cols, file) != (size_t)a->cols)return 0;
+	}
+	return offset + (size_t)a->rows * a->cols * sizeof(double);
+}
+
+/**
+* Saves a neural network to a binary file, which nload() can map back in.
+*
+* @param nn A pointer to the neural network to save.
+* @param path The file to (over)write.
+*
+* @returns 1 on success, 0 on error or if an activation function has no ID (see aid()).
+*/
+int nsave(const neural_network* nn, const char* path){
+	nfile_header header;
+	FILE* file;
+	size_t offset;
+	int layer, neurons, ok;
+
+	if(!nn || !path || !nn->weights || !nn->biases || nn->n_layers < 2)return 0;
+	memcpy(header.magic, NFILE_MAGIC, sizeof(header.magic));
+	header.version = NFILE_VERSION;
+	header.byte_order = NFILE_BYTE_ORDER;
+	header.n_layers = nn->n_layers;
+	header.hidden_activ = aid(nn->hidden_activ);
+	header.output_activ = nn->output_activ ? ACTIV_SMAX : ACTIV_NONE;
+	header.value_size = sizeof(double);
+	if(header.hidden_activ < 0 || (nn->output_activ && nn->output_activ != asmax))return 0;
+
+	file = fopen(path, "wb");
+	if(!file)return 0;
+	ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for(layer = 0; ok && layer < nn->n_layers; layer++){
+		neurons = layer ? nn->weights[layer - 1]->rows : nn->weights[0]->cols;
+		ok = fwrite(&neurons, sizeof(int), 1, file) == 1;
+	}
+	offset = sizeof(header) + nn->n_layers * sizeof(int);
+	for(layer = 0; ok && layer < nn->n_layers - 1; layer++){
+		offset = nfile_write(file, offset, nn->weights[layer]);
+		if(offset)offset = nfile_write(file, offset, nn->biases[layer]);
+		ok = offset != 0;
+	}
+	if(fclose(file) != 0)ok = 0;
+
+	return ok;
+}
+
+/**
+* Loads a neural network saved by nsave(). The file is memory mapped and the weights and biases are
+* used in place, see MATRIX_EXTERN. nfree() unmaps it.
+*
+* @param path The file to load.
+*
+* @returns A pointer to the neural network, or NULL on error or if the file is not a valid saved network.
+*/
+neural_network* nload(const char* path){
+	neural_network* nn = NULL;
+	nfile_header header;
+	const int* neurons;
+	struct stat info;
+	char* map;
+	size_t size, offset;
+	int fd, layer, ok = 1;
+
+	if(!path)return NULL;
+	fd = open(path, O_RDONLY);
+	if(fd < 0)return NULL;
+	if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(header)){
+		close(fd);
+		return NULL;
+	}
+	size = info.st_size;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)return NULL;
+
+	/* Check the header and the layer sizes before trusting any offsets */
+	memcpy(&header, map, sizeof(header));
+	if(memcmp(header.magic, NFILE_MAGIC, sizeof(header.magic)) || header.version != NFILE_VERSION
+	   || header.byte_order != NFILE_BYTE_ORDER || header.value_size != sizeof(double) || header.n_layers < 2
+	   || (size - sizeof(header)) / sizeof(int) < (size_t)header.n_layers
+	   || (header.hidden_activ != ACTIV_NONE && !abyid(header.hidden_activ))
+	   || (header.output_activ != ACTIV_NONE && header.output_activ != ACTIV_SMAX)){
+		nunmap(map, size);
+		return NULL;
+	}
+	neurons = (const int*)(map + sizeof(header));
+	offset = sizeof(header) + header.n_layers * sizeof(int);
+	for(layer = 0; ok && layer < header.n_layers - 1; layer++){
+		double bytes = ((double)neurons[layer + 1] * neurons[layer] + neurons[layer + 1]) * sizeof(double);
+		ok = neurons[layer] > 0 && neurons[layer + 1] > 0 && bytes + 2 * NFILE_ALIGN <= (double)size;
+		if(ok){
+			offset = nfile_align(offset) + (size_t)neurons[layer + 1] * neurons[layer] * sizeof(double);
+			offset = nfile_align(offset) + (size_t)neurons[layer + 1] * sizeof(double);
+			ok = offset <= size;
+		}
+	}
+	if(!ok){
+		nunmap(map, size);
+		return NULL;
+	}
+
+	nn = malloc(sizeof(neural_network));
+	if(!nn){
+		nunmap(map, size);
+		return NULL;
+	}
+	nn->n_layers = header.n_layers;
+	nactiv(nn, header.hidden_activ, header.output_activ); /* Both IDs were checked above */
+	nn->map = map;
+	nn->map_size = size;
+	nn->weights = calloc(nn->n_layers - 1, sizeof(Matrix*));
+	nn->biases = calloc(nn->n_layers - 1, sizeof(Matrix*));
+	if(!nn->weights || !nn->biases){
+		free(nn->weights);
+		free(nn->biases);
+		free(nn);
+		nunmap(map, size);
+		return NULL;
+	}
+
+	/* Point the matrices into the mapping */
+	offset = sizeof(header) + header.n_layers * sizeof(int);
+	for(layer = 0; ok && layer < nn->n_layers - 1; layer++){
+		offset = nfile_align(offset);
+		nn->weights[layer] = mwrap(neurons[layer + 1], neurons[layer], neurons[layer], (double*)(map + offset));
+		offset = nfile_align(offset + (size_t)neurons[layer + 1] * neurons[layer] * sizeof(double));
+		nn->biases[layer] = mwrap(neurons[layer + 1], 1, 1, (double*)(map + offset));
+		offset += (size_t)neurons[layer + 1] * sizeof(double);
+		ok = nn->weights[layer] && nn->biases[layer];
+	}
+	if(!ok){
+		nfree(nn);
+		return NULL;
+	}
+
+	return nn;
+}
+
+/**
+* Unmaps a model file mapped by nload(). Used by nfree().
+*
+* @param map The start of the mapping.
+* @param size The size of the mapping in bytes.
+*/
+void nunmap(void* map, size_t size){
+	if(map)munmap(map, size);
+}
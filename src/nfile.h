@@ -0,0 +1,26 @@
+#ifndef NFILE_H
+#define NFILE_H
+#include "nn.h"
+/* Saved network format, see nsave() */
+#define NFILE_MAGIC "ENNMODEL"
+#define NFILE_VERSION 1
+/* Every weight and bias blob starts on a multiple of this many bytes from the start of the file */
+#define NFILE_ALIGN 64
+
+/* The start of a saved network. The header is followed by n_layers ints (neurons per layer), then for
+each of the n_layers - 1 layers its weights (row-major) and biases as NFILE_ALIGN aligned blobs */
+struct nfile_header {
+	char magic[8]; /* NFILE_MAGIC, not NUL terminated */
+	int version; /* NFILE_VERSION */
+	int byte_order; /* 0x01020304 as written, files from a machine of another byte order are rejected */
+	int n_layers;
+	int hidden_activ; /* activ_id of the hidden activation */
+	int output_activ; /* ACTIV_NONE or ACTIV_SMAX */
+	int value_size; /* sizeof(double) */
+};
+typedef struct nfile_header nfile_header;
+
+int nsave(const neural_network* nn, const char* path);
+neural_network* nload(const char* path);
+void nunmap(void* map, size_t size);
+#endif
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "enn.h"
+#include "linalg.h"
+#include "activ.h"
+#include "nn.h"
+#include "ngen.h"
+
+/* Generates C source for an executor specialized to one network. Everything npred() resolves at run
+time is fixed in the code: the number of layers, their shapes and the activation functions, and for
+small layers the weights themselves, with the terms of zero weights left out. The compiler then sees
+straight-line code of constant shape it can fully schedule and vectorize, with no loops, function
+pointers or Matrix bookkeeping left. The make codegen target runs it on a saved network. */
+
+/**
+* Returns the C statement applying an activation function to z in generated code, with the same
+* formula as the library version, "" for none, or NULL if it cannot be generated.
+*/
+static const char* ngen_activ(int id){
+	switch(id){
+	case ACTIV_NONE:
+	case ACTIV_LIN:
+		return "";
+	case ACTIV_RELU:
+		return "z = (z >= 0) ? z : 0;";
+	case ACTIV_LRELU:
+		return "z = (z >= 0) ? z : 0.01 * z;";
+	case ACTIV_SIGM:
+		return "z = 1 / (1 + exp(-z));";
+	case ACTIV_TANH:
+		return "z = tanh(z);";
+	case ACTIV_GELU:
+		return "z = z / (1 + exp(-2 * 0.79788456080286535588 * (z + 0.044715 * z * z * z)));";
+	case ACTIV_ELU:
+		return "z = (z >= 0) ? z : exp(z) - 1;";
+	default:
+		return NULL;
+	}
+}
+
+/**
+* Returns nonzero if name is a C identifier.
+*/
+static int ngen_name(const char* name){
+	size_t i;
+
+	if(!name || !(isalpha((unsigned char)name[0]) || name[0] == '_'))return 0;
+	for(i = 1; name[i]; i++){
+		if(!isalnum((unsigned char)name[i]) && name[i] != '_')return 0;
+	}
+	return 1;
+}
+
+/**
+* Returns nonzero if every element of a is finite, so it can be written as a C constant.
+*/
+static int ngen_finite(const Matrix* a){
+	int row, col;
+
+	for(row = 0; row < a->rows; row++){
+		for(col = 0; col < a->cols; col++){
+			if(a->data[row][col] - a->data[row][col] != 0)return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+* Opens dir/name.ext for writing.
+*/
+static FILE* ngen_open(const char* dir, const char* name, const char* ext, char** path){
+	FILE* file;
+
+	*path = malloc(strlen(dir) + strlen(name) + strlen(ext) + 2);
+	if(!*path)return NULL;
+	sprintf(*path, "%s/%s%s", dir, name, ext);
+	file = fopen(*path, "w");
+	if(!file){
+		free(*path);
+		*path = NULL;
+	}
+	return file;
+}
+
+/**
+* Writes the layer sizes of a network, such as 4-4-4-3.
+*/
+static void ngen_shape(FILE* file, const neural_network* nn){
+	int layer;
+
+	fprintf(file, "%d", nn->weights[0]->cols);
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		fprintf(file, "-%d", nn->weights[layer]->rows);
+	}
+}
+
+/**
+* Writes the weights and biases of a layer that is not unrolled as constant arrays.
+*/
+static void ngen_arrays(FILE* file, const char* name, int layer, const Matrix* w, const Matrix* b){
+	int row, col;
+
+	fprintf(file, "static const double %s_w%d[%d][%d] = {\n", name, layer, w->rows, w->cols);
+	for(row = 0; row < w->rows; row++){
+		fprintf(file, "\t{");
+		for(col = 0; col < w->cols; col++){
+			fprintf(file, "%s%.17g", col ? (col % 8 ? ", " : ",\n\t ") : "", w->data[row][col]);
+		}
+		fprintf(file, "}%s\n", row < w->rows - 1 ? "," : "");
+	}
+	fprintf(file, "};\nstatic const double %s_b%d[%d] = {", name, layer, b->rows);
+	for(row = 0; row < b->rows; row++){
+		fprintf(file, "%s%.17g", row ? (row % 8 ? ", " : ",\n\t") : "\n\t", b->data[row][0]);
+	}
+	fprintf(file, "\n};\n\n");
+}
+
+/**
+* Writes the code of one layer, out = activ(w * in + b). The products are summed in the order
+* npred() sums them, then the bias is added.
+*/
+static void ngen_layer(FILE* file, const char* name, int layer, const Matrix* w, const Matrix* b, const char* in,
+					   const char* out, const char* activ){
+	int row, col, terms;
+
+	fprintf(file, "\n\t/* Layer %d: %d inputs, %d outputs */\n", layer, w->cols, w->rows);
+	if((long)w->rows * w->cols > NGEN_UNROLL){
+		fprintf(file, "\tfor(i = 0; i < %d; i++){\n", w->rows);
+		fprintf(file, "\t\tz = 0;\n\t\tfor(j = 0; j < %d; j++){\n", w->cols);
+		fprintf(file, "\t\t\tz += %s_w%d[i][j] * %s[j];\n\t\t}\n", name, layer, in);
+		fprintf(file, "\t\tz += %s_b%d[i];\n", name, layer);
+		if(activ[0])fprintf(file, "\t\t%s\n", activ);
+		fprintf(file, "\t\t%s[i] = z;\n\t}\n", out);
+		return;
+	}
+
+	for(row = 0; row < w->rows; row++){
+		fprintf(file, "\tz = ");
+		terms = 0;
+		for(col = 0; col < w->cols; col++){
+			double weight = w->data[row][col];
+			if(weight == 0)continue;
+			if(terms)fprintf(file, terms % 4 ? " " : "\n\t\t");
+			if(terms)fprintf(file, weight < 0 ? "- " : "+ ");
+			else if(weight < 0)fprintf(file, "-");
+			fprintf(file, "%.17g * %s[%d]", weight < 0 ? -weight : weight, in, col);
+			terms++;
+		}
+		fprintf(file, "%s;\n", terms ? "" : "0");
+		if(b->data[row][0] != 0)fprintf(file, "\tz += %.17g;\n", b->data[row][0]);
+		if(activ[0])fprintf(file, "\t%s\n", activ);
+		fprintf(file, "\t%s[%d] = z;\n", out, row);
+	}
+}
+
+/**
+* Writes the prediction functions.
+*/
+static void ngen_pred(FILE* file, const neural_network* nn, const char* name, const char* upper, const char* activ){
+	char in[32], out[32];
+	int layer, last = nn->n_layers - 2, loops = 0, softmax = nn->output_activ != NULL;
+
+	for(layer = 0; layer <= last; layer++){
+		if((long)nn->weights[layer]->rows * nn->weights[layer]->cols > NGEN_UNROLL)loops = 1;
+	}
+
+	fprintf(file, "/**\n* Runs the network on one sample.\n*\n* @param x The %s_INPUTS inputs.\n", upper);
+	fprintf(file, "* @param out The %s_OUTPUTS outputs.\n*/\n", upper);
+	fprintf(file, "void %s_pred(const double* x, double* out){\n", name);
+	for(layer = 0; layer < last; layer++){
+		fprintf(file, "\tdouble h%d[%d];\n", layer, nn->weights[layer]->rows);
+	}
+	fprintf(file, "\tdouble z;\n");
+	if(softmax)fprintf(file, "\tdouble max, sum;\n");
+	if(loops || softmax)fprintf(file, "\tint i%s;\n", loops ? ", j" : "");
+
+	for(layer = 0; layer <= last; layer++){
+		if(layer)sprintf(in, "h%d", layer - 1);
+		else strcpy(in, "x");
+		if(layer < last)sprintf(out, "h%d", layer);
+		else strcpy(out, "out");
+		ngen_layer(file, name, layer, nn->weights[layer], nn->biases[layer], in, out, activ);
+	}
+
+	if(softmax){
+		fprintf(file, "\n\t/* Softmax, with the maximum subtracted first so exp cannot overflow */\n");
+		fprintf(file, "\tmax = out[0];\n\tfor(i = 1; i < %s_OUTPUTS; i++){\n", upper);
+		fprintf(file, "\t\tif(out[i] > max)max = out[i];\n\t}\n\tsum = 0;\n");
+		fprintf(file, "\tfor(i = 0; i < %s_OUTPUTS; i++){\n", upper);
+		fprintf(file, "\t\tout[i] = exp(out[i] - max);\n\t\tsum += out[i];\n\t}\n\tsum = 1 / sum;\n");
+		fprintf(file, "\tfor(i = 0; i < %s_OUTPUTS; i++){\n\t\tout[i] *= sum;\n\t}\n", upper);
+	}
+	fprintf(file, "}\n\n");
+
+	fprintf(file, "/**\n* Runs the network on a batch of samples, one sample per row.\n*\n");
+	fprintf(file, "* @param samples Number of samples.\n* @param X The inputs, samples x %s_INPUTS.\n", upper);
+	fprintf(file, "* @param out The outputs, samples x %s_OUTPUTS.\n*/\n", upper);
+	fprintf(file, "void %s_pred_batch(int samples, const double* X, double* out){\n\tint i;\n", name);
+	fprintf(file, "\tfor(i = 0; i < samples; i++){\n");
+	fprintf(file, "\t\t%s_pred(X + (size_t)i * %s_INPUTS, out + (size_t)i * %s_OUTPUTS);\n\t}\n}\n", name, upper,
+			upper);
+}
+
+/**
+* Generates a C executor specialized to a network: dir/name.h declares name_pred() and
+* name_pred_batch(), and dir/name.c defines them with the network's shapes, weights and activation
+* functions built in. The generated code is C90, needs only libm and gives the same outputs as
+* npred(), up to rounding. name_pred_batch() takes one sample per row, like npred_rows().
+*
+* @param nn A pointer to the neural network, typically loaded with nload().
+* @param name Prefix of the generated files and functions, a C identifier.
+* @param dir Directory to write the files to.
+*
+* @returns 1 on success, 0 on error, if name is not a C identifier, if an activation function has no
+* ID (see aid()) or if a weight or bias is not finite.
+*/
+int ngen(const neural_network* nn, const char* name, const char* dir){
+	FILE *header, *source;
+	char *header_path, *source_path, *upper;
+	const char* activ;
+	int layer, ok = 1;
+	size_t i;
+
+	if(!nn || !dir || !ngen_name(name) || !nn->weights || !nn->biases || nn->n_layers < 2)return 0;
+	activ = ngen_activ(aid(nn->hidden_activ));
+	if(!activ || (nn->output_activ && nn->output_activ != asmax))return 0;
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		if(!ngen_finite(nn->weights[layer]) || !ngen_finite(nn->biases[layer]))return 0;
+	}
+
+	upper = malloc(strlen(name) + 1);
+	if(!upper)return 0;
+	for(i = 0; name[i]; i++){
+		upper[i] = toupper((unsigned char)name[i]);
+	}
+	upper[i] = '\0';
+	header = ngen_open(dir, name, ".h", &header_path);
+	source = header ? ngen_open(dir, name, ".c", &source_path) : NULL;
+	if(!source){
+		if(header){
+			fclose(header);
+			remove(header_path);
+			free(header_path);
+		}
+		free(upper);
+		return 0;
+	}
+
+	fprintf(header, "/* Generated by ngen() for a ");
+	ngen_shape(header, nn);
+	fprintf(header, " network, do not edit */\n#ifndef %s_H\n#define %s_H\n", upper, upper);
+	fprintf(header, "#define %s_INPUTS %d\n", upper, nn->weights[0]->cols);
+	fprintf(header, "#define %s_OUTPUTS %d\n\n", upper, nn->weights[nn->n_layers - 2]->rows);
+	fprintf(header, "void %s_pred(const double* x, double* out);\n", name);
+	fprintf(header, "void %s_pred_batch(int samples, const double* X, double* out);\n#endif\n", name);
+
+	fprintf(source, "/* Generated by ngen() for a ");
+	ngen_shape(source, nn);
+	fprintf(source, " network, do not edit */\n#include <stddef.h>\n#include <math.h>\n#include \"%s.h\"\n\n", name);
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		if((long)nn->weights[layer]->rows * nn->weights[layer]->cols > NGEN_UNROLL){
+			ngen_arrays(source, name, layer, nn->weights[layer], nn->biases[layer]);
+		}
+	}
+	ngen_pred(source, nn, name, upper, activ);
+
+	if(ferror(header) || ferror(source))ok = 0;
+	if(fclose(header) != 0)ok = 0;
+	if(fclose(source) != 0)ok = 0;
+	if(!ok){
+		remove(header_path);
+		remove(source_path);
+	}
+	free(header_path);
+	free(source_path);
+	free(upper);
+
+	return ok;
+}
@@ -0,0 +1,9 @@
+#ifndef NGEN_H
+#define NGEN_H
+#include "nn.h"
+/* Layers with at most this many weights are fully unrolled, with the weights as constants in the code.
+Larger layers are loops of constant length over constant arrays */
+#define NGEN_UNROLL 1024
+
+int ngen(const neural_network* nn, const char* name, const char* dir);
+#endif
@@ -3,6 +3,9 @@
 #include "linalg.h"
 #include "loss.h"
 #include "nn.h"
+#include "simd.h"
+#include "arena.h"
+#include "nfile.h"
 
 #ifdef NN_DBG
 #define D if(1)
@@ -36,7 +39,10 @@ neural_network* ninit(int inputs, int hidden_layers, int hiddens, int outputs, d
 	nn->weights = malloc((nn->n_layers - 1) * sizeof(Matrix*));
 	nn->biases = malloc((nn->n_layers - 1) * sizeof(Matrix*));
 	nn->hidden_activ = hidden_activ;
+	nn->hidden_deriv = aderiv(hidden_activ);
 	nn->output_activ = output_activ;
+	nn->map = NULL;
+	nn->map_size = 0;
 	if(!nn->weights || !nn->biases){
 		free(nn->weights);
 		free(nn->biases);
@@ -69,15 +75,40 @@ neural_network* ninit(int inputs, int hidden_layers, int hiddens, int outputs, d
 */
 void nfree(neural_network* nn){
 	int i;
-	for(i = 0; i < nn->n_layers; i++) {
+	if(!nn) return;
+	/* There are 1 less weights than layers */
+	for(i = 0; i < nn->n_layers - 1; i++) {
 		mfree(nn->weights[i]);
 		mfree(nn->biases[i]);
 	}
 	free(nn->weights);
 	free(nn->biases);
+	if(nn->map)nunmap(nn->map, nn->map_size);
 	free(nn);
 }
 
+/**
+* Selects the activation functions of a neural network by ID (see activ.h), the way saved networks
+* store them. The derivative is paired as ninit() does, and mapply() and mdense() pick up the
+* whole-buffer version of the function, if it has one.
+*
+* @param nn A pointer to the neural network.
+* @param hidden_id ID of the input/hidden layer activation, such as ACTIV_SIGM, or ACTIV_NONE.
+* @param output_id ID of the output layer activation, ACTIV_SMAX or ACTIV_NONE.
+*
+* @returns 1 on success, 0 if an ID is unknown (the network is then unchanged).
+*/
+int nactiv(neural_network* nn, int hidden_id, int output_id){
+	dfunc hidden_activ = abyid(hidden_id);
+
+	if(!nn || (hidden_id != ACTIV_NONE && !hidden_activ))return 0;
+	if(output_id != ACTIV_NONE && output_id != ACTIV_SMAX)return 0;
+	nn->hidden_activ = hidden_activ;
+	nn->hidden_deriv = aderiv(hidden_activ);
+	nn->output_activ = (output_id == ACTIV_SMAX) ? asmax : NULL;
+	return 1;
+}
+
 /**
 * Runs the feedforward network
 *
@@ -89,34 +120,36 @@ void nfree(neural_network* nn){
 
 Matrix* npred(const neural_network* nn, const Matrix* x){
 	int layer;
-	Matrix *current_vector, *product, *sum;
+	Matrix *current_vector = NULL, *sum;
+	arena *scratch, *previous;
+	arena_mark mark;
 
-	if(!nn || !x || !nn->weights || !nn->biases)return NULL;
+	if(!nn || !x || !nn->weights || !nn->biases || nn->n_layers < 2)return NULL;
+	scratch = arena_scratch();
+	if(!scratch)return NULL;
+
+	/* The hidden layer outputs are temporaries, so they come from the scratch arena. The last layer and
+	the output activation are allocated the way the caller's matrices are */
+	mark = arena_save(scratch);
+	previous = arena_use(scratch);
 
-	current_vector = mscale(x, 1.0, NULL);
 	/* There are 1 less weights than layers */
 	for(layer = 0; layer < nn->n_layers - 1; layer++){
-		/* Apply the weights and biases */
-		product = mmul(nn->weights[layer], current_vector, NULL);
-		D printf("Product:\n");
-		D mprint(product);
+		if(layer == nn->n_layers - 2)arena_use(previous);
+		/* Apply the weights, biases and activation function in one pass (the first layer reads x directly) */
 		D printf("biases:\n");
 		D mprint(nn->biases[layer]);
-		D printf("Sum:\n");
-		sum = madd(product, nn->biases[layer], NULL); /* Segfault here */
+		sum = mdense(nn->weights[layer], layer ? current_vector : x, nn->biases[layer], nn->hidden_activ, NULL);
+		D printf("Layer output:\n");
 		D mprint(sum);
 		mfree(current_vector);
-		mfree(product);
-
-		/* Apply the activation function, if it exists, but not on the output layer */
-		if(nn->hidden_activ && layer < nn->n_layers-1){
-			current_vector = mapply(sum, nn->hidden_activ, NULL);
-		}
-		else{
-			current_vector = mscale(sum, 1.0, NULL);
-		}
-		mfree(sum);
+		current_vector = sum;
+		if(!current_vector)break;
 	}
+	/* A caller whose own allocations come from the scratch arena keeps everything until its restore */
+	arena_use(previous);
+	if(previous != scratch)arena_restore(scratch, mark);
+	if(!current_vector)return NULL;
 
 	/* Apply output activation, if applicable */
 	if(nn->output_activ){
@@ -129,6 +162,227 @@ Matrix* npred(const neural_network* nn, const Matrix* x){
 	return current_vector;
 }
 
+/**
+* Applies a Matrix activation function (such as softmax) to each column of a, in place.
+*/
+static int ncolumns_activ(Matrix* a, mfunc activ){
+	Matrix *column, *activated;
+	int row, col;
+
+	/* Softmax has an in-place, column-wise version that does not allocate */
+	if(activ == asmax){
+		asmaxc(a);
+		return 1;
+	}
+
+	column = mnew(a->rows, 1);
+	if(!column)return 0;
+	for(col = 0; col < a->cols; col++){
+		for(row = 0; row < a->rows; row++){
+			column->data[row][0] = a->data[row][col];
+		}
+		activated = activ(column);
+		if(!activated){
+			mfree(column);
+			return 0;
+		}
+		for(row = 0; row < a->rows; row++){
+			a->data[row][col] = activated->data[row][0];
+		}
+		mfree(activated);
+	}
+	mfree(column);
+	return 1;
+}
+
+/**
+* Runs the feedforward network on a whole batch of samples at once. Each layer is one matrix-matrix
+* multiplication followed by a single pass that adds the bias and applies the activation function.
+*
+* @param nn A pointer to a neural network structure
+* @param X The inputs to predict on, one sample per column (inputs x samples).
+* @param out Pointer to output matrix (optional, outputs x samples).
+*
+* @returns The neural network outputs, one column per sample.
+*/
+Matrix* npred_batch(const neural_network* nn, const Matrix* X, Matrix* out){
+	int layer, last, ok = 1;
+	Matrix *current = NULL, *next;
+	arena *scratch, *previous;
+	arena_mark mark;
+
+	if(!nn || !X || !nn->weights || !nn->biases || nn->n_layers < 2)return NULL;
+	if(X->rows != nn->weights[0]->cols)return NULL;
+	scratch = arena_scratch();
+	if(!scratch)return NULL;
+
+	/* Hidden layer outputs come from the scratch arena, see npred() */
+	mark = arena_save(scratch);
+	previous = arena_use(scratch);
+
+	/* There are 1 less weights than layers */
+	last = nn->n_layers - 2;
+	for(layer = 0; layer <= last; layer++){
+		/* The last layer is written straight into out */
+		/* Apply the weights, biases and activation function in one pass, as npred() does for every layer */
+		if(layer == last)arena_use(previous);
+		next = mdense(nn->weights[layer], layer ? current : X, nn->biases[layer], nn->hidden_activ,
+					  layer == last ? out : NULL);
+		if(layer)mfree(current);
+		current = next;
+		if(!current)break;
+	}
+
+	/* Apply output activation to each sample, if applicable */
+	arena_use(scratch);
+	if(current && nn->output_activ && !ncolumns_activ(current, nn->output_activ)){
+		arena_use(previous);
+		if(current != out)mfree(current);
+		ok = 0;
+	}
+	arena_use(previous);
+	if(previous != scratch)arena_restore(scratch, mark);
+
+	return ok ? current : NULL;
+}
+
+/**
+* Runs the feedforward network on a batch of samples stored one per row, the layout ntrain(),
+* nbprop_batch() and dsnext() use, so their batches can be predicted on directly. The outputs are those
+* of npred_batch(), one row per sample.
+*
+* @param nn A pointer to a neural network structure
+* @param X The inputs to predict on, one sample per row (samples x inputs).
+* @param out Pointer to output matrix (optional, samples x outputs).
+*
+* @returns The neural network outputs, one row per sample, or NULL on error.
+*/
+Matrix* npred_rows(const neural_network* nn, const Matrix* X, Matrix* out){
+	Matrix *inputs, *outputs;
+
+	if(!nn || !X || !nn->weights || nn->n_layers < 2)return NULL;
+	if(X->cols != nn->weights[0]->cols)return NULL;
+	if(out && (out->rows != X->rows || out->cols != nn->weights[nn->n_layers - 2]->rows))return NULL;
+
+	/* The transposes are O(samples x width), small next to the products of the layers */
+	inputs = mtrns(X, NULL);
+	outputs = npred_batch(nn, inputs, NULL);
+	mfree(inputs);
+	if(!outputs)return NULL;
+	out = mtrns(outputs, out);
+	mfree(outputs);
+
+	return out;
+}
+
+/**
+* Creates a prediction plan: a workspace holding everything npred needs, so that predictions made
+* with nplan_pred() do not allocate any memory.
+*
+* @param nn A pointer to the neural network to predict with. It must outlive the plan, and its layer
+* shapes must not change.
+* @param batch The maximum number of samples (columns) per call to nplan_pred().
+*
+* @returns A pointer to the plan, or NULL on error.
+*/
+nplan* nplan_new(const neural_network* nn, int batch){
+	nplan* plan;
+	int layer, widest = 0;
+
+	if(!nn || !nn->weights || !nn->biases || nn->n_layers < 2 || batch < 1)return NULL;
+
+	/* Find the widest layer, which sets the height of the activation buffers */
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		if(nn->weights[layer]->rows > widest)widest = nn->weights[layer]->rows;
+	}
+
+	plan = malloc(sizeof(nplan));
+	if(!plan)return NULL;
+	plan->nn = nn;
+	plan->batch = batch;
+	plan->buffers[0] = mnew(widest, batch);
+	plan->buffers[1] = mnew(widest, batch);
+	if(!plan->buffers[0] || !plan->buffers[1]){
+		nplan_free(plan);
+		return NULL;
+	}
+	/* Each view starts as a copy of its buffer's header. Its rows and cols are set per layer and per
+	call, while the stride (and so the row pointers) stay those of the full buffer */
+	plan->views[0] = *plan->buffers[0];
+	plan->views[1] = *plan->buffers[1];
+
+	return plan;
+}
+
+/**
+* Frees a prediction plan. The neural network it was made for is not freed.
+*
+* @param plan A pointer to the plan to free.
+*/
+void nplan_free(nplan* plan){
+	if(!plan)return;
+	mfree(plan->buffers[0]);
+	mfree(plan->buffers[1]);
+	free(plan);
+}
+
+/**
+* Runs the feedforward network using a prediction plan. Layers alternate between the two activation
+* buffers of the plan, so no memory is allocated.
+*
+* @param plan A pointer to a plan made by nplan_new().
+* @param X The inputs to predict on, one sample per column (inputs x samples, at most plan->batch
+* samples).
+*
+* @returns The neural network outputs, one column per sample. The Matrix belongs to the plan and is
+* overwritten by the next call.
+*/
+const Matrix* nplan_pred(nplan* plan, const Matrix* X){
+	const neural_network* nn;
+	const Matrix* current;
+	Matrix* next = NULL;
+	int layer;
+
+	if(!plan || !X || X->cols > plan->batch)return NULL;
+	nn = plan->nn;
+	if(X->rows != nn->weights[0]->cols)return NULL;
+
+	current = X;
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		/* Write into the buffer not holding the current activations */
+		next = &plan->views[layer % 2];
+		next->rows = nn->weights[layer]->rows;
+		next->cols = X->cols;
+		if(!mdense(nn->weights[layer], current, nn->biases[layer], nn->hidden_activ, next))return NULL;
+		current = next;
+	}
+
+	/* Apply output activation to each sample, if applicable */
+	if(nn->output_activ && !ncolumns_activ(next, nn->output_activ))return NULL;
+
+	return next;
+}
+
+/**
+* Multiplies delta by the derivative of the activation function, delta = delta * f'(z), in a single pass.
+*
+* @param delta The layer delta to update in place.
+* @param activation The activation output of the layer, f(z), with the same shape as delta.
+* @param deriv The derivative of f in terms of its output, e.g. dsigm for asigm.
+*/
+static void nhad_deriv(Matrix* delta, const Matrix* activation, dfunc deriv){
+	int row, col;
+
+	for(row = 0; row < delta->rows; row++){
+		double* drow = delta->data[row];
+		const double* arow = activation->data[row];
+		for(col = 0; col < delta->cols; col++){
+			drow[col] *= deriv(arow[col]);
+		}
+	}
+}
+
+/* Numerical derivative of activ_func at x, for activation functions without a known derivative */
 static Matrix* ndiff(const Matrix* x, const dfunc activ_func){
 	double h = 0.000001;
 	Matrix *activ_x, *activ_xh, *xh, *d_activ;
@@ -148,235 +402,248 @@ static Matrix* ndiff(const Matrix* x, const dfunc activ_func){
 	/* Denominator (divide by h) */
 	d_activ = mscale(d_activ, 1.0/h, d_activ);
 
-	free(activ_xh);
-	free(activ_x);
+	mfree(xh);
+	mfree(activ_xh);
+	mfree(activ_x);
 	return d_activ;
 }
 
 /**
-* Run backpropagation
+* Allocates a set of gradients shaped like the weights and biases of a neural network, filled with
+* zeros.
+*
+* @param nn A pointer to the neural network.
+*
+* @returns A Matrix*** holding Matrix** nabla_w and Matrix** nabla_b, as returned by nbprop().
+*/
+Matrix*** ngrad_new(const neural_network* nn){
+	Matrix ***nablas, **nabla_w, **nabla_b;
+	int layer, n_weights;
+
+	if(!nn || nn->n_layers < 2)return NULL;
+	n_weights = nn->n_layers - 1;
+
+	nablas = malloc(2 * sizeof(Matrix**));
+	nabla_w = calloc(n_weights, sizeof(Matrix*));
+	nabla_b = calloc(n_weights, sizeof(Matrix*));
+	if(!nablas || !nabla_w || !nabla_b){
+		free(nablas);
+		free(nabla_w);
+		free(nabla_b);
+		return NULL;
+	}
+	nablas[0] = nabla_w;
+	nablas[1] = nabla_b;
+
+	for(layer = 0; layer < n_weights; layer++){
+		nabla_w[layer] = mconst(nn->weights[layer]->rows, nn->weights[layer]->cols, 0.0, NULL);
+		nabla_b[layer] = mconst(nn->biases[layer]->rows, nn->biases[layer]->cols, 0.0, NULL);
+		if(!nabla_w[layer] || !nabla_b[layer]){
+			ngrad_free(nn, nablas);
+			return NULL;
+		}
+	}
+
+	return nablas;
+}
+
+/**
+* Resets a set of gradients to zero, e.g. before accumulating the next mini-batch.
+*
+* @param nn A pointer to the neural network the gradients belong to.
+* @param grads The gradients, as returned by ngrad_new().
+*/
+void ngrad_zero(const neural_network* nn, Matrix*** grads){
+	int layer;
+
+	if(!nn || !grads)return;
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		mconst(grads[0][layer]->rows, grads[0][layer]->cols, 0.0, grads[0][layer]);
+		mconst(grads[1][layer]->rows, grads[1][layer]->cols, 0.0, grads[1][layer]);
+	}
+}
+
+/**
+* Frees a set of gradients.
+*
+* @param nn A pointer to the neural network the gradients belong to.
+* @param grads The gradients, as returned by ngrad_new() or nbprop().
+*/
+void ngrad_free(const neural_network* nn, Matrix*** grads){
+	int layer;
+
+	if(!nn || !grads)return;
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		mfree(grads[0][layer]);
+		mfree(grads[1][layer]);
+	}
+	free(grads[0]);
+	free(grads[1]);
+	free(grads);
+}
+
+/**
+* Run backpropagation on a mini-batch. The forward and backward passes process the whole batch at once,
+* so every step is a matrix-matrix multiplication.
 *
 * @param nn A constant pointer to the neural network to backpropagate.
-* @param X_train A pointer to the Matrix row from the training dataset to backpropagate on.
-* @param y_train A pointer to the Matrix desired output for the row of the training dataset.
-* @param loss_func A function pointer to the loss function.
+* @param X A pointer to the Matrix of training inputs, one sample per row (samples x inputs).
+* @param Y A pointer to the Matrix of desired outputs, one sample per row (samples x outputs).
 * @param dloss_func A function pointer to the derivative of the loss function.
+* @param grads The gradients (from ngrad_new()) to accumulate into. The gradients of the samples are
+* summed, so scale by learning_rate / samples when updating, like update_mini_batch in network.py.
 *
-* @returns A Matrix*** of the gradients for the weights and biases. (Contains Matrix** nabla_w, Matrix** nabla_b)
+* @returns 1 on success, 0 on error.
 */
-Matrix*** nbprop(const neural_network* nn, const Matrix* X_train, const Matrix* y_train, const lfunc loss_func,
-				 const lfuncd dloss_func){
+int nbprop_batch(const neural_network* nn, const Matrix* X, const Matrix* Y, const lfuncd dloss_func,
+				 Matrix*** grads){
 	/* http://neuralnetworksanddeeplearning.com/chap2.html#the_code_for_backpropagation */
 	/* Nabla_b and nabla_w are gradients of the biases and weights respectively. They are lists of Matrices
 	just as the weights and biases are in the neural network structure */
 	Matrix **nabla_b, **nabla_w;
-	Matrix*** nablas; /* Holds both the weight and bias gradients */
-	Matrix **Zs; /* A list of Z vectors (unactivated outputs) for each layer */
-	Matrix **activations = NULL; /* A list of activations for each layer */
-	Matrix *z = NULL; /* Current z (unactivated layer output) vector */
-	Matrix *activation = NULL; /* Current activation */
+	Matrix **Zs; /* A list of Z matrices (unactivated outputs, one column per sample) for each layer */
+	Matrix **activations; /* A list of activations for each layer */
+	Matrix *delta = NULL; /* Delta for current layer */
 	Matrix *activationp; /* Activation prime */
-	Matrix *last_activation; /* Activation of last layer */
-	Matrix *err; /* Error (output of loss function) */
-	Matrix *delta; /* Delta for current layer */
-	Matrix *tmp = NULL, *tmp2 = NULL; /* Temporary variables for calculations */
-	int layer, layer_fwd;
-	size_t list_size;
+	Matrix *tmp, *trns; /* Temporary variables for calculations */
+	arena *scratch, *previous;
+	arena_mark mark;
+	int layer, row, n_weights, ok = 1;
 
 	/* Check for nulls */
-	if(!nn || !X_train || !y_train || !loss_func) return NULL;
-	/* Make sure we only have 1 row of data */
-	if(X_train->rows != 1 || y_train->rows != 1) return NULL;
+	if(!nn || !X || !Y || !dloss_func || !grads || nn->n_layers < 2) return 0;
+	/* There are n_layers - 1 weights/biases in the network */
+	n_weights = nn->n_layers - 1;
 	/* Make sure training data is right size */
-	if(X_train->cols != nn->weights[0]->cols) return NULL;
-
-	/* Allocate variables */
-	list_size = nn->n_layers * sizeof(Matrix*);
-	/* nabla_b = [np.zeros(b.shape) for b in self.biases] */
-	nabla_b = malloc(list_size);
-	/* nabla_w = [np.zeros(w.shape) for w in self.weights] */
-	nabla_w = malloc(list_size);
+	if(X->rows != Y->rows || X->cols != nn->weights[0]->cols || Y->cols != nn->weights[n_weights - 1]->rows){
+		return 0;
+	}
+	nabla_w = grads[0];
+	nabla_b = grads[1];
+
+	/* Every temporary comes from the scratch arena and is given back in one step at the end, so the
+	passes below never call malloc once the arena has grown to fit a batch */
+	scratch = arena_scratch();
+	if(!scratch)return 0;
+	mark = arena_save(scratch);
+	previous = arena_use(scratch);
+
 	/* zs = [] */
-	Zs = calloc(list_size + 1, sizeof(Matrix*));
-	/* activations = [x] */
-	activations = calloc(list_size + 1, sizeof(Matrix*));
-
-	/* Get data from designated row of X_train and y_train for stochastic gradient descent */
-	/*
-	MDUP(&X_train->data[index], cur_X_train, 1, X_train->cols);
-	MDUP(&y_train->data[index], cur_y_train, 1, y_train->cols);
-	*/
-
-	/* Set initial activation to the row of training data (cur_X_train we are training on */
-	/* activation = x */
-	activation = mscale(X_train, 1.0, NULL);
-	activations[0] = activation;
-
-	/* Run the forward propagation (prediction) pass. There are n_layers - 1 weights/biases in the network*/
+	Zs = arena_alloc(scratch, n_weights * sizeof(Matrix*));
+	/* activations = [x], with the samples as columns */
+	activations = arena_alloc(scratch, (n_weights + 1) * sizeof(Matrix*));
+	ok = Zs && activations;
+	for(layer = 0; ok && layer < n_weights; layer++){
+		Zs[layer] = NULL;
+	}
+	if(ok){
+		activations[0] = mtrns(X, NULL);
+		ok = activations[0] != NULL;
+	}
+
+	/* Run the forward propagation (prediction) pass */
 	/* for b, w in zip(self.biases, self.weights): */
-	D printf("Starting forward propagation!\n");
-	for(layer = 0; layer < nn->n_layers - 1; layer++){
-		Matrix *weight, *bias;
-		bias = nn->biases[layer];
-		weight = nn->weights[layer];
-		D printf("===========================================\n");
-		D printf("Forward prop Layer: %d\n", layer);
-		D printf("Bias:\n");
-		D mprint(bias);
-		D printf("Weight:\n");
-		D mprint(weight);
-		D printf("Last Activation:\n");
-		D mprint(activation);
-
-		/* Calculate Z (unactivated layer output) */
+	for(layer = 0; ok && layer < n_weights; layer++){
 		/* z = np.dot(w, activation)+b */
-		z = mmul(weight, activation, NULL);
-		z = madd(z, bias, z); /* Addition is in-place, so we don't need an extra variable */
-		D printf("Current Z:\n");
-		D mprint(z);
-		/* zs.append(z)  */
-		Zs[layer] = z;
-
-		/* Calculate the activation by applying it to Z (the output of the layer before activtion) */
 		/* activation = sigmoid(z) */
-		activation = mapply(z, nn->hidden_activ, NULL);
-		/* activations.append(activation) */
-		activations[layer + 1] = activation;
-		D printf("Current activation:\n");
-		D mprint(z);
+		if(nn->hidden_deriv || !nn->hidden_activ){
+			/* The derivative only needs the activation, so Z (unactivated layer output) is never stored */
+			activations[layer + 1] = mdense(nn->weights[layer], activations[layer], nn->biases[layer],
+											nn->hidden_activ, NULL);
+		}
+		else{
+			/* Keep Z for the numerical derivative */
+			Zs[layer] = mdense(nn->weights[layer], activations[layer], nn->biases[layer], NULL, NULL);
+			activations[layer + 1] = Zs[layer] ? mapply(Zs[layer], nn->hidden_activ, NULL) : NULL;
+		}
+		ok = activations[layer + 1] != NULL;
 	}
 
-	/* Calculate output delta*/
+	/* Calculate output delta, the derivative of the loss function wrt the output activations */
 	/* delta = self.cost_derivative(activations[-1], y) * sigmoid_prime(zs[-1]) */
-	delta = dloss_func(activation, y_train); /* Derviative of loss function wrt output activations */
-	D printf("Calculating first delta...===========================\n");
-	D printf("Last activation:\n");
-	D mprint(activation);
-	D printf("y_train set:\n");
-	D mprint(y_train);
-	D printf("Derivative of loss func (delta):\n");
-	D mprint(delta);
-	D printf("Zs[nn->n_layers - 2]:\n");
-	D mprint(Zs[nn->n_layers - 2]);
-	err = ndiff(Zs[nn->n_layers - 2], nn->hidden_activ); /* Derivative of activation function wrt output Z vector */
-	D printf("Derivative of activation function wrt output Z vector:\n");
-	D mprint(err);
-	delta = mhad(delta, err, NULL); /* Delta is the Hadamard product of these 2, equation BP1 */
-	D printf("Delta (Hadamard product):\n");
-	D mprint(delta);
-
-	/* Calculate output weight and bias derivatives */
-	/* Definition of dot product: x.y=x^T*y */
-	last_activation = mtrns(activations[nn->n_layers - 2], NULL);
-	/* nabla_b[-1] = delta */
-	/* In a 4 layer network, this would be nabla_b[3] */
-	/* Last element of nabla_b is nn->n_layers - 1 and not nn->n_layers */
-	nabla_b[nn->n_layers - 2] = mscale(delta, 1, NULL); /* Equation BP3 */
-	/* nabla_w[-1] = np.dot(delta, activations[-2].transpose()) */
-	nabla_w[nn->n_layers - 2] = mmul(delta, last_activation, NULL); /* Equation BP4 */
-
-	mfree(err);
-	mfree(tmp);
-	mfree(last_activation);
-
-	/*  for l in xrange(2, self.num_layers): */
-	/* In 4 layer network:
-	weights[0]
-	weights[1]
-	weights[2]
-	weights[3]
-	nn->n_layers = 4
-	weights[-1] should be weights[3]
-	weights[-2] should be weights[2]
-	So, the layer_fwd should go 2, 3 which corresponds to layers 2, 1
-	*/
-	D printf("Starting backward pass\n");
-	for(layer_fwd = 2; layer_fwd < nn->n_layers; layer_fwd++){
-		int layer = nn->n_layers - layer_fwd; /* Account for only n_layers - 1 weights, but also add 1 */
-		Matrix *transposed_weights;
-		D printf("======================================\n");
-		D printf("Back prop Layer: %d, layer_fwd: %d\n",layer,layer_fwd);
-		D printf("Next layer's (%d) weights:\n", layer);
-		D mprint(nn->weights[layer]);
-		D printf("This layer's (%d) weights:\n", layer - 1);
-		D mprint(nn->weights[layer - 1]);
-		/*  z = zs[-l] */
-		z = Zs[layer - 1]; /* Z vector for current layer (unactivated layer output) */
-		/* sp = sigmoid_prime(z) */
-		activationp = ndiff(z, nn->hidden_activ); /* Derivative of activation function for current layer */
-		/*activationp = mapply(z, drelu, NULL);*/
-		/* last_activation = activations[-l-1].transpose() */
-		last_activation = mtrns(activations[layer - 1], NULL); /* Transpose of activation of layer n-1 */
-		D printf("z:\n");
-		D mprint(z);
-		D printf("activationp:\n");
-		D mprint(activationp);
-		D printf("last_activation (layer: %d):\n", layer - 1);
-		D mprint(last_activation);
-		D printf("This layers activation (layer: %d):\n", layer);
-		D mprint(activations[layer]);
-
-		/* Calculate delta */
-		/* delta = np.dot(self.weights[-l+1].transpose(), delta) * sp */
-		/* tmp = np.dot(self.weights[-l+1].transpose(), delta) */
-		transposed_weights = mtrns(nn->weights[layer], NULL); /* Transposed weights of next layer */
-		tmp = mmul(transposed_weights, delta, NULL);
-		/* delta = tmp * sp */
-		D printf("transposed_weights:\n");
-		D mprint(transposed_weights);
-		D printf("tmp (transposed_weights @ delta):\n");
-		D mprint(tmp);
-		D printf("delta:\n");
-		D mprint(delta);
-		delta = mhad(tmp, activationp, NULL); /* Equation BP2 */
-		D printf("New delta (tmp * activationp):\n");
-		D mprint(delta);
-
-		/* Calculate gradients */
-		/* nabla_b[-l] = delta */
-		nabla_b[layer - 1] = mscale(delta, 1.0, NULL); /* Equation BP3 */
-		D printf("nabla_b (delta):\n");
-		D mprint(nabla_b[layer - 1]);
-		/* nabla_w[-l] = np.dot(delta, activations[-l-1].transpose()) */
-		nabla_w[layer - 1] = mmul(delta, last_activation, NULL); /* Equation BP4 */
-		D printf("nabla_w ( np.dot(delta, activations[-l-1].transpose()) ) :\n");
-		D mprint(nabla_w[layer - 1]);
-		D printf("Last activation:\n");
-		D mprint(last_activation);
-		D printf("activations[layer-1]:\n");
-		D mprint(activations[layer-1]);
-		D printf("Weight dimensions: %d x %d, nabla_w dimensions: %d x %d\n",
-					nn->weights[layer-1]->rows, nn->weights[layer-1]->cols,
-					nabla_w[layer-1]->rows, nabla_w[layer-1]->cols);
-
-		/* Free variables */
-		mfree(transposed_weights);
-		mfree(last_activation);
-		mfree(tmp);
+	if(ok){
+		trns = mtrns(Y, NULL);
+		delta = trns ? dloss_func(activations[n_weights], trns) : NULL;
+		mfree(trns);
+		ok = delta != NULL;
 	}
 
+	/* Run the backward pass, from the output layer to the first layer */
+	/* for l in xrange(2, self.num_layers): */
+	for(layer = n_weights - 1; ok && layer >= 0; layer--){
+		/* sp = sigmoid_prime(z), calculated from the activation sigmoid(z) */
+		if(layer < n_weights - 1){
+			/* delta = np.dot(self.weights[-l+1].transpose(), delta) * sp */
+			/* The weights of the next layer are read transposed in place, never copied */
+			if(nn->hidden_deriv){
+				tmp = mdelta(nn->weights[layer + 1], 1, delta, activations[layer + 1], nn->hidden_deriv, NULL); /* BP2 */
+			}
+			else tmp = mmult(nn->weights[layer + 1], 1, delta, 0, NULL);
+			mfree(delta);
+			delta = tmp;
+			if(!delta){
+				ok = 0;
+				break;
+			}
+		}
+		else if(nn->hidden_deriv){
+			nhad_deriv(delta, activations[layer + 1], nn->hidden_deriv); /* Equation BP1 */
+		}
+
+		if(!nn->hidden_deriv && nn->hidden_activ){
+			activationp = ndiff(Zs[layer], nn->hidden_activ); /* Derivative of activation function for layer */
+			if(!activationp){
+				ok = 0;
+				break;
+			}
+			mhad(delta, activationp, delta); /* Equation BP1 (output layer) and BP2 (hidden layers) */
+			mfree(activationp);
+		}
 
-	/* Free unneeded variables */
-	for(layer = 0; layer < nn->n_layers; layer++){
-		mfree(Zs[layer]);
-		D printf("==================================================\n");
-		D printf("Activations[%d]\n",layer);
-		D mprint(activations[layer]);
-		if(layer < nn->n_layers - 1){
-			D printf("Nabla_w[%d]\n",layer);
-			D mprint(nabla_w[layer]);
-			D printf("nn->weights[%d]\n",layer);
-			D mprint(nn->weights[layer]);
+		/* Calculate gradients, summed over the samples in the batch */
+		/* nabla_b[-l] += delta */
+		for(row = 0; row < delta->rows; row++){
+			nabla_b[layer]->data[row][0] += simd()->sum(delta->cols, delta->data[row]); /* Equation BP3 */
 		}
-		mfree(activations[layer]);
+		/* nabla_w[-l] += np.dot(delta, activations[-l-1].transpose()), accumulated in place */
+		ok = mmacc(delta, 0, activations[layer], 1, nabla_w[layer]) != NULL; /* Equation BP4 */
+	}
+
+	/* Free variables */
+	arena_use(previous);
+	arena_restore(scratch, mark);
+
+	return ok;
+}
+
+/**
+* Run backpropagation on a single sample
+*
+* @param nn A constant pointer to the neural network to backpropagate.
+* @param X_train A pointer to the Matrix row from the training dataset to backpropagate on.
+* @param y_train A pointer to the Matrix desired output for the row of the training dataset.
+* @param loss_func A function pointer to the loss function.
+* @param dloss_func A function pointer to the derivative of the loss function.
+*
+* @returns A Matrix*** of the gradients for the weights and biases. (Contains Matrix** nabla_w, Matrix** nabla_b)
+* Free with ngrad_free().
+*/
+Matrix*** nbprop(const neural_network* nn, const Matrix* X_train, const Matrix* y_train, const lfunc loss_func,
+				 const lfuncd dloss_func){
+	Matrix*** nablas; /* Holds both the weight and bias gradients */
+
+	/* Check for nulls */
+	if(!nn || !X_train || !y_train || !loss_func) return NULL;
+	/* Make sure we only have 1 row of data */
+	if(X_train->rows != 1 || y_train->rows != 1) return NULL;
+
+	/* A single sample is a mini-batch of one row */
+	nablas = ngrad_new(nn);
+	if(!nablas) return NULL;
+	if(!nbprop_batch(nn, X_train, y_train, dloss_func, nablas)){
+		ngrad_free(nn, nablas);
+		return NULL;
 	}
-	mfree(tmp2);
-	free(activations);
-	free(Zs);
 
-	/* Package up and return pointer to gradients */
-	nablas = malloc(2 * sizeof(Matrix**));
-	nablas[0] = nabla_w;
-	nablas[1] = nabla_b;
 	return nablas;
 }
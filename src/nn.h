@@ -1,5 +1,6 @@
 #ifndef NN_H
 #define NN_H
+#include <stddef.h>
 #include "activ.h" /* Needed for ninit() */
 #include "loss.h" /* Needed for nbprop() */
 /* Data structures */
@@ -7,14 +8,39 @@ struct neural_network {
 	Matrix** weights;
 	Matrix** biases;
 	dfunc hidden_activ; /* Input/hidden layer activation (f: double->double) */
+	dfunc hidden_deriv; /* Derivative of hidden_activ in terms of its output (see aderiv()), NULL if unknown */
 	mfunc output_activ; /* Output layer activation (f: Matrix*->Matrix*) */
 	int n_layers;
+	void* map; /* Mapped model file the weights and biases point into (see nload()), NULL if none */
+	size_t map_size;
 };
 typedef struct neural_network neural_network;
 
-/* Functions */
+/* Preallocated workspace for predictions, see nplan_new() */
+struct nplan {
+	const neural_network* nn;
+	int batch; /* Maximum number of samples per prediction */
+	Matrix* buffers[2]; /* Ping-pong activation buffers, (widest layer) x batch */
+	Matrix views[2]; /* Views of the buffers shaped to the current layer */
+};
+typedef struct nplan nplan;
+
+/* Functions. npred_batch() and nplan_pred() take and return one sample per column (inputs x samples),
+npred_rows(), nbprop_batch() and ntrain() one sample per row (samples x inputs) */
 Matrix* npred(const neural_network* nn, const Matrix* x);
+Matrix* npred_batch(const neural_network* nn, const Matrix* X, Matrix* out);
+Matrix* npred_rows(const neural_network* nn, const Matrix* X, Matrix* out);
 neural_network* ninit(int inputs, int hidden_layers, int hiddens, int outputs, dfunc hidden_activ, mfunc output_activ);
+void nfree(neural_network* nn);
+int nactiv(neural_network* nn, int hidden_id, int output_id);
+nplan* nplan_new(const neural_network* nn, int batch);
+const Matrix* nplan_pred(nplan* plan, const Matrix* X);
+void nplan_free(nplan* plan);
 Matrix*** nbprop(const neural_network* nn, const Matrix* X_train, const Matrix* y_train, const lfunc loss_func,
 				const lfuncd dloss_func);
+int nbprop_batch(const neural_network* nn, const Matrix* X, const Matrix* Y, const lfuncd dloss_func,
+				 Matrix*** grads);
+Matrix*** ngrad_new(const neural_network* nn);
+void ngrad_zero(const neural_network* nn, Matrix*** grads);
+void ngrad_free(const neural_network* nn, Matrix*** grads);
 #endif
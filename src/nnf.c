@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include "enn.h"
+#include "linalg.h"
+#include "linalgf.h"
+#include "nn.h"
+#include "nnf.h"
+#include "arena.h"
+
+/**
+* Makes a single precision copy of a neural network for inference. Weights and biases are rounded to
+* the nearest float, and activation functions are replaced by their float versions.
+*
+* @param nn A pointer to the (trained) neural network to convert.
+*
+* @returns A pointer to the float network, or NULL on error or if an activation function has no float
+* version (see afloat()).
+*/
+neural_networkf* nconvf(const neural_network* nn){
+	neural_networkf* nnf;
+	int layer, ok = 1;
+
+	if(!nn || !nn->weights || !nn->biases || nn->n_layers < 2)return NULL;
+	if(nn->hidden_activ && !afloat(nn->hidden_activ))return NULL;
+	if(nn->output_activ && nn->output_activ != asmax)return NULL;
+
+	nnf = malloc(sizeof(neural_networkf));
+	if(!nnf)return NULL;
+	nnf->n_layers = nn->n_layers;
+	nnf->hidden_activ = nn->hidden_activ ? afloat(nn->hidden_activ) : NULL;
+	nnf->output_activ = nn->output_activ ? asmaxcf : NULL;
+	nnf->weights = calloc(nn->n_layers - 1, sizeof(Matrixf*));
+	nnf->biases = calloc(nn->n_layers - 1, sizeof(Matrixf*));
+	if(!nnf->weights || !nnf->biases)ok = 0;
+
+	for(layer = 0; ok && layer < nn->n_layers - 1; layer++){
+		nnf->weights[layer] = mconvf(nn->weights[layer], NULL);
+		nnf->biases[layer] = mconvf(nn->biases[layer], NULL);
+		ok = nnf->weights[layer] && nnf->biases[layer];
+	}
+	if(!ok){
+		nfreef(nnf);
+		return NULL;
+	}
+
+	return nnf;
+}
+
+/**
+* Frees memory for a single precision neural network.
+*
+* @param nn A pointer to the neural network to free.
+*/
+void nfreef(neural_networkf* nn){
+	int i;
+
+	if(!nn)return;
+	for(i = 0; i < nn->n_layers - 1; i++){
+		if(nn->weights)mfreef(nn->weights[i]);
+		if(nn->biases)mfreef(nn->biases[i]);
+	}
+	free(nn->weights);
+	free(nn->biases);
+	free(nn);
+}
+
+/**
+* Runs the single precision network on a batch of samples, like npred_batch().
+*
+* @param nn A pointer to the float neural network.
+* @param X The inputs to predict on, one sample per column (inputs x samples).
+* @param out Pointer to output matrix (optional, outputs x samples).
+*
+* @returns The neural network outputs, one column per sample.
+*/
+Matrixf* npredf_batch(const neural_networkf* nn, const Matrixf* X, Matrixf* out){
+	int layer, last;
+	Matrixf *current = NULL, *next;
+	arena *scratch, *previous;
+	arena_mark mark;
+
+	if(!nn || !X || !nn->weights || !nn->biases || nn->n_layers < 2)return NULL;
+	if(X->rows != nn->weights[0]->cols)return NULL;
+	scratch = arena_scratch();
+	if(!scratch)return NULL;
+
+	/* Hidden layer outputs come from the scratch arena, see npred() */
+	mark = arena_save(scratch);
+	previous = arena_use(scratch);
+
+	last = nn->n_layers - 2;
+	for(layer = 0; layer <= last; layer++){
+		if(layer == last)arena_use(previous);
+		next = mdensef(nn->weights[layer], layer ? current : X, nn->biases[layer], nn->hidden_activ,
+					   layer == last ? out : NULL);
+		if(layer)mfreef(current);
+		current = next;
+		if(!current)break;
+	}
+	arena_use(previous);
+	if(previous != scratch)arena_restore(scratch, mark);
+
+	if(current && nn->output_activ)nn->output_activ(current);
+	return current;
+}
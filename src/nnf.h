@@ -0,0 +1,19 @@
+#ifndef NNF_H
+#define NNF_H
+#include "linalgf.h"
+#include "nn.h"
+/* Single precision copy of a trained neural_network, for inference (see nconvf()) */
+struct neural_networkf {
+	Matrixf** weights;
+	Matrixf** biases;
+	ffunc hidden_activ; /* Input/hidden layer activation (f: float->float) */
+	void (*output_activ)(Matrixf*); /* Output layer activation, applied in place to each column, or NULL */
+	int n_layers;
+};
+typedef struct neural_networkf neural_networkf;
+
+neural_networkf* nconvf(const neural_network* nn);
+void nfreef(neural_networkf* nn);
+/* One sample per column (inputs x samples), like npred_batch() */
+Matrixf* npredf_batch(const neural_networkf* nn, const Matrixf* X, Matrixf* out);
+#endif
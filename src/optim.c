@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <math.h>
+#include "enn.h"
+#include "linalg.h"
+#include "nn.h"
+#include "pool.h"
+#include "optim.h"
+
+/* Optimizers for gradient descent. The state (velocities and moments) is allocated once per network
+by optim_new(), and every step updates each weight and bias matrix in a single in-place pass that
+reads the gradient, updates the state and writes the weight, with the averaging of the gradient over
+the mini-batch folded in. */
+
+/* One weight or bias matrix to update */
+struct optim_job {
+	const optim_opts* opts;
+	Matrix* w;
+	const Matrix* g;
+	Matrix* m; /* NULL for OPTIM_SGD */
+	Matrix* v; /* NULL unless Adam */
+	double scale; /* Factor of the gradient */
+	double step; /* Learning rate, bias corrected for Adam */
+	double decay; /* Factor the weights are multiplied by before an AdamW step, 1 otherwise */
+};
+
+/* w -= step * g */
+static void optim_sgd_row(int n, double* w, const double* g, double step){
+	int i;
+	for(i = 0; i < n; i++){
+		w[i] -= step * g[i];
+	}
+}
+
+/* v = momentum * v - lr * g, then w += v, or w += momentum * v - lr * g (Nesterov) */
+static void optim_momentum_row(int n, double* w, const double* g, double* m, const struct optim_job* job){
+	double momentum = job->opts->momentum, step = job->step * job->scale;
+	int nesterov = job->opts->kind == OPTIM_NESTEROV, i;
+
+	for(i = 0; i < n; i++){
+		double update = step * g[i];
+		double velocity = momentum * m[i] - update;
+		m[i] = velocity;
+		w[i] += nesterov ? momentum * velocity - update : velocity;
+	}
+}
+
+/* m = beta1 * m + (1 - beta1) * g, v = beta2 * v + (1 - beta2) * g^2, w -= step * m / (sqrt(v) + epsilon) */
+static void optim_adam_row(int n, double* w, const double* g, double* m, double* v, const struct optim_job* job){
+	double beta1 = job->opts->beta1, beta2 = job->opts->beta2, epsilon = job->opts->epsilon;
+	int i;
+
+	for(i = 0; i < n; i++){
+		double grad = g[i] * job->scale;
+		double mi = beta1 * m[i] + (1 - beta1) * grad;
+		double vi = beta2 * v[i] + (1 - beta2) * grad * grad;
+		m[i] = mi;
+		v[i] = vi;
+		w[i] = w[i] * job->decay - job->step * mi / (sqrt(vi) + epsilon);
+	}
+}
+
+/**
+* Frees state allocated with ngrad_new() for a network of n_layers layers, once the network may be gone.
+*/
+static void optim_state_free(Matrix*** state, int n_layers){
+	int layer;
+
+	if(!state)return;
+	for(layer = 0; layer < n_layers - 1; layer++){
+		mfree(state[0][layer]);
+		mfree(state[1][layer]);
+	}
+	free(state[0]);
+	free(state[1]);
+	free(state);
+}
+
+/**
+* Pool task: updates the rows [begin, end) of a weight or bias matrix.
+*/
+static void optim_task(void* arg, int begin, int end){
+	const struct optim_job* job = arg;
+	int row, cols = job->w->cols;
+
+	for(row = begin; row < end; row++){
+		switch(job->opts->kind){
+		case OPTIM_MOMENTUM:
+		case OPTIM_NESTEROV:
+			optim_momentum_row(cols, job->w->data[row], job->g->data[row], job->m->data[row], job);
+			break;
+		case OPTIM_ADAM:
+		case OPTIM_ADAMW:
+			optim_adam_row(cols, job->w->data[row], job->g->data[row], job->m->data[row], job->v->data[row], job);
+			break;
+		default:
+			optim_sgd_row(cols, job->w->data[row], job->g->data[row], job->step * job->scale);
+		}
+	}
+}
+
+/**
+* Sets the default settings of an optimizer, those of Keras: a learning rate of 0.01 for the SGD kinds
+* and 0.001 for Adam, a momentum of 0.9, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-7 and a weight decay
+* of 0.004.
+*
+* @param opts Pointer to the settings to fill in.
+* @param kind The update rule, such as OPTIM_ADAM.
+*/
+void optim_defaults(optim_opts* opts, int kind){
+	if(!opts)return;
+	opts->kind = kind;
+	opts->learning_rate = (kind == OPTIM_ADAM || kind == OPTIM_ADAMW) ? 0.001 : 0.01;
+	opts->momentum = 0.9;
+	opts->beta1 = 0.9;
+	opts->beta2 = 0.999;
+	opts->epsilon = 1e-7;
+	opts->weight_decay = 0.004;
+}
+
+/**
+* Creates an optimizer for a network, with its state (zero velocities or moments) shaped like the
+* weights and biases. Keep it for as long as the network is trained: the state carries over from one
+* call of ntrain() (see train_opts) to the next.
+*
+* @param nn A pointer to the neural network to optimize.
+* @param opts The settings, see optim_defaults().
+*
+* @returns A pointer to the optimizer, or NULL on error or if opts->kind is unknown.
+*/
+optim* optim_new(const neural_network* nn, const optim_opts* opts){
+	optim* opt;
+	int kind;
+
+	if(!nn || !opts || nn->n_layers < 2)return NULL;
+	kind = opts->kind;
+	if(kind != OPTIM_SGD && kind != OPTIM_MOMENTUM && kind != OPTIM_NESTEROV && kind != OPTIM_ADAM
+	   && kind != OPTIM_ADAMW)return NULL;
+
+	opt = malloc(sizeof(optim));
+	if(!opt)return NULL;
+	opt->opts = *opts;
+	opt->n_layers = nn->n_layers;
+	opt->m = NULL;
+	opt->v = NULL;
+	opt->steps = 0;
+	if(kind != OPTIM_SGD){
+		opt->m = ngrad_new(nn);
+		if(!opt->m){
+			optim_free(opt);
+			return NULL;
+		}
+	}
+	if(kind == OPTIM_ADAM || kind == OPTIM_ADAMW){
+		opt->v = ngrad_new(nn);
+		if(!opt->v){
+			optim_free(opt);
+			return NULL;
+		}
+	}
+
+	return opt;
+}
+
+/**
+* Takes one optimizer step: updates every weight and bias of a network in place from its gradient.
+* Large matrices are split across the thread pool by rows.
+*
+* @param opt A pointer to the optimizer, made for this network by optim_new().
+* @param nn A pointer to the neural network to update.
+* @param grads The gradients of the loss, as from ngrad_new() and nbprop_batch().
+* @param scale Factor of the gradients, e.g. 1 / samples to average gradients summed over a mini-batch.
+*
+* @returns 1 on success, 0 on error (shapes that do not match the network).
+*/
+int optim_step(optim* opt, neural_network* nn, Matrix*** grads, double scale){
+	struct optim_job job;
+	int layer, part;
+
+	if(!opt || !nn || !grads || nn->n_layers != opt->n_layers)return 0;
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		for(part = 0; part < 2; part++){
+			const Matrix* w = part ? nn->biases[layer] : nn->weights[layer];
+			const Matrix* g = grads[part][layer];
+			if(!g || g->rows != w->rows || g->cols != w->cols)return 0;
+			if(opt->m && (opt->m[part][layer]->rows != w->rows || opt->m[part][layer]->cols != w->cols))return 0;
+		}
+	}
+
+	opt->steps++;
+	job.opts = &opt->opts;
+	job.scale = scale;
+	job.step = opt->opts.learning_rate;
+	if(opt->opts.kind == OPTIM_ADAM || opt->opts.kind == OPTIM_ADAMW){
+		job.step *= sqrt(1 - pow(opt->opts.beta2, opt->steps)) / (1 - pow(opt->opts.beta1, opt->steps));
+	}
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		for(part = 0; part < 2; part++){
+			job.w = part ? nn->biases[layer] : nn->weights[layer];
+			job.g = grads[part][layer];
+			job.m = opt->m ? opt->m[part][layer] : NULL;
+			job.v = opt->v ? opt->v[part][layer] : NULL;
+			job.decay = (opt->opts.kind == OPTIM_ADAMW && !part) ?
+				1 - opt->opts.learning_rate * opt->opts.weight_decay : 1;
+			/* mnew() accepts empty matrices, which have nothing to update */
+			if(!job.w->rows || !job.w->cols)continue;
+			pool_for(job.w->rows, LINALG_PARALLEL / job.w->cols + 1, optim_task, &job);
+		}
+	}
+
+	return 1;
+}
+
+/**
+* Frees an optimizer and its state.
+*
+* @param opt A pointer to the optimizer.
+*/
+void optim_free(optim* opt){
+	if(!opt)return;
+	optim_state_free(opt->m, opt->n_layers);
+	optim_state_free(opt->v, opt->n_layers);
+	free(opt);
+}
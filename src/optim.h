@@ -0,0 +1,39 @@
+#ifndef OPTIM_H
+#define OPTIM_H
+#include "nn.h"
+/* Update rules, see optim_step() */
+enum optim_kind {
+	OPTIM_SGD, /* w -= lr * g */
+	OPTIM_MOMENTUM, /* v = momentum * v - lr * g, w += v */
+	OPTIM_NESTEROV, /* v = momentum * v - lr * g, w += momentum * v - lr * g */
+	OPTIM_ADAM, /* Adam (Kingma and Ba, 2014), in the form Keras uses */
+	OPTIM_ADAMW /* Adam with decoupled weight decay (Loshchilov and Hutter, 2017) */
+};
+
+/* Settings of an optimizer, see optim_defaults() */
+struct optim_opts {
+	int kind; /* OPTIM_* */
+	double learning_rate;
+	double momentum; /* OPTIM_MOMENTUM and OPTIM_NESTEROV */
+	double beta1; /* Decay of the first moment estimate (Adam) */
+	double beta2; /* Decay of the second moment estimate (Adam) */
+	double epsilon; /* Added to the square root of the second moment (Adam) */
+	double weight_decay; /* Fraction of the weights (not the biases) taken off per unit of learning rate (AdamW) */
+};
+typedef struct optim_opts optim_opts;
+
+/* An optimizer and its state for one network, see optim_new() */
+struct optim {
+	optim_opts opts;
+	int n_layers; /* Of the network the state is shaped for */
+	Matrix*** m; /* Velocity (momentum) or first moment (Adam) of every weight and bias, as from ngrad_new() */
+	Matrix*** v; /* Second moment (Adam) */
+	long steps; /* Steps taken, for the Adam bias correction */
+};
+typedef struct optim optim;
+
+void optim_defaults(optim_opts* opts, int kind);
+optim* optim_new(const neural_network* nn, const optim_opts* opts);
+int optim_step(optim* opt, neural_network* nn, Matrix*** grads, double scale);
+void optim_free(optim* opt);
+#endif
@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "enn.h"
+#include "pool.h"
+
+/* Persistent worker pool. Workers are started on first use and sleep on a condition variable between
+jobs. A job splits a range of n items into one contiguous chunk per thread; the calling thread runs the
+first chunk itself and then waits for the workers to finish theirs. */
+
+static pthread_mutex_t pool_job_lock = PTHREAD_MUTEX_INITIALIZER; /* Held for the whole of a job */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; /* Protects the variables below */
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER; /* Signalled when a job is posted */
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER; /* Signalled when the last chunk finishes */
+static pthread_t* pool_workers = NULL;
+static int pool_size = 0; /* Number of threads, including the calling thread. 0 until started */
+static int pool_stop = 0;
+static unsigned long pool_generation = 0; /* Incremented for every job */
+static unsigned long pool_epoch = 0; /* Generation when the workers were started */
+
+/* Current job */
+static pool_task job_task;
+static void* job_arg;
+static int job_n, job_chunks, job_remaining;
+
+/* Nonzero while the thread is running a task. Jobs started from inside a task run serially */
+static ENN_TLS int pool_inside = 0;
+
+/**
+* Runs one chunk of the current job.
+*/
+static void pool_chunk(int chunk){
+	int begin = (int)((long)job_n * chunk / job_chunks);
+	int end = (int)((long)job_n * (chunk + 1) / job_chunks);
+	if(begin < end)job_task(job_arg, begin, end);
+}
+
+/**
+* Worker thread main loop. Worker i runs chunk i of every job that has more than i chunks.
+*/
+static void* pool_worker(void* arg){
+	int index = (int)(size_t)arg;
+	unsigned long seen;
+
+	pool_inside = 1;
+	pthread_mutex_lock(&pool_lock);
+	seen = pool_epoch;
+	for(;;){
+		while(!pool_stop && pool_generation == seen){
+			pthread_cond_wait(&pool_wake, &pool_lock);
+		}
+		if(pool_stop)break;
+		seen = pool_generation;
+		if(index < job_chunks){
+			pthread_mutex_unlock(&pool_lock);
+			pool_chunk(index);
+			pthread_mutex_lock(&pool_lock);
+			if(--job_remaining == 0)pthread_cond_signal(&pool_done);
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+/**
+* Returns the default number of threads: $ENN_THREADS if set, otherwise the number of online cores.
+*/
+static int pool_default_threads(void){
+	const char* env = getenv(POOL_ENV);
+	long cores;
+
+	if(env && atoi(env) > 0)return atoi(env);
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cores > 0) ? (int)cores : 1;
+}
+
+/**
+* Starts threads - 1 workers. Must be called with pool_job_lock held and no workers running.
+*/
+static void pool_start(int threads){
+	int i;
+
+	pool_size = 1;
+	if(threads < 2)return;
+	pool_workers = malloc((threads - 1) * sizeof(pthread_t));
+	if(!pool_workers)return;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stop = 0;
+	pool_epoch = pool_generation;
+	for(i = 1; i < threads; i++){
+		if(pthread_create(&pool_workers[i - 1], NULL, pool_worker, (void*)(size_t)i) != 0)break;
+	}
+	pool_size = i;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+* Stops and joins the workers. Must be called with pool_job_lock held.
+*/
+static void pool_stop_workers(void){
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stop = 1;
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+	for(i = 0; i < pool_size - 1; i++){
+		pthread_join(pool_workers[i], NULL);
+	}
+	free(pool_workers);
+	pool_workers = NULL;
+	pool_size = 0;
+}
+
+/**
+* Returns the number of threads jobs are split across (including the calling thread), starting the pool
+* on the first call. Inside a task this is 1, since jobs started there run serially, and it returns
+* without locking: pool_for() holds pool_job_lock for the whole job.
+*/
+int pool_threads(void){
+	int threads;
+
+	if(pool_inside)return 1;
+	pthread_mutex_lock(&pool_job_lock);
+	if(pool_size == 0)pool_start(pool_default_threads());
+	threads = pool_size;
+	pthread_mutex_unlock(&pool_job_lock);
+	return threads;
+}
+
+/**
+* Restarts the pool with a given number of threads.
+*
+* @param threads Number of threads including the calling thread, or 0 for the default.
+*
+* @returns The number of threads actually started.
+*/
+int pool_set_threads(int threads){
+	pthread_mutex_lock(&pool_job_lock);
+	pool_stop_workers();
+	pool_start(threads > 0 ? threads : pool_default_threads());
+	threads = pool_size;
+	pthread_mutex_unlock(&pool_job_lock);
+	return threads;
+}
+
+/**
+* Stops the workers. The pool is started again by the next job.
+*/
+void pool_shutdown(void){
+	pthread_mutex_lock(&pool_job_lock);
+	pool_stop_workers();
+	pthread_mutex_unlock(&pool_job_lock);
+}
+
+/**
+* Runs task over the items [0, n), split into contiguous chunks across the pool. Small jobs (fewer than
+* 2 * grain items), jobs started from inside a task and single threaded pools run on the calling thread.
+*
+* @param n Number of items.
+* @param grain Minimum number of items per chunk, so each thread gets enough work to pay for the handoff.
+* @param task Function to run on each chunk.
+* @param arg Argument passed to task.
+*/
+void pool_for(int n, int grain, pool_task task, void* arg){
+	int chunks;
+
+	if(n <= 0)return;
+	if(grain < 1)grain = 1;
+	chunks = n / grain;
+	if(pool_inside || chunks < 2 || pool_threads() < 2){
+		task(arg, 0, n);
+		return;
+	}
+
+	/* The pool may have been shut down or shrunk since pool_threads() dropped the lock */
+	pthread_mutex_lock(&pool_job_lock);
+	if(pool_size == 0)pool_start(pool_default_threads());
+	if(pool_size < 2){
+		pthread_mutex_unlock(&pool_job_lock);
+		task(arg, 0, n);
+		return;
+	}
+	if(chunks > pool_size)chunks = pool_size;
+
+	/* Post the job and wake the workers */
+	pthread_mutex_lock(&pool_lock);
+	job_task = task;
+	job_arg = arg;
+	job_n = n;
+	job_chunks = chunks;
+	job_remaining = chunks - 1;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+
+	/* Run the first chunk here, then wait for the rest */
+	pool_inside = 1;
+	pool_chunk(0);
+	pool_inside = 0;
+	pthread_mutex_lock(&pool_lock);
+	while(job_remaining > 0){
+		pthread_cond_wait(&pool_done, &pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	pthread_mutex_unlock(&pool_job_lock);
+}
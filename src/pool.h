@@ -0,0 +1,13 @@
+#ifndef POOL_H
+#define POOL_H
+/* Environment variable overriding the number of threads (default: number of online cores) */
+#define POOL_ENV "ENN_THREADS"
+
+/* A task processes items [begin, end) of a job */
+typedef void (*pool_task)(void* arg, int begin, int end);
+
+int pool_threads(void);
+int pool_set_threads(int threads);
+void pool_for(int n, int grain, pool_task task, void* arg);
+void pool_shutdown(void);
+#endif
@@ -0,0 +1,345 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "enn.h"
+#include "linalg.h"
+#include "nn.h"
+#include "quant.h"
+#include "simd.h"
+#include "pool.h"
+#include "arena.h"
+
+/* Post-training int8 quantization. Weights get one symmetric scale per row (output neuron), chosen so
+the largest weight of the row maps to 127. Activations are quantized per sample as they flow through
+the network, with a scale chosen the same way, so a layer is an exact int32 dot product of two int8
+vectors per output, followed by one float multiply by both scales, the bias and the activation.
+
+The int8 values are widened to int16 and multiplied in pairs into int32 (pmaddwd). The u8 x s8 forms
+(pmaddubsw, VNNI) would need unsigned activations and can saturate, while the widened products are
+exact for any k below 2^17. */
+
+/* Minimum multiply-adds per thread before prediction is split across the pool */
+#define QUANT_PARALLEL 65536
+
+/**
+* Rounds x / scale to the nearest int8.
+*/
+static signed char quant_round(double x, double scale){
+	double q = x / scale;
+	if(q > 127.0)q = 127.0;
+	if(q < -127.0)q = -127.0;
+	return (signed char)((q >= 0) ? q + 0.5 : q - 0.5);
+}
+
+/**
+* Dot product of two zero padded int8 vectors of n (a multiple of QUANT_ALIGN) elements.
+*/
+static long quant_dot(const signed char* a, const signed char* b, int n){
+	long sum = 0;
+	int i;
+
+	for(i = 0; i < n; i++){
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANT_X86
+#include <immintrin.h>
+
+/**
+* AVX2 version of quant_dot(): 32 elements per step, sign-extended to int16 and multiplied in pairs
+* into int32 lanes, with two independent accumulators.
+*/
+static __attribute__((target("avx2"))) long quant_dot_avx2(const signed char* a, const signed char* b, int n){
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+	__m128i sum;
+	int i;
+
+	for(i = 0; i < n; i += 32){
+		__m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+		__m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+		__m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16)));
+		__m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)));
+		acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(a0, b0));
+		acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(a1, b1));
+	}
+	acc0 = _mm256_add_epi32(acc0, acc1);
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+	return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+/**
+* Quantizes a trained neural network to int8 weights for inference.
+*
+* @param nn A pointer to the neural network to quantize.
+*
+* @returns A pointer to the quantized network, or NULL on error or if an activation function has no
+* float version (see afloat()) or the output activation is not asmax.
+*/
+qnetwork* nquant(const neural_network* nn){
+	qnetwork* q;
+	int layer, row, col, ok = 1;
+
+	if(!nn || !nn->weights || !nn->biases || nn->n_layers < 2)return NULL;
+	if(nn->hidden_activ && !afloat(nn->hidden_activ))return NULL;
+	if(nn->output_activ && nn->output_activ != asmax)return NULL;
+
+	q = malloc(sizeof(qnetwork));
+	if(!q)return NULL;
+	q->n_layers = nn->n_layers;
+	q->hidden_activ = nn->hidden_activ ? afloat(nn->hidden_activ) : NULL;
+	q->output_activ = nn->output_activ;
+	q->layers = calloc(nn->n_layers - 1, sizeof(qlayer));
+	if(!q->layers){
+		free(q);
+		return NULL;
+	}
+
+	for(layer = 0; ok && layer < nn->n_layers - 1; layer++){
+		const Matrix* w = nn->weights[layer];
+		qlayer* ql = &q->layers[layer];
+		ql->rows = w->rows;
+		ql->cols = w->cols;
+		ql->stride = (w->cols + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+		ql->weights = calloc((size_t)ql->rows * ql->stride + 1, 1);
+		ql->scales = malloc((ql->rows + 1) * sizeof(float));
+		ql->biases = malloc((ql->rows + 1) * sizeof(float));
+		ok = ql->weights && ql->scales && ql->biases;
+
+		for(row = 0; ok && row < w->rows; row++){
+			double max = 0.0;
+			for(col = 0; col < w->cols; col++){
+				if(fabs(w->data[row][col]) > max)max = fabs(w->data[row][col]);
+			}
+			ql->scales[row] = (max > 0.0) ? (float)(max / 127.0) : 1.0f;
+			for(col = 0; col < w->cols; col++){
+				ql->weights[(size_t)row * ql->stride + col] = quant_round(w->data[row][col], ql->scales[row]);
+			}
+			ql->biases[row] = (float)nn->biases[layer]->data[row][0];
+		}
+	}
+	if(!ok){
+		qfree(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/**
+* Frees memory for a quantized network.
+*
+* @param q A pointer to the quantized network to free.
+*/
+void qfree(qnetwork* q){
+	int layer;
+
+	if(!q)return;
+	for(layer = 0; q->layers && layer < q->n_layers - 1; layer++){
+		free(q->layers[layer].weights);
+		free(q->layers[layer].scales);
+		free(q->layers[layer].biases);
+	}
+	free(q->layers);
+	free(q);
+}
+
+/* A batch of samples split across the thread pool */
+struct quant_job {
+	const qnetwork* q;
+	const Matrix* X;
+	Matrix* out;
+	int widest; /* Stride of the widest layer input */
+	int failed; /* Set by a task that could not get its scratch buffers, its columns of out are then unset */
+	pthread_mutex_t lock; /* Protects failed */
+};
+
+/**
+* Quantizes the n values at x into q, returning the scale.
+*/
+static float quant_activations(const float* x, int n, signed char* q){
+	float max = 0.0f, scale;
+	int i;
+
+	for(i = 0; i < n; i++){
+		if(fabs(x[i]) > max)max = (float)fabs(x[i]);
+	}
+	scale = (max > 0.0f) ? max / 127.0f : 1.0f;
+	for(i = 0; i < n; i++){
+		q[i] = quant_round(x[i], scale);
+	}
+	return scale;
+}
+
+/**
+* Marks a job as failed, from any of its tasks.
+*/
+static void quant_fail(struct quant_job* job){
+	pthread_mutex_lock(&job->lock);
+	job->failed = 1;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/**
+* Pool task: runs the quantized network on the samples (columns) [begin, end), one sample at a time.
+*/
+static void quant_task(void* arg, int begin, int end){
+	struct quant_job* job = arg;
+	const qnetwork* q = job->q;
+	long (*dot)(const signed char*, const signed char*, int) = quant_dot;
+	arena* scratch = arena_scratch();
+	arena_mark mark;
+	signed char* xq;
+	float *x, *h;
+	int sample, layer, row, last = q->n_layers - 2;
+
+#ifdef QUANT_X86
+	if(simd_level() >= SIMD_AVX2)dot = quant_dot_avx2;
+#endif
+	if(!scratch){
+		quant_fail(job);
+		return;
+	}
+	mark = arena_save(scratch);
+	xq = arena_alloc(scratch, job->widest);
+	x = arena_alloc(scratch, job->widest * sizeof(float));
+	h = arena_alloc(scratch, job->widest * sizeof(float));
+	if(!xq || !x || !h){
+		arena_restore(scratch, mark);
+		quant_fail(job);
+		return;
+	}
+
+	for(sample = begin; sample < end; sample++){
+		/* Quantize the input column, the padding stays zero */
+		for(row = 0; row < job->X->rows; row++){
+			x[row] = (float)job->X->data[row][sample];
+		}
+		for(layer = 0; layer <= last; layer++){
+			const qlayer* ql = &q->layers[layer];
+			float scale;
+			memset(xq, 0, ql->stride);
+			scale = quant_activations(x, ql->cols, xq);
+			for(row = 0; row < ql->rows; row++){
+				float z = (float)dot(ql->weights + (size_t)row * ql->stride, xq, ql->stride) * ql->scales[row] * scale
+						  + ql->biases[row];
+				h[row] = q->hidden_activ ? q->hidden_activ(z) : z;
+			}
+			if(layer == last){
+				for(row = 0; row < ql->rows; row++){
+					job->out->data[row][sample] = h[row];
+				}
+			}
+			else memcpy(x, h, ql->rows * sizeof(float));
+		}
+	}
+	arena_restore(scratch, mark);
+}
+
+/**
+* Runs the quantized network on a batch of samples, like npred_batch().
+*
+* @param q A pointer to the quantized network.
+* @param X The inputs to predict on, one sample per column (inputs x samples).
+* @param out Pointer to output matrix (optional, outputs x samples).
+*
+* @returns The network outputs, one column per sample, or NULL on error.
+*/
+Matrix* qpred_batch(const qnetwork* q, const Matrix* X, Matrix* out){
+	struct quant_job job;
+	Matrix* given = out;
+	double work = 0.0;
+	int layer;
+
+	if(!q || !X || q->n_layers < 2 || X->rows != q->layers[0].cols)return NULL;
+	out = mnew2(q->layers[q->n_layers - 2].rows, X->cols, out);
+	if(!out)return NULL;
+
+	job.q = q;
+	job.X = X;
+	job.out = out;
+	job.widest = 0;
+	job.failed = 0;
+	if(pthread_mutex_init(&job.lock, NULL) != 0){
+		if(out != given)mfree(out);
+		return NULL;
+	}
+	for(layer = 0; layer < q->n_layers - 1; layer++){
+		if(q->layers[layer].stride > job.widest)job.widest = q->layers[layer].stride;
+		if(q->layers[layer].rows > job.widest)job.widest = q->layers[layer].rows;
+		work += (double)q->layers[layer].rows * q->layers[layer].stride;
+	}
+	pool_for(X->cols, (int)(QUANT_PARALLEL / work) + 1, quant_task, &job);
+	/* pool_for() has joined the tasks, so failed can be read without the lock */
+	pthread_mutex_destroy(&job.lock);
+	if(job.failed){
+		if(out != given)mfree(out);
+		return NULL;
+	}
+
+	if(q->output_activ == asmax)asmaxc(out);
+	return out;
+}
+
+/**
+* Index of the largest element of a column.
+*/
+static int quant_argmax(const Matrix* a, int col){
+	int row, best = 0;
+	for(row = 1; row < a->rows; row++){
+		if(a->data[row][col] > a->data[best][col])best = row;
+	}
+	return best;
+}
+
+/**
+* Measures the accuracy lost by quantization on a (held-out) labelled set: both networks classify every
+* sample, and a sample counts as correct when the largest output is the largest desired output.
+*
+* @param nn A pointer to the original network.
+* @param q A pointer to the network quantized from it.
+* @param X The inputs, one sample per column (inputs x samples).
+* @param Y The desired outputs (e.g. one-hot), one sample per column (outputs x samples).
+* @param report Pointer to the report to fill in.
+*
+* @returns 1 on success, 0 on error.
+*/
+int qeval(const neural_network* nn, const qnetwork* q, const Matrix* X, const Matrix* Y, qreport* report){
+	Matrix *expected, *actual;
+	int sample, row, correct = 0, correct_q = 0;
+
+	if(!nn || !q || !X || !Y || !report || X->cols != Y->cols || X->cols < 1)return 0;
+	expected = npred_batch(nn, X, NULL);
+	actual = qpred_batch(q, X, NULL);
+	if(!expected || !actual || expected->rows != Y->rows){
+		mfree(expected);
+		mfree(actual);
+		return 0;
+	}
+
+	report->max_error = 0.0;
+	for(sample = 0; sample < X->cols; sample++){
+		int label = quant_argmax(Y, sample);
+		correct += quant_argmax(expected, sample) == label;
+		correct_q += quant_argmax(actual, sample) == label;
+		for(row = 0; row < Y->rows; row++){
+			double error = fabs(expected->data[row][sample] - actual->data[row][sample]);
+			if(error > report->max_error)report->max_error = error;
+		}
+	}
+	report->samples = X->cols;
+	report->accuracy = (double)correct / X->cols;
+	report->accuracy_q = (double)correct_q / X->cols;
+	report->delta = report->accuracy_q - report->accuracy;
+
+	mfree(expected);
+	mfree(actual);
+	return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef QUANT_H
+#define QUANT_H
+#include "nn.h"
+/* Rows of int8 weights and activations are zero padded to a multiple of this many elements, so the
+dot product kernels never need a scalar tail */
+#define QUANT_ALIGN 32
+
+/* One layer with int8 weights: weight[i][k] ~= weights[i * stride + k] * scales[i] */
+struct qlayer {
+	int rows;
+	int cols;
+	int stride; /* cols rounded up to QUANT_ALIGN */
+	signed char* weights; /* rows x stride, row-major */
+	float* scales; /* One scale per row (output neuron) */
+	float* biases; /* Kept in float, they are added after the int32 accumulation */
+};
+typedef struct qlayer qlayer;
+
+/* A network quantized after training, for inference only (see nquant()) */
+struct qnetwork {
+	qlayer* layers; /* n_layers - 1 layers, like the weights of a neural_network */
+	ffunc hidden_activ;
+	mfunc output_activ; /* NULL or asmax */
+	int n_layers;
+};
+typedef struct qnetwork qnetwork;
+
+/* Accuracy of a quantized network against the network it was made from, see qeval() */
+struct qreport {
+	int samples;
+	double accuracy; /* Fraction of samples the original network classifies correctly */
+	double accuracy_q; /* Fraction of samples the quantized network classifies correctly */
+	double delta; /* accuracy_q - accuracy */
+	double max_error; /* Largest absolute difference between the outputs of the two networks */
+};
+typedef struct qreport qreport;
+
+qnetwork* nquant(const neural_network* nn);
+void qfree(qnetwork* q);
+/* One sample per column (inputs x samples), like npred_batch() */
+Matrix* qpred_batch(const qnetwork* q, const Matrix* X, Matrix* out);
+int qeval(const neural_network* nn, const qnetwork* q, const Matrix* X, const Matrix* Y, qreport* report);
+#endif
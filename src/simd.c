@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stddef.h>
+#include <math.h>
+#include <pthread.h>
+#include "simd.h"
+
+/* Vectorized element-wise kernels. The instruction set is picked once, on first use, from what the
+CPU reports through CPUID. Each vector kernel is compiled with a function level target attribute so
+the rest of the library keeps building as plain C90 for the baseline architecture. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Portable kernels, also used for the tails of the vector kernels */
+static void add_scalar(size_t n, const double* a, const double* b, double* out){
+	size_t i;
+	for(i = 0; i < n; i++)out[i] = a[i] + b[i];
+}
+
+static void sub_scalar(size_t n, const double* a, const double* b, double* out){
+	size_t i;
+	for(i = 0; i < n; i++)out[i] = a[i] - b[i];
+}
+
+static void mul_scalar(size_t n, const double* a, const double* b, double* out){
+	size_t i;
+	for(i = 0; i < n; i++)out[i] = a[i] * b[i];
+}
+
+static void scale_scalar(size_t n, const double* a, double b, double* out){
+	size_t i;
+	for(i = 0; i < n; i++)out[i] = a[i] * b;
+}
+
+static void fill_scalar(size_t n, double value, double* out){
+	size_t i;
+	for(i = 0; i < n; i++)out[i] = value;
+}
+
+static double sum_scalar(size_t n, const double* a){
+	double sum = 0.0;
+	size_t i;
+	for(i = 0; i < n; i++)sum += a[i];
+	return sum;
+}
+
+static void expv_scalar(size_t n, const double* a, double* out){
+	size_t i;
+	for(i = 0; i < n; i++)out[i] = exp(a[i]);
+}
+
+/* The vector exp splits x = k ln 2 + r with |r| <= ln 2 / 2, evaluates exp(r) with a degree 12 Taylor
+polynomial (truncation error below 2e-16 on that interval), and multiplies by 2^k built directly in the
+exponent bits. The relative error is below 1e-15 (a few ulps) for -708 <= x <= 709.78; smaller x give
+0 (exp(-708) is about 3e-308, the bottom of the normal range), larger x give inf, and NaN stays NaN. */
+#define EXPV_LOG2E 1.4426950408889634074
+#define EXPV_LN2_HI 6.93147180369123816490e-01 /* ln 2 with the low bits zero, so k * EXPV_LN2_HI is exact */
+#define EXPV_LN2_LO 1.90821492927058770002e-10 /* ln 2 - EXPV_LN2_HI */
+#define EXPV_MIN -708.0
+#define EXPV_MAX 709.782712893384
+#define EXPV_MAGIC 6755399441055744.0 /* 1.5 * 2^52: adding it leaves round(k) in the low mantissa bits */
+static const double expv_taylor[] = {
+	1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0,
+	1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 1.0 / 2.0, 1.0, 1.0
+};
+
+#ifdef SIMD_X86
+/* Defines out = a op b over whole vectors of width doubles, then finishes the tail with the
+scalar kernel. Vector add/sub/mul round exactly like the scalar operators. */
+#define SIMD_BINARY(name, isa, vec, width, load, store, vop, tail) \
+	static __attribute__((target(isa))) void name(size_t n, const double* a, const double* b, double* out){ \
+		size_t i; \
+		for(i = 0; i + (width) <= n; i += (width)){ \
+			vec va = load(a + i); \
+			vec vb = load(b + i); \
+			store(out + i, vop(va, vb)); \
+		} \
+		tail(n - i, a + i, b + i, out + i); \
+	}
+
+#define SIMD_SCALE(name, isa, vec, width, set1, load, store, vmul) \
+	static __attribute__((target(isa))) void name(size_t n, const double* a, double b, double* out){ \
+		vec vb = set1(b); \
+		size_t i; \
+		for(i = 0; i + (width) <= n; i += (width)){ \
+			store(out + i, vmul(load(a + i), vb)); \
+		} \
+		scale_scalar(n - i, a + i, b, out + i); \
+	}
+
+#define SIMD_FILL(name, isa, vec, width, set1, store) \
+	static __attribute__((target(isa))) void name(size_t n, double value, double* out){ \
+		vec v = set1(value); \
+		size_t i; \
+		for(i = 0; i + (width) <= n; i += (width)){ \
+			store(out + i, v); \
+		} \
+		fill_scalar(n - i, value, out + i); \
+	}
+
+SIMD_BINARY(add_sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, add_scalar)
+SIMD_BINARY(sub_sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, sub_scalar)
+SIMD_BINARY(mul_sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, mul_scalar)
+SIMD_SCALE(scale_sse2, "sse2", __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd)
+SIMD_FILL(fill_sse2, "sse2", __m128d, 2, _mm_set1_pd, _mm_storeu_pd)
+
+SIMD_BINARY(add_avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, add_scalar)
+SIMD_BINARY(sub_avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, sub_scalar)
+SIMD_BINARY(mul_avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, mul_scalar)
+SIMD_SCALE(scale_avx2, "avx2", __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd)
+SIMD_FILL(fill_avx2, "avx2", __m256d, 4, _mm256_set1_pd, _mm256_storeu_pd)
+
+SIMD_BINARY(add_avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, add_scalar)
+SIMD_BINARY(sub_avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, sub_scalar)
+SIMD_BINARY(mul_avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, mul_scalar)
+SIMD_SCALE(scale_avx512, "avx512f", __m512d, 8, _mm512_set1_pd, _mm512_loadu_pd, _mm512_storeu_pd,
+			_mm512_mul_pd)
+SIMD_FILL(fill_avx512, "avx512f", __m512d, 8, _mm512_set1_pd, _mm512_storeu_pd)
+
+/* Sums use several independent accumulators to hide the latency of the adds, so they round
+differently from the sequential scalar sum (by at most about n ulps of the sum of |a|) */
+static __attribute__((target("sse2"))) double sum_sse2(size_t n, const double* a){
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	double lanes[2];
+	size_t i;
+	for(i = 0; i + 4 <= n; i += 4){
+		acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+		acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+	}
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+	return lanes[0] + lanes[1] + sum_scalar(n - i, a + i);
+}
+
+static __attribute__((target("avx2"))) double sum_avx2(size_t n, const double* a){
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	double lanes[4];
+	size_t i;
+	for(i = 0; i + 8 <= n; i += 8){
+		acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+		acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+	}
+	_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sum_scalar(n - i, a + i);
+}
+
+static __attribute__((target("avx512f"))) double sum_avx512(size_t n, const double* a){
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	size_t i;
+	for(i = 0; i + 16 <= n; i += 16){
+		acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(a + i));
+		acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(a + i + 8));
+	}
+	return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1)) + sum_scalar(n - i, a + i);
+}
+
+/* 2^k is built as 2^(k - 1) * 2, so that k = 1024 (x just below EXPV_MAX) does not need exponent 2047 */
+static __attribute__((target("avx2,fma"))) void expv_avx2(size_t n, const double* a, double* out){
+	const __m256d lo = _mm256_set1_pd(EXPV_MIN), hi = _mm256_set1_pd(EXPV_MAX);
+	const __m256d magic = _mm256_set1_pd(EXPV_MAGIC), two = _mm256_set1_pd(2.0);
+	const __m256i bias = _mm256_set1_epi64x(1022);
+	size_t i;
+	int c;
+
+	for(i = 0; i + 4 <= n; i += 4){
+		__m256d x = _mm256_loadu_pd(a + i), xc, k, r, p, scale;
+		__m256i bits;
+		xc = _mm256_min_pd(_mm256_max_pd(x, lo), hi);
+		k = _mm256_round_pd(_mm256_mul_pd(xc, _mm256_set1_pd(EXPV_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXPV_LN2_HI), xc);
+		r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXPV_LN2_LO), r);
+		p = _mm256_set1_pd(expv_taylor[0]);
+		for(c = 1; c < (int)(sizeof(expv_taylor) / sizeof(expv_taylor[0])); c++){
+			p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(expv_taylor[c]));
+		}
+		bits = _mm256_castpd_si256(_mm256_add_pd(k, magic));
+		scale = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(bits, bias), 52));
+		p = _mm256_mul_pd(_mm256_mul_pd(p, scale), two);
+		p = _mm256_blendv_pd(p, _mm256_setzero_pd(), _mm256_cmp_pd(x, lo, _CMP_LT_OQ));
+		p = _mm256_blendv_pd(p, _mm256_set1_pd(HUGE_VAL), _mm256_cmp_pd(x, hi, _CMP_GT_OQ));
+		p = _mm256_blendv_pd(p, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+		_mm256_storeu_pd(out + i, p);
+	}
+	expv_scalar(n - i, a + i, out + i);
+}
+
+static __attribute__((target("avx512f"))) void expv_avx512(size_t n, const double* a, double* out){
+	const __m512d lo = _mm512_set1_pd(EXPV_MIN), hi = _mm512_set1_pd(EXPV_MAX);
+	const __m512d magic = _mm512_set1_pd(EXPV_MAGIC), two = _mm512_set1_pd(2.0);
+	const __m512i bias = _mm512_set1_epi64(1022);
+	size_t i;
+	int c;
+
+	for(i = 0; i + 8 <= n; i += 8){
+		__m512d x = _mm512_loadu_pd(a + i), xc, k, r, p, scale;
+		__m512i bits;
+		xc = _mm512_min_pd(_mm512_max_pd(x, lo), hi);
+		k = _mm512_roundscale_pd(_mm512_mul_pd(xc, _mm512_set1_pd(EXPV_LOG2E)), _MM_FROUND_TO_NEAREST_INT);
+		r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXPV_LN2_HI), xc);
+		r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXPV_LN2_LO), r);
+		p = _mm512_set1_pd(expv_taylor[0]);
+		for(c = 1; c < (int)(sizeof(expv_taylor) / sizeof(expv_taylor[0])); c++){
+			p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(expv_taylor[c]));
+		}
+		bits = _mm512_castpd_si512(_mm512_add_pd(k, magic));
+		scale = _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_add_epi64(bits, bias), 52));
+		p = _mm512_mul_pd(_mm512_mul_pd(p, scale), two);
+		p = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, lo, _CMP_LT_OQ), p, _mm512_setzero_pd());
+		p = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, hi, _CMP_GT_OQ), p, _mm512_set1_pd(HUGE_VAL));
+		p = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), p, x);
+		_mm512_storeu_pd(out + i, p);
+	}
+	expv_scalar(n - i, a + i, out + i);
+}
+#endif
+
+/* Kernel tables, indexed by level */
+static const simd_kernels simd_table[] = {
+	{add_scalar, sub_scalar, mul_scalar, scale_scalar, fill_scalar, sum_scalar, expv_scalar},
+#ifdef SIMD_X86
+	{add_sse2, sub_sse2, mul_sse2, scale_sse2, fill_sse2, sum_sse2, expv_scalar},
+	{add_avx2, sub_avx2, mul_avx2, scale_avx2, fill_avx2, sum_avx2, expv_avx2},
+	{add_avx512, sub_avx512, mul_avx512, scale_avx512, fill_avx512, sum_avx512, expv_avx512}
+#endif
+};
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT; /* The first call may come from several threads */
+static int simd_supported = -1; /* Highest level the CPU supports, -1 until detected */
+static int simd_current = -1; /* Level in use */
+
+/**
+* Detects the highest instruction set level the CPU (and OS) supports.
+*/
+static int simd_detect(void){
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))return SIMD_AVX512;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))return SIMD_AVX2;
+	if(__builtin_cpu_supports("sse2"))return SIMD_SSE2;
+#endif
+	return SIMD_SCALAR;
+}
+
+/**
+* Sets the supported level and the level in use, once, through simd_once.
+*/
+static void simd_init(void){
+	simd_supported = simd_detect();
+	simd_current = simd_supported;
+}
+
+/**
+* Returns the instruction set level in use, detecting it on the first call. Safe to call from any
+* thread.
+*
+* @returns One of SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 or SIMD_AVX512.
+*/
+int simd_level(void){
+	pthread_once(&simd_once, simd_init);
+	return simd_current;
+}
+
+/**
+* Selects the instruction set level to use, e.g. SIMD_SCALAR to compare against the portable path.
+* Call it while no other thread is using the kernels (such as from tests or at startup).
+*
+* @param level Requested level. It is lowered to the highest level the CPU supports.
+*
+* @returns The level now in use.
+*/
+int simd_set_level(int level){
+	simd_level();
+	if(level < SIMD_SCALAR)level = SIMD_SCALAR;
+	simd_current = (level < simd_supported) ? level : simd_supported;
+	return simd_current;
+}
+
+/**
+* Returns the element-wise kernels for the instruction set level in use.
+*/
+const simd_kernels* simd(void){
+	return &simd_table[simd_level()];
+}
@@ -0,0 +1,25 @@
+#ifndef SIMD_H
+#define SIMD_H
+#include <stddef.h>
+/* Instruction set levels, in increasing order. Each level implies the ones below it */
+#define SIMD_SCALAR 0 /* Portable C90 */
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2 /* AVX2 + FMA */
+#define SIMD_AVX512 3 /* AVX-512F */
+
+/* Element-wise kernels over n contiguous doubles. out may be the same buffer as a or b. */
+struct simd_kernels {
+	void (*add)(size_t n, const double* a, const double* b, double* out); /* out = a + b */
+	void (*sub)(size_t n, const double* a, const double* b, double* out); /* out = a - b */
+	void (*mul)(size_t n, const double* a, const double* b, double* out); /* out = a * b */
+	void (*scale)(size_t n, const double* a, double b, double* out); /* out = a * b */
+	void (*fill)(size_t n, double value, double* out); /* out = value */
+	double (*sum)(size_t n, const double* a); /* Sum of a, in an unspecified order */
+	void (*expv)(size_t n, const double* a, double* out); /* out = exp(a), see simd.c for the error */
+};
+typedef struct simd_kernels simd_kernels;
+
+const simd_kernels* simd(void);
+int simd_level(void);
+int simd_set_level(int level);
+#endif
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include "enn.h"
+#include "linalg.h"
+#include "nn.h"
+#include "pool.h"
+#include "dataset.h"
+#include "optim.h"
+#include "train.h"
+
+/* Data-parallel mini-batch SGD. Each mini-batch is split into shards of consecutive rows, every shard
+is backpropagated on its own thread into private gradient buffers, the buffers are summed with a tree
+reduction, and the weights are updated once per mini-batch by the optimizer (see optim.h).
+
+The asynchronous mode follows Hogwild! (Niu et al., 2011): every worker walks its own share of the
+samples, backpropagates one sample at a time and writes its update straight into the shared weights,
+with no locks and no barrier. Workers may read weights that another worker is halfway through updating;
+for networks whose updates rarely collide this costs little accuracy, and no core ever waits. */
+
+/* One mini-batch, split into shards */
+struct train_job {
+	const neural_network* nn;
+	const Matrix* X; /* Inputs of the mini-batch, one sample per row */
+	const Matrix* Y; /* Desired outputs of the mini-batch, one sample per row */
+	lfuncd dloss_func;
+	Matrix**** grads; /* Private gradients of each shard, from ngrad_new() */
+	int* status; /* Result of nbprop_batch() for each shard */
+	int shards;
+	int stride; /* Distance between the shards summed by the current reduction step */
+	optim* optim; /* Updates the network after each mini-batch */
+	int own_optim; /* Nonzero if optim was made for this job (plain SGD) */
+	/* Asynchronous mode only */
+	neural_network* shared_nn; /* The network all workers update */
+	const int* order; /* Order to visit the samples in, NULL for 0, 1, 2, ... */
+	double learning_rate;
+};
+
+/**
+* Sets the default training options: 1 epoch of mini-batches of 32, a learning rate of 0.01, one shard
+* per thread, no shuffling, mean squared error loss and plain SGD.
+*
+* @param opts Pointer to the options to fill in.
+*/
+void ntrain_defaults(train_opts* opts){
+	if(!opts)return;
+	opts->epochs = 1;
+	opts->batch_size = 32;
+	opts->learning_rate = 0.01;
+	opts->shards = 0;
+	opts->shuffle = 0;
+	opts->seed = 1;
+	opts->dloss_func = dmse;
+	opts->async = 0;
+	opts->optim = NULL;
+}
+
+/**
+* Pool task: backpropagates the shards [begin, end) of a mini-batch.
+*/
+static void train_shard_task(void* arg, int begin, int end){
+	struct train_job* job = arg;
+	Matrix X_shard, Y_shard;
+	int shard, row, rows;
+
+	for(shard = begin; shard < end; shard++){
+		row = (int)((long)job->X->rows * shard / job->shards);
+		rows = (int)((long)job->X->rows * (shard + 1) / job->shards) - row;
+		ngrad_zero(job->nn, job->grads[shard]);
+		job->status[shard] = nbprop_batch(job->nn, mrows(job->X, row, rows, &X_shard),
+										  mrows(job->Y, row, rows, &Y_shard), job->dloss_func, job->grads[shard]);
+	}
+}
+
+/**
+* Pool task: one step of the tree reduction. Pair i adds the gradients of shard (2i + 1) * stride into
+* shard 2i * stride.
+*/
+static void train_reduce_task(void* arg, int begin, int end){
+	struct train_job* job = arg;
+	int pair, layer, dst, src;
+
+	for(pair = begin; pair < end; pair++){
+		dst = pair * 2 * job->stride;
+		src = dst + job->stride;
+		if(src >= job->shards)continue;
+		for(layer = 0; layer < job->nn->n_layers - 1; layer++){
+			madd(job->grads[dst][0][layer], job->grads[src][0][layer], job->grads[dst][0][layer]);
+			madd(job->grads[dst][1][layer], job->grads[src][1][layer], job->grads[dst][1][layer]);
+		}
+	}
+}
+
+/**
+* Lock-free gradient descent step, w = w - step * g, for the asynchronous mode. Elements with a zero
+* gradient (common after ReLU) are not written at all, which keeps workers off each other's cache lines.
+*/
+static void train_sgd_sparse(Matrix* w, const Matrix* g, double step){
+	int row, col;
+
+	for(row = 0; row < w->rows; row++){
+		double* wrow = w->data[row];
+		const double* grow = g->data[row];
+		for(col = 0; col < w->cols; col++){
+			if(grow[col] != 0.0)wrow[col] -= step * grow[col];
+		}
+	}
+}
+
+/**
+* Pool task: asynchronous workers [begin, end). Worker w trains on samples w, w + shards, w + 2 * shards,
+* ... of the epoch, updating the shared network after every sample.
+*/
+static void train_hogwild_task(void* arg, int begin, int end){
+	struct train_job* job = arg;
+	neural_network* nn = job->shared_nn;
+	Matrix X_sample, Y_sample;
+	int worker, i, sample, layer;
+
+	for(worker = begin; worker < end; worker++){
+		job->status[worker] = 1;
+		for(i = worker; i < job->X->rows; i += job->shards){
+			sample = job->order ? job->order[i] : i;
+			ngrad_zero(nn, job->grads[worker]);
+			if(!nbprop_batch(nn, mrows(job->X, sample, 1, &X_sample), mrows(job->Y, sample, 1, &Y_sample),
+							 job->dloss_func, job->grads[worker])){
+				job->status[worker] = 0;
+				break;
+			}
+			for(layer = 0; layer < nn->n_layers - 1; layer++){
+				train_sgd_sparse(nn->weights[layer], job->grads[worker][0][layer], job->learning_rate);
+				train_sgd_sparse(nn->biases[layer], job->grads[worker][1][layer], job->learning_rate);
+			}
+		}
+	}
+}
+
+/**
+* Runs one mini-batch: backpropagates the shards in parallel, sums their gradients and updates the
+* weights and biases.
+*
+* @returns 1 on success, 0 on error.
+*/
+static int train_batch(neural_network* nn, struct train_job* job){
+	int shard, shards_wanted = job->shards;
+
+	/* Never make empty shards */
+	if(job->shards > job->X->rows)job->shards = job->X->rows;
+	pool_for(job->shards, 1, train_shard_task, job);
+	for(shard = 0; shard < job->shards; shard++){
+		if(!job->status[shard]){
+			job->shards = shards_wanted;
+			return 0;
+		}
+	}
+
+	/* Tree reduction: after the step with stride s, shard 2ks holds the sum of shards 2ks to 2(k+1)s - 1 */
+	for(job->stride = 1; job->stride < job->shards; job->stride *= 2){
+		int pairs = (job->shards + 2 * job->stride - 1) / (2 * job->stride);
+		pool_for(pairs, 1, train_reduce_task, job);
+	}
+
+	job->shards = shards_wanted;
+
+	/* The gradients are summed over the samples, so average them in the step */
+	return optim_step(job->optim, nn, job->grads[0], 1.0 / job->X->rows);
+}
+
+/**
+* Copies the rows order[0], ..., order[rows - 1] of a into the first rows of out.
+*/
+static void train_gather(const Matrix* a, const int* order, int rows, Matrix* out){
+	int row, col;
+
+	for(row = 0; row < rows; row++){
+		const double* src = a->data[order[row]];
+		for(col = 0; col < a->cols; col++){
+			out->data[row][col] = src[col];
+		}
+	}
+}
+
+/**
+* Sets up the shards of a training job and their gradient buffers.
+*
+* @param batch_size Maximum samples per mini-batch, which bounds the shards, or 0 for no bound.
+* @param samples Number of training samples, or 0 if unknown.
+*
+* @returns 1 on success, 0 on error (call train_job_free() either way).
+*/
+static int train_job_new(struct train_job* job, neural_network* nn, const train_opts* opts, int batch_size,
+						 int samples){
+	optim_opts sgd;
+	int shard;
+
+	job->nn = nn;
+	job->shared_nn = nn;
+	job->dloss_func = opts->dloss_func;
+	job->learning_rate = opts->learning_rate;
+	job->order = NULL;
+	job->optim = opts->optim;
+	job->own_optim = !opts->optim;
+	if(job->own_optim){
+		optim_defaults(&sgd, OPTIM_SGD);
+		sgd.learning_rate = opts->learning_rate;
+		job->optim = optim_new(nn, &sgd);
+	}
+	job->shards = (opts->shards > 0) ? opts->shards : pool_threads();
+	if(batch_size > 0 && job->shards > batch_size)job->shards = batch_size;
+	if(samples > 0 && job->shards > samples)job->shards = samples;
+	job->grads = calloc(job->shards, sizeof(Matrix***));
+	job->status = calloc(job->shards, sizeof(int));
+	if(!job->optim || !job->grads || !job->status)return 0;
+	for(shard = 0; shard < job->shards; shard++){
+		job->grads[shard] = ngrad_new(nn);
+		if(!job->grads[shard])return 0;
+	}
+	return 1;
+}
+
+/**
+* Frees the gradient buffers (and the plain SGD optimizer, if any) of a training job.
+*/
+static void train_job_free(struct train_job* job, const neural_network* nn){
+	int shard;
+
+	for(shard = 0; job->grads && shard < job->shards; shard++){
+		ngrad_free(nn, job->grads[shard]);
+	}
+	free(job->grads);
+	free(job->status);
+	if(job->own_optim)optim_free(job->optim);
+}
+
+/**
+* Trains a neural network with mini-batch gradient descent, splitting every mini-batch across the
+* thread pool, and updating the network with opts->optim (plain SGD if NULL). With opts->async set, the
+* workers instead update the network with plain SGD after every sample without any locking (Hogwild!),
+* and batch_size is not used; an optimizer with state cannot be shared that way, so opts->optim must
+* then be NULL.
+*
+* @param nn A pointer to the neural network to train.
+* @param X The training inputs, one sample per row (samples x inputs).
+* @param Y The desired outputs, one sample per row (samples x outputs).
+* @param opts The training options, see ntrain_defaults().
+*
+* @returns 1 on success, 0 on error.
+*/
+int ntrain(neural_network* nn, const Matrix* X, const Matrix* Y, const train_opts* opts){
+	struct train_job job;
+	Matrix *X_batch = NULL, *Y_batch = NULL, X_view, Y_view;
+	int* order = NULL;
+	unsigned long seed;
+	int epoch, start, rows, shard, i, ok = 1;
+
+	if(!nn || !X || !Y || !opts || !opts->dloss_func || opts->batch_size < 1 || X->rows != Y->rows)return 0;
+	if(opts->async && opts->optim)return 0;
+	ok = train_job_new(&job, nn, opts, opts->async ? 0 : opts->batch_size, X->rows);
+
+	/* Shuffled batches are gathered into their own buffers, otherwise they are views of X and Y.
+	Asynchronous workers read single samples through order instead */
+	if(ok && opts->shuffle){
+		order = malloc(X->rows * sizeof(int));
+		ok = order != NULL;
+		for(i = 0; ok && i < X->rows; i++)order[i] = i;
+		if(ok && !opts->async){
+			X_batch = mnew(opts->batch_size, X->cols);
+			Y_batch = mnew(opts->batch_size, Y->cols);
+			ok = X_batch && Y_batch;
+		}
+	}
+
+	seed = opts->seed;
+	for(epoch = 0; ok && epoch < opts->epochs; epoch++){
+		if(opts->shuffle){
+			/* Fisher-Yates shuffle with a linear congruential generator */
+			for(i = X->rows - 1; i > 0; i--){
+				int j, tmp;
+				seed = seed * 1103515245UL + 12345UL;
+				j = (int)((seed >> 16) % (unsigned long)(i + 1));
+				tmp = order[i];
+				order[i] = order[j];
+				order[j] = tmp;
+			}
+		}
+
+		if(opts->async){
+			job.X = X;
+			job.Y = Y;
+			job.order = order;
+			pool_for(job.shards, 1, train_hogwild_task, &job);
+			for(shard = 0; shard < job.shards; shard++){
+				ok = ok && job.status[shard];
+			}
+			continue;
+		}
+
+		for(start = 0; ok && start < X->rows; start += opts->batch_size){
+			rows = (X->rows - start < opts->batch_size) ? X->rows - start : opts->batch_size;
+			if(opts->shuffle){
+				train_gather(X, order + start, rows, X_batch);
+				train_gather(Y, order + start, rows, Y_batch);
+				job.X = mrows(X_batch, 0, rows, &X_view);
+				job.Y = mrows(Y_batch, 0, rows, &Y_view);
+			}
+			else{
+				job.X = mrows(X, start, rows, &X_view);
+				job.Y = mrows(Y, start, rows, &Y_view);
+			}
+			ok = train_batch(nn, &job);
+		}
+	}
+
+	train_job_free(&job, nn);
+	free(order);
+	mfree(X_batch);
+	mfree(Y_batch);
+
+	return ok;
+}
+
+/**
+* Trains a neural network like ntrain(), on batches streamed from a dataset. The dataset's prefetch
+* thread reads and prepares the next batches (see dsnormalize() and dsshuffle()) while the current one
+* is trained on, so reading the data only holds training up when it is slower than training; see
+* dsstats() for the stall counters. The batch size is the dataset's (opts->batch_size is not used),
+* opts->shuffle is not used either (the dataset shuffles), and opts->async is not supported.
+*
+* @param nn A pointer to the neural network to train.
+* @param ds The training set, with inputs and outputs matching the network. It is rewound before every
+* epoch after the first.
+* @param opts The training options, see ntrain_defaults().
+*
+* @returns 1 on success, 0 on error (including a read error in the dataset).
+*/
+int ntrain_stream(neural_network* nn, dataset* ds, const train_opts* opts){
+	struct train_job job;
+	const Matrix *X, *Y;
+	int epoch, rows = 0, ok;
+
+	if(!nn || !ds || !opts || !opts->dloss_func || opts->async)return 0;
+	ok = train_job_new(&job, nn, opts, dsbatch(ds), 0);
+
+	for(epoch = 0; ok && epoch < opts->epochs; epoch++){
+		if(epoch)ok = dsrewind(ds);
+		while(ok && (rows = dsnext(ds, &X, &Y)) > 0){
+			job.X = X;
+			job.Y = Y;
+			ok = train_batch(nn, &job);
+		}
+		if(rows < 0)ok = 0;
+	}
+
+	train_job_free(&job, nn);
+	return ok;
+}
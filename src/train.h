@@ -0,0 +1,24 @@
+#ifndef TRAIN_H
+#define TRAIN_H
+#include "nn.h"
+#include "dataset.h"
+#include "optim.h"
+/* Options for ntrain(), see ntrain_defaults() */
+struct train_opts {
+	int epochs; /* Passes over the training set */
+	int batch_size; /* Samples per mini-batch (the last batch of an epoch may be smaller) */
+	double learning_rate; /* Of the plain SGD used when optim is NULL */
+	int shards; /* Pieces each mini-batch is split into, one per thread. 0 for one per pool thread */
+	int shuffle; /* Nonzero to visit the samples in a new random order every epoch */
+	unsigned long seed; /* Seed for the shuffle */
+	lfuncd dloss_func; /* Derivative of the loss function */
+	int async; /* Nonzero for lock-free asynchronous (Hogwild!) training, see ntrain() */
+	optim* optim; /* Optimizer to update the network with (see optim_new()), NULL for plain SGD at learning_rate */
+};
+typedef struct train_opts train_opts;
+
+void ntrain_defaults(train_opts* opts);
+/* One sample per row (samples x inputs), like nbprop_batch() and dsnext() */
+int ntrain(neural_network* nn, const Matrix* X, const Matrix* Y, const train_opts* opts);
+int ntrain_stream(neural_network* nn, dataset* ds, const train_opts* opts);
+#endif
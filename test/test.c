@@ -1,10 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
 #include "../src/enn.h"
 #include "../src/linalg.h"
 #include "../src/activ.h"
 #include "../src/nn.h"
 #include "../src/loss.h"
+#include "../src/simd.h"
+#include "../src/pool.h"
+#include "../src/train.h"
+#include "../src/arena.h"
+#include "../src/mpool.h"
+#include "../src/gemm.h"
+#include "../src/nnf.h"
+#include "../src/quant.h"
+#include "../src/nfile.h"
+#include "../src/ngen.h"
+#include "../src/dataset.h"
 #include "minunit.h"
 
 int tests_run = 0;
@@ -14,6 +30,8 @@ static char* test_mnew(){
 	mat = mnew(5,3);
 	mu_assert("Error, rows != 5", mat->rows == 5);
 	mu_assert("Error, cols != 3", mat->cols == 3);
+	mu_assert("Error, rows are not contiguous", mat->data[1] == mat->buf + mat->stride);
+	mu_assert("Error, storage is not aligned", (size_t)mat->buf % ENN_ALIGN == 0);
 	mfree(mat);
 	return NULL;
 }
@@ -125,6 +143,366 @@ static char* test_mmul(){
 	return NULL;
 }
 
+/* Checks the cache-blocked path of mmul() against the textbook triple loop on odd shapes */
+static char* test_mmul_blocked(){
+	Matrix *a, *b, *prod, *expected;
+	int row, col, index;
+	int m = 67, k = 301, n = 45;
+
+	/* Small integers keep every partial sum exact, so any summation order gives the same result */
+	a = mnew(m, k);
+	b = mnew(k, n);
+	for(row = 0; row < m; row++){
+		for(col = 0; col < k; col++){
+			a->data[row][col] = (row * 7 + col * 3) % 11 - 5;
+		}
+	}
+	for(row = 0; row < k; row++){
+		for(col = 0; col < n; col++){
+			b->data[row][col] = (row * 5 + col) % 7 - 3;
+		}
+	}
+	expected = mconst(m, n, 0.0, NULL);
+	for(row = 0; row < m; row++){
+		for(col = 0; col < n; col++){
+			for(index = 0; index < k; index++){
+				expected->data[row][col] += a->data[row][index] * b->data[index][col];
+			}
+		}
+	}
+
+	prod = mmul(a, b, NULL);
+	mu_assert("Error, blocked mmul(a, b) != expected", mcmp(prod, expected));
+
+	mfree(a);
+	mfree(b);
+	mfree(prod);
+	mfree(expected);
+
+	return NULL;
+}
+
+/* Transposed operands must give the same products as explicit transposes, on the small, blocked and
+threaded (split by rows and by columns) paths */
+static char* test_mmult(){
+	Matrix *a, *b, *at, *bt, *expected, *prod, *twice;
+	int sizes[4][3] = {{3, 5, 4}, {67, 301, 45}, {130, 301, 45}, {45, 301, 130}};
+	int size, row, col, ta, tb;
+
+	pool_set_threads(4);
+	for(size = 0; size < 4; size++){
+		int m = sizes[size][0], k = sizes[size][1], n = sizes[size][2];
+		a = mnew(m, k);
+		b = mnew(k, n);
+		for(row = 0; row < m; row++){
+			for(col = 0; col < k; col++){
+				a->data[row][col] = (row * 7 + col * 3) % 11 - 5;
+			}
+		}
+		for(row = 0; row < k; row++){
+			for(col = 0; col < n; col++){
+				b->data[row][col] = (row * 5 + col) % 7 - 3;
+			}
+		}
+		at = mtrns(a, NULL);
+		bt = mtrns(b, NULL);
+		expected = mmul(a, b, NULL);
+		twice = mscale(expected, 2.0, NULL);
+
+		for(ta = 0; ta < 2; ta++){
+			for(tb = 0; tb < 2; tb++){
+				prod = mmult(ta ? at : a, ta, tb ? bt : b, tb, NULL);
+				mu_assert("Error, mmult(op(a), op(b)) != a * b", mcmp(prod, expected));
+				mu_assert("Error, mmacc did not accumulate", mmacc(ta ? at : a, ta, tb ? bt : b, tb, prod) == prod);
+				mu_assert("Error, mmacc(op(a), op(b)) != 2 * a * b", mcmp(prod, twice));
+				mfree(prod);
+			}
+		}
+		mu_assert("Error, mmult accepted mismatched shapes", !mmult(a, 1, b, 0, NULL));
+		mu_assert("Error, mmacc accepted a NULL output", !mmacc(a, 0, b, 0, NULL));
+
+		mfree(a);
+		mfree(b);
+		mfree(at);
+		mfree(bt);
+		mfree(expected);
+		mfree(twice);
+	}
+	pool_set_threads(0);
+
+	return NULL;
+}
+
+/* With ENN_BLAS, the external BLAS must agree with the built-in kernels (without it, this compares the
+built-in kernels with themselves) */
+static char* test_blas(){
+	Matrix *a, *b, *prod[2], *sum[2], *scaled[2];
+	int blas = gemm_blas(), use, row, col;
+
+	a = mnew(300, 300);
+	b = mnew(300, 300);
+	for(row = 0; row < 300; row++){
+		for(col = 0; col < 300; col++){
+			a->data[row][col] = (row * 7 + col * 3) % 11 - 5;
+			b->data[row][col] = (row * 5 + col) % 7 - 3;
+		}
+	}
+	for(use = 0; use < 2; use++){
+		gemm_set_blas(use);
+		prod[use] = mmul(a, b, NULL);
+		sum[use] = mconst(300, 300, 1.0, NULL);
+		madd(sum[use], a, sum[use]);
+		scaled[use] = mconst(300, 300, 3.0, NULL);
+		mscale(scaled[use], 0.5, scaled[use]);
+	}
+	gemm_set_blas(blas);
+
+	/* Small integers keep the products exact in any summation order */
+	mu_assert("Error, BLAS mmul != built-in mmul", mcmp(prod[0], prod[1]));
+	mu_assert("Error, BLAS madd != built-in madd", mcmp(sum[0], sum[1]));
+	mu_assert("Error, BLAS mscale != built-in mscale", mcmp(scaled[0], scaled[1]));
+
+	for(use = 0; use < 2; use++){
+		mfree(prod[use]);
+		mfree(sum[use]);
+		mfree(scaled[use]);
+	}
+	mfree(a);
+	mfree(b);
+
+	return NULL;
+}
+
+/* Checks the fused layer kernels against separate mmul, bias, mapply and mhad passes. The shared
+dimension is deeper than one cache block, so the epilogue must wait for the last block. */
+static char* test_mdense(){
+	Matrix *w, *x, *bias, *act, *fused, *expected, *derivs;
+	int row, col, m = 37, k = 300, n = 20;
+
+	w = mnew(m, k);
+	x = mnew(k, n);
+	bias = mnew(m, 1);
+	act = mnew(m, n);
+	for(row = 0; row < m; row++){
+		for(col = 0; col < k; col++){
+			w->data[row][col] = ((row * 7 + col * 3) % 11 - 5) * 0.01;
+		}
+		bias->data[row][0] = row * 0.1 - 1.5;
+	}
+	for(row = 0; row < k; row++){
+		for(col = 0; col < n; col++){
+			x->data[row][col] = ((row * 5 + col) % 7 - 3) * 0.1;
+		}
+	}
+	for(row = 0; row < m; row++){
+		for(col = 0; col < n; col++){
+			act->data[row][col] = ((row + col) % 9) * 0.1;
+		}
+	}
+
+	/* activ(w * x + bias) */
+	expected = mmul(w, x, NULL);
+	for(row = 0; row < m; row++){
+		for(col = 0; col < n; col++){
+			expected->data[row][col] += bias->data[row][0];
+		}
+	}
+	mapply(expected, asigm, expected);
+	fused = mdense(w, x, bias, asigm, NULL);
+	mu_assert("Error, mdense != activ(w * x + bias)", mcmp(fused, expected));
+	mfree(fused);
+	mfree(expected);
+
+	/* (w * x) * deriv(act) */
+	expected = mmul(w, x, NULL);
+	derivs = mapply(act, dsigm, NULL);
+	mhad(expected, derivs, expected);
+	fused = mdelta(w, 0, x, act, dsigm, NULL);
+	mu_assert("Error, mdelta != (w * x) * deriv(act)", mcmp(fused, expected));
+
+	mfree(fused);
+	mfree(expected);
+	mfree(derivs);
+	mfree(w);
+	mfree(x);
+	mfree(bias);
+	mfree(act);
+
+	return NULL;
+}
+
+/* Pool task: counts how many times each item is visited */
+static void count_task(void* arg, int begin, int end){
+	int* visits = arg;
+	int i;
+	for(i = begin; i < end; i++)visits[i]++;
+}
+
+/* Two multiplications run from inside pool tasks, see test_pool() */
+struct nested_job {
+	const Matrix *a, *b;
+	Matrix* out[2];
+};
+
+/* Pool task: multiplies large enough matrices for gemm_ex() to want the pool */
+static void nested_task(void* arg, int begin, int end){
+	struct nested_job* job = arg;
+	int i;
+	for(i = begin; i < end; i++)job->out[i] = mmul(job->a, job->b, NULL);
+}
+
+/* Shuts down and resizes the pool while another thread posts jobs to it */
+static void* resize_thread(void* arg){
+	int i;
+	(void)arg;
+	for(i = 0; i < 200; i++){
+		pool_shutdown();
+		pool_set_threads(i % 2 ? 1 : 4);
+	}
+	return NULL;
+}
+
+static char* test_pool(){
+	Matrix *a, *b, *serial, *threaded;
+	struct nested_job nested;
+	pthread_t resizer;
+	int visits[1000];
+	int i, row, col;
+
+	mu_assert("Error, could not start 4 threads", pool_set_threads(4) == 4);
+
+	/* Every item is visited exactly once, whether or not the job is split */
+	for(i = 0; i < 1000; i++)visits[i] = 0;
+	pool_for(1000, 10, count_task, visits);
+	pool_for(1000, 1000, count_task, visits);
+	for(i = 0; i < 1000; i++){
+		mu_assert("Error, pool_for did not visit every item once per job", visits[i] == 2);
+	}
+
+	/* Jobs stay whole while the pool is shut down and restarted under them */
+	for(i = 0; i < 1000; i++)visits[i] = 0;
+	mu_assert("Error, could not start the resizing thread", pthread_create(&resizer, NULL, resize_thread, NULL) == 0);
+	for(i = 0; i < 2000; i++){
+		pool_for(1000, 10, count_task, visits);
+	}
+	pthread_join(resizer, NULL);
+	for(i = 0; i < 1000; i++){
+		mu_assert("Error, pool_for lost items while the pool was resized", visits[i] == 2000);
+	}
+	pool_set_threads(4);
+
+	/* A multiplication large enough to be split gives the same result as on one thread */
+	a = mnew(200, 300);
+	b = mnew(300, 150);
+	for(row = 0; row < 200; row++){
+		for(col = 0; col < 300; col++){
+			a->data[row][col] = ((row * 7 + col * 3) % 11 - 5) * 0.1;
+		}
+	}
+	for(row = 0; row < 300; row++){
+		for(col = 0; col < 150; col++){
+			b->data[row][col] = ((row * 5 + col) % 7 - 3) * 0.1;
+		}
+	}
+	threaded = mmul(a, b, NULL);
+
+	/* Over GEMM_PARALLEL from inside a task, which must run serially rather than wait for the pool */
+	nested.a = a;
+	nested.b = b;
+	nested.out[0] = nested.out[1] = NULL;
+	pool_for(2, 1, nested_task, &nested);
+	for(i = 0; i < 2; i++){
+		mu_assert("Error, nested mmul failed", nested.out[i]);
+		for(row = 0; row < 200; row++){
+			for(col = 0; col < 150; col++){
+				mu_assert("Error, nested mmul != threaded mmul",
+						  fabs(nested.out[i]->data[row][col] - threaded->data[row][col]) < 1e-9);
+			}
+		}
+		mfree(nested.out[i]);
+	}
+	pool_set_threads(1);
+	serial = mmul(a, b, NULL);
+	for(row = 0; row < 200; row++){
+		for(col = 0; col < 150; col++){
+			mu_assert("Error, threaded mmul != serial mmul",
+					  fabs(threaded->data[row][col] - serial->data[row][col]) < 1e-9);
+		}
+	}
+
+	pool_set_threads(0);
+	mfree(a);
+	mfree(b);
+	mfree(serial);
+	mfree(threaded);
+
+	return NULL;
+}
+
+/* Checks the vectorized element-wise kernels against the portable scalar path */
+static char* test_simd(){
+	Matrix *a, *b, *sums[2], *diffs[2], *prods[2], *scaled[2], *filled[2], *smaxs[2];
+	double total[2], abs_total = 0.0;
+	int i, j, l, level, best;
+	int n = 1003; /* Not a multiple of any vector width, so the tails are exercised */
+
+	a = mnew(1, n);
+	b = mnew(1, n);
+	for(i = 0; i < n; i++){
+		a->data[0][i] = (i % 17) * 0.37 - 2.5;
+		b->data[0][i] = (i % 13) * -0.91 + 1.25;
+		abs_total += fabs(a->data[0][i]);
+	}
+
+	/* Run every kernel on the scalar path (0), then on every level the CPU has (1) in turn */
+	best = simd_level();
+	for(l = SIMD_SCALAR; l <= best; l++){
+		i = (l != SIMD_SCALAR);
+		level = simd_set_level(l);
+		mu_assert("Error, could not select SIMD level", level == l);
+		sums[i] = madd(a, b, NULL);
+		diffs[i] = msub(a, b, NULL);
+		prods[i] = mhad(a, b, NULL);
+		scaled[i] = mscale(a, 0.3, NULL);
+		filled[i] = mconst(3, 7, 0.1, NULL);
+		smaxs[i] = asmax(a);
+		total[i] = simd()->sum(n, a->buf);
+		if(!i)continue;
+
+		/* Add, subtract and multiply round exactly the same way on every path */
+		mu_assert("Error, SIMD madd differs from scalar", mcmp(sums[0], sums[1]));
+		mu_assert("Error, SIMD msub differs from scalar", mcmp(diffs[0], diffs[1]));
+		mu_assert("Error, SIMD mhad differs from scalar", mcmp(prods[0], prods[1]));
+		mu_assert("Error, SIMD mscale differs from scalar", mcmp(scaled[0], scaled[1]));
+		mu_assert("Error, SIMD mconst differs from scalar", mcmp(filled[0], filled[1]));
+		/* Sums are reassociated, so allow the usual n * eps * sum(|a|) error bound */
+		mu_assert("Error, SIMD sum differs from scalar", fabs(total[0] - total[1]) <= n * DBL_EPSILON * abs_total);
+		for(j = 0; j < n; j++){
+			mu_assert("Error, SIMD asmax differs from scalar",
+					  fabs(smaxs[0]->data[0][j] - smaxs[1]->data[0][j]) <= n * DBL_EPSILON * smaxs[0]->data[0][j]);
+		}
+		mfree(sums[1]);
+		mfree(diffs[1]);
+		mfree(prods[1]);
+		mfree(scaled[1]);
+		mfree(filled[1]);
+		mfree(smaxs[1]);
+	}
+
+	simd_set_level(best);
+
+	mfree(sums[0]);
+	mfree(diffs[0]);
+	mfree(prods[0]);
+	mfree(scaled[0]);
+	mfree(filled[0]);
+	mfree(smaxs[0]);
+	mfree(a);
+	mfree(b);
+
+	return NULL;
+}
+
 static char* test_mhad(){
 	Matrix *a, *b, *c, *prod;
 	double ad[2][2] = {
@@ -185,6 +563,9 @@ static char* test_mscale(){
 	mfree(as);
 	mfree(a);
 	mfree(b);
+	mfree(cs);
+	mfree(c);
+	mfree(d);
 
 	return NULL;
 }
@@ -217,68 +598,177 @@ static char* test_arelu(){
 	return NULL;
 }
 
-static char* test_npred(){
-	#define N_TESTS 10
-	Matrix **weights, **biases, *out_prob, *current_vector, *current_vector_trns;
+static char* test_asmax(){
+	Matrix *logits, *logits_t, *rows, *cols, *cols_t, *in_place, *vec, *vec_out;
+	double x[1001], e[1001], max, sum;
+	int i, row, col;
+
+	/* The vector exp stays within its documented error over the whole normal range */
+	for(i = 0; i < 1001; i++){
+		x[i] = -708.0 + 1417.0 * i / 1000.0;
+	}
+	simd()->expv(1001, x, e);
+	for(i = 0; i < 1001; i++){
+		mu_assert("Error, expv is not accurate", fabs(e[i] - exp(x[i])) <= 1e-15 * exp(x[i]));
+	}
+
+	/* Logits of 1000 and more overflow exp unless the maximum is subtracted */
+	logits = mnew(4, 5);
+	for(row = 0; row < 4; row++){
+		for(col = 0; col < 5; col++){
+			logits->data[row][col] = 1000.0 * (row % 2) + 3.0 * col - row;
+		}
+	}
+	logits_t = mtrns(logits, NULL);
+	rows = asmax2(logits, ASMAX_ROWS, NULL);
+	cols_t = asmax2(logits_t, ASMAX_COLS, NULL);
+	cols = mtrns(cols_t, NULL);
+	mu_assert("Error, asmax2 returned NULL", rows && cols_t);
+	for(row = 0; row < 4; row++){
+		max = logits->data[row][4];
+		sum = 0.0;
+		for(col = 0; col < 5; col++){
+			sum += exp(logits->data[row][col] - max);
+		}
+		for(col = 0; col < 5; col++){
+			double expected = exp(logits->data[row][col] - max) / sum;
+			mu_assert("Error, asmax2 rows is wrong", fabs(rows->data[row][col] - expected) < 1e-14);
+			mu_assert("Error, asmax2 cols is wrong", fabs(cols->data[row][col] - expected) < 1e-14);
+		}
+	}
+	in_place = mscale(logits, 1.0, NULL);
+	mu_assert("Error, in place asmax2 is wrong", asmax2(in_place, ASMAX_ROWS, in_place) == in_place
+			  && mcmp(in_place, rows));
+
+	/* asmax normalizes the whole (column) vector, stably too */
+	vec = mnew(5, 1);
+	for(i = 0; i < 5; i++){
+		vec->data[i][0] = logits->data[1][i];
+	}
+	vec_out = asmax(vec);
+	for(i = 0; i < 5; i++){
+		mu_assert("Error, asmax is wrong", fabs(vec_out->data[i][0] - rows->data[1][i]) < 1e-14);
+	}
+
+	mfree(logits);
+	mfree(logits_t);
+	mfree(rows);
+	mfree(cols);
+	mfree(cols_t);
+	mfree(in_place);
+	mfree(vec);
+	mfree(vec_out);
+
+	return NULL;
+}
+
+/* The whole-buffer activations (see avec()) match the scalar ones at every SIMD level */
+static char* test_avec(){
+	dfunc activs[] = {arelu, asigm, atnh, agelu, aelu};
+	Matrix *x, *vec, *dense, *w;
 	neural_network* nn;
-	int i, j, n_layers, prediction;
-	double pred_max;
-	/* Weights and biases of neural network to test predictions */
-	double w0[4][4] = {
-		{-0.5206975 ,  0.5338802 , -0.5602411 , -0.09294045},
-		{-0.81646407,  0.07859222,  0.8910857 ,  0.9753645 },
-		{ 0.0776132 , -0.71796286,  1.0895936 ,  0.40837875},
-		{-0.46662232,  0.19200796,  0.38742024, -0.2863772 }
-	};
-	double w1[4][4] = {
-		{ 0.2019741 , -0.71195257, -0.8410556 ,  0.6462495 },
-		{-0.636823  ,  1.4791069 ,  0.25363532, -0.30699533},
-		{-0.7421215 ,  1.5144516 ,  0.48467913,  0.81691414},
-		{-0.62316686, -0.7518175 ,  0.7958357 , -0.5908574 }
-	};
-	double w2[3][4] = {
-		{ 0.24331057, -1.0454109 , -1.8839567 , -1.2707748 },
-		{-0.88661844, -1.3611857 ,  0.29023024,  1.1938326 },
-		{ 0.01811641,  0.8420355 ,  0.980748  , -0.07365165}
-	};
-	double b0[4] = {0.0, -0.563959, -0.06092859, 0.0};
-	double b1[4] = {0.0, -0.82546085, -0.3782354, -0.00169147};
-	double b2[3] = {1.9372896, -0.7055002, -1.4840443};
-	/*double test_set_X[5][4] = {
-		{6.1, 2.8, 4.7, 1.2},
-		{5.7, 3.8, 1.7, 0.3},
-		{7.7, 2.6, 6.9, 2.3},
-		{6. , 2.9, 4.5, 1.5},
-		{6.8, 2.8, 4.8, 1.4}
-	};
-	int test_set_y[5] = {1, 0, 2, 1, 1};
-	*/
-	double test_set_X[N_TESTS][4] = {
-		{6.1, 2.8, 4.7, 1.2},
-		{5.7, 3.8, 1.7, 0.3},
-		{7.7, 2.6, 6.9, 2.3},
-		{6. , 2.9, 4.5, 1.5},
-		{6.8, 2.8, 4.8, 1.4},
-		{5.4, 3.4, 1.5, 0.4},
-		{5.6, 2.9, 3.6, 1.3},
-		{6.9, 3.1, 5.1, 2.3},
-		{6.2, 2.2, 4.5, 1.5},
-		{5.8, 2.7, 3.9, 1.2}
-	};
-	int test_set_y[N_TESTS] = {1, 0, 2, 1, 1, 0, 1, 2, 1, 1};
-	n_layers = 4;
+	int best, level, i, f, j;
+
+	/* More than ACTIV_CHUNK elements per row, so the kernels take several chunks */
+	x = mnew(2, 700);
+	for(j = 0; j < 700; j++){
+		x->data[0][j] = -40.0 + 80.0 * j / 699.0;
+		x->data[1][j] = (j - 350) * 1e-3;
+	}
+	x->data[1][0] = -800.0;
+	x->data[1][1] = 800.0;
+	w = meye(2, NULL);
+	best = simd_level();
+	for(i = SIMD_SCALAR; i <= best; i++){
+		level = simd_set_level(i);
+		for(f = 0; f < (int)(sizeof(activs) / sizeof(activs[0])); f++){
+			mu_assert("Error, activation has no whole-buffer version", avec(activs[f]) != NULL);
+			vec = mapply(x, activs[f], NULL);
+			dense = mdense(w, x, NULL, activs[f], NULL);
+			mu_assert("Error, mapply or mdense returned NULL", vec && dense);
+			for(j = 0; j < 1400; j++){
+				double in = x->data[j / 700][j % 700], expected = activs[f](in);
+				mu_assert("Error, whole-buffer activation is not accurate",
+						  fabs(vec->data[j / 700][j % 700] - expected) <= 1e-15 * (1 + fabs(in)));
+				mu_assert("Error, mdense does not match mapply",
+						  fabs(dense->data[j / 700][j % 700] - vec->data[j / 700][j % 700]) <= 1e-15 * (1 + fabs(in)));
+			}
+			mfree(vec);
+			mfree(dense);
+		}
+		simd_set_level(level);
+	}
+
+	/* Activations selected by ID get their derivative paired, and round trip through aid() */
+	nn = ninit(2, 1, 3, 2, NULL, NULL);
+	mu_assert("Error, nactiv rejected ACTIV_TANH", nactiv(nn, ACTIV_TANH, ACTIV_SMAX));
+	mu_assert("Error, nactiv did not select atnh", nn->hidden_activ == atnh && nn->hidden_deriv == dtnh
+			  && nn->output_activ == asmax && aid(nn->hidden_activ) == ACTIV_TANH);
+	mu_assert("Error, nactiv accepted an unknown ID", !nactiv(nn, 1000, ACTIV_NONE) && nn->hidden_activ == atnh);
+	mu_assert("Error, agelu has a derivative", nactiv(nn, ACTIV_GELU, ACTIV_NONE) && !nn->hidden_deriv);
+	mu_assert("Error, delu is wrong", fabs(delu(aelu(-0.5)) - exp(-0.5)) < 1e-15 && delu(aelu(2.0)) == 1.0);
+
+	nfree(nn);
+	mfree(w);
+	mfree(x);
+
+	return NULL;
+}
+
+/* Weights and biases of a Keras model trained on the iris dataset (see gen_weights.py), used to test
+predictions */
+#define N_TESTS 10
+static double iris_w0[4][4] = {
+	{-0.5206975 ,  0.5338802 , -0.5602411 , -0.09294045},
+	{-0.81646407,  0.07859222,  0.8910857 ,  0.9753645 },
+	{ 0.0776132 , -0.71796286,  1.0895936 ,  0.40837875},
+	{-0.46662232,  0.19200796,  0.38742024, -0.2863772 }
+};
+static double iris_w1[4][4] = {
+	{ 0.2019741 , -0.71195257, -0.8410556 ,  0.6462495 },
+	{-0.636823  ,  1.4791069 ,  0.25363532, -0.30699533},
+	{-0.7421215 ,  1.5144516 ,  0.48467913,  0.81691414},
+	{-0.62316686, -0.7518175 ,  0.7958357 , -0.5908574 }
+};
+static double iris_w2[3][4] = {
+	{ 0.24331057, -1.0454109 , -1.8839567 , -1.2707748 },
+	{-0.88661844, -1.3611857 ,  0.29023024,  1.1938326 },
+	{ 0.01811641,  0.8420355 ,  0.980748  , -0.07365165}
+};
+static double iris_b0[4] = {0.0, -0.563959, -0.06092859, 0.0};
+static double iris_b1[4] = {0.0, -0.82546085, -0.3782354, -0.00169147};
+static double iris_b2[3] = {1.9372896, -0.7055002, -1.4840443};
+static double iris_X[N_TESTS][4] = {
+	{6.1, 2.8, 4.7, 1.2},
+	{5.7, 3.8, 1.7, 0.3},
+	{7.7, 2.6, 6.9, 2.3},
+	{6. , 2.9, 4.5, 1.5},
+	{6.8, 2.8, 4.8, 1.4},
+	{5.4, 3.4, 1.5, 0.4},
+	{5.6, 2.9, 3.6, 1.3},
+	{6.9, 3.1, 5.1, 2.3},
+	{6.2, 2.2, 4.5, 1.5},
+	{5.8, 2.7, 3.9, 1.2}
+};
+static int iris_y[N_TESTS] = {1, 0, 2, 1, 1, 0, 1, 2, 1, 1};
+
+/* Builds the iris neural network from the arrays above. Free with nfree() */
+static neural_network* iris_nn(){
+	Matrix **weights, **biases;
+	neural_network* nn;
+	int i, n_layers = 4;
 
 	/* Allocate variables for weights and biases */
 	weights = malloc(sizeof(Matrix*) * (n_layers - 1));
 	biases = malloc(sizeof(Matrix*) * (n_layers - 1));
 
 	/* Put weights and biases into Matrix* structs */
-	MDUP(w0, weights[0], 4, 4);
-	MDUP(w1, weights[1], 4, 4);
-	MDUP(w2, weights[2], 3, 4);
-	MDUP(&b0, biases[0], 1, 4);
-	MDUP(&b1, biases[1], 1, 4);
-	MDUP(&b2, biases[2], 1, 3);
+	MDUP(iris_w0, weights[0], 4, 4);
+	MDUP(iris_w1, weights[1], 4, 4);
+	MDUP(iris_w2, weights[2], 3, 4);
+	MDUP(&iris_b0, biases[0], 1, 4);
+	MDUP(&iris_b1, biases[1], 1, 4);
+	MDUP(&iris_b2, biases[2], 1, 3);
 
 	/* Convert biases to column vectors */
 	for(i = 0; i < n_layers - 1; i++){
@@ -292,28 +782,43 @@ static char* test_npred(){
 	nn->weights = weights;
 	nn->biases = biases;
 	nn->hidden_activ = &arelu;
+	nn->hidden_deriv = &drelu;
 	nn->output_activ = &asmax;
 	nn->n_layers = n_layers;
+	nn->map = NULL;
+	nn->map_size = 0;
+
+	return nn;
+}
+
+/* Returns the row with the highest value in column col (argmax) */
+static int argmax_col(const Matrix* a, int col){
+	int row, best = 0;
+	for(row = 1; row < a->rows; row++){
+		if(a->data[row][col] > a->data[best][col])best = row;
+	}
+	return best;
+}
+
+static char* test_npred(){
+	Matrix *out_prob, *current_vector, *current_vector_trns;
+	neural_network* nn;
+	int i, prediction;
+
+	nn = iris_nn();
 
 	/* Run the tests */
 	for(i = 0; i < N_TESTS; i++){
 		/* Run the neural network prediction */
-		MDUP(&test_set_X[i], current_vector_trns, 1, 4);
+		MDUP(&iris_X[i], current_vector_trns, 1, 4);
 		current_vector = mtrns(current_vector_trns, NULL);
 		out_prob = npred(nn, current_vector); /* Prediction is a probably as we are using softmax output */
 
 		/* Find the prediction using argmax */
-		pred_max = 0.0;
-		prediction = 0;
-		for(j = 0; j < 3; j++){
-			if(out_prob->data[j][0] > pred_max){
-				pred_max = out_prob->data[j][0];
-				prediction = j;
-			}
-		}
+		prediction = argmax_col(out_prob, 0);
 
 		/* Test against actual TensorFlow predictions */
-		mu_assert("Error: prediction != actual", prediction == test_set_y[i]);
+		mu_assert("Error: prediction != actual", prediction == iris_y[i]);
 
 		/* Free variables */
 		mfree(current_vector_trns);
@@ -322,15 +827,425 @@ static char* test_npred(){
 	}
 
 	/* Free the rest of the variables */
-	mfree(weights[0]);
-	mfree(weights[1]);
-	mfree(weights[2]);
-	mfree(biases[0]);
-	mfree(biases[1]);
-	mfree(biases[2]);
-	free(weights);
-	free(biases);
-	free(nn);
+	nfree(nn);
+
+	return NULL;
+}
+
+static char* test_npred_batch(){
+	Matrix *X_rows, *X, *out, *rows, *current_vector, *out_prob;
+	neural_network* nn;
+	int i, j;
+
+	nn = iris_nn();
+
+	/* One sample per column */
+	MDUP(iris_X, X_rows, N_TESTS, 4);
+	X = mtrns(X_rows, NULL);
+	out = npred_batch(nn, X, NULL);
+	mu_assert("Error, npred_batch returned NULL", out);
+	mu_assert("Error, npred_batch output has wrong shape", out->rows == 3 && out->cols == N_TESTS);
+
+	/* Each column must match running npred on that sample alone */
+	for(i = 0; i < N_TESTS; i++){
+		current_vector = mnew(4, 1);
+		for(j = 0; j < 4; j++){
+			current_vector->data[j][0] = X->data[j][i];
+		}
+		out_prob = npred(nn, current_vector);
+		for(j = 0; j < 3; j++){
+			mu_assert("Error, npred_batch != npred", fabs(out->data[j][i] - out_prob->data[j][0]) < 1e-12);
+		}
+		mu_assert("Error: batch prediction != actual", argmax_col(out, i) == iris_y[i]);
+		mfree(current_vector);
+		mfree(out_prob);
+	}
+
+	/* One sample per row gives the same outputs, transposed */
+	rows = npred_rows(nn, X_rows, NULL);
+	mu_assert("Error, npred_rows returned NULL", rows);
+	mu_assert("Error, npred_rows output has wrong shape", rows->rows == N_TESTS && rows->cols == 3);
+	for(i = 0; i < N_TESTS; i++){
+		for(j = 0; j < 3; j++){
+			mu_assert("Error, npred_rows != npred_batch", rows->data[i][j] == out->data[j][i]);
+		}
+	}
+	mu_assert("Error, npred_rows accepted inputs as columns", !npred_rows(nn, X, NULL));
+	mu_assert("Error, npred_rows accepted an output of the wrong shape", !npred_rows(nn, X_rows, out));
+
+	mfree(X_rows);
+	mfree(X);
+	mfree(out);
+	mfree(rows);
+	nfree(nn);
+
+	return NULL;
+}
+
+/* The float network must agree with the double one to float precision, and make the same predictions */
+static char* test_nconvf(){
+	Matrix *X_rows, *X, *expected, *a, *b, *prod, *prod_d;
+	Matrixf *Xf, *out, *af, *bf, *prodf;
+	neural_network* nn;
+	neural_networkf* nnf;
+	int i, j;
+
+	nn = iris_nn();
+	nnf = nconvf(nn);
+	mu_assert("Error, nconvf returned NULL", nnf);
+
+	MDUP(iris_X, X_rows, N_TESTS, 4);
+	X = mtrns(X_rows, NULL);
+	expected = npred_batch(nn, X, NULL);
+	Xf = mconvf(X, NULL);
+	out = npredf_batch(nnf, Xf, NULL);
+	mu_assert("Error, npredf_batch returned NULL", out);
+	mu_assert("Error, npredf_batch output has wrong shape", out->rows == 3 && out->cols == N_TESTS);
+	for(i = 0; i < N_TESTS; i++){
+		int best = 0;
+		for(j = 0; j < 3; j++){
+			mu_assert("Error, npredf_batch != npred_batch", fabs(out->data[j][i] - expected->data[j][i]) < 1e-4);
+			if(out->data[j][i] > out->data[best][i])best = j;
+		}
+		mu_assert("Error: float prediction != actual", best == iris_y[i]);
+	}
+
+	/* The blocked float kernel, on small integers so the products are exact */
+	a = mnew(67, 301);
+	b = mnew(301, 45);
+	for(i = 0; i < 67; i++){
+		for(j = 0; j < 301; j++){
+			a->data[i][j] = (i * 7 + j * 3) % 11 - 5;
+		}
+	}
+	for(i = 0; i < 301; i++){
+		for(j = 0; j < 45; j++){
+			b->data[i][j] = (i * 5 + j) % 7 - 3;
+		}
+	}
+	af = mconvf(a, NULL);
+	bf = mconvf(b, NULL);
+	prod = mmul(a, b, NULL);
+	prodf = mmulf(af, bf, NULL);
+	prod_d = mconvd(prodf, NULL);
+	mu_assert("Error, mmulf != mmul", mcmp(prod, prod_d));
+
+	/* Activations without a float version cannot be converted */
+	nn->hidden_activ = tanh;
+	mu_assert("Error, nconvf accepted an activation with no float version", !nconvf(nn));
+	nn->hidden_activ = arelu;
+
+	mfree(X_rows);
+	mfree(X);
+	mfree(expected);
+	mfree(a);
+	mfree(b);
+	mfree(prod);
+	mfree(prod_d);
+	mfreef(Xf);
+	mfreef(out);
+	mfreef(af);
+	mfreef(bf);
+	mfreef(prodf);
+	nfreef(nnf);
+	nfree(nn);
+
+	return NULL;
+}
+
+static char* test_nquant(){
+	Matrix *X_rows, *X, *Y, *expected, *out, *out_scalar;
+	neural_network* nn;
+	qnetwork* q;
+	qreport report;
+	int i, j, level;
+
+	nn = iris_nn();
+	q = nquant(nn);
+	mu_assert("Error, nquant returned NULL", q);
+
+	MDUP(iris_X, X_rows, N_TESTS, 4);
+	X = mtrns(X_rows, NULL);
+	expected = npred_batch(nn, X, NULL);
+	out = qpred_batch(q, X, NULL);
+	mu_assert("Error, qpred_batch returned NULL", out);
+	mu_assert("Error, qpred_batch output has wrong shape", out->rows == 3 && out->cols == N_TESTS);
+	for(i = 0; i < N_TESTS; i++){
+		for(j = 0; j < 3; j++){
+			mu_assert("Error, qpred_batch too far from npred_batch", fabs(out->data[j][i] - expected->data[j][i]) < 0.05);
+		}
+		mu_assert("Error: quantized prediction != actual", argmax_col(out, i) == iris_y[i]);
+	}
+
+	/* The scalar kernel gives exactly the same integer sums */
+	level = simd_set_level(SIMD_SCALAR);
+	out_scalar = qpred_batch(q, X, NULL);
+	simd_set_level(level);
+	mu_assert("Error, scalar qpred_batch != vector qpred_batch", mcmp(out, out_scalar));
+
+	Y = mconst(3, N_TESTS, 0.0, NULL);
+	for(i = 0; i < N_TESTS; i++){
+		Y->data[iris_y[i]][i] = 1.0;
+	}
+	mu_assert("Error, qeval failed", qeval(nn, q, X, Y, &report));
+	mu_assert("Error, qeval counted the wrong number of samples", report.samples == N_TESTS);
+	mu_assert("Error, qeval accuracy is wrong", report.accuracy == 1.0 && report.accuracy_q == 1.0);
+	mu_assert("Error, qeval delta is wrong", report.delta == 0.0 && report.max_error < 0.05);
+
+	/* Activations without a float version cannot be quantized */
+	nn->hidden_activ = tanh;
+	mu_assert("Error, nquant accepted an activation with no float version", !nquant(nn));
+	nn->hidden_activ = arelu;
+
+	mfree(X_rows);
+	mfree(X);
+	mfree(Y);
+	mfree(expected);
+	mfree(out);
+	mfree(out_scalar);
+	qfree(q);
+	nfree(nn);
+
+	return NULL;
+}
+
+static char* test_nsave(){
+	const char* path = "enn_test_model.bin";
+	Matrix *X_rows, *X, *expected, *out;
+	neural_network *nn, *loaded, *reloaded;
+	FILE* file;
+	char saved[4096];
+	size_t size;
+	int i, neurons;
+
+	nn = iris_nn();
+	mu_assert("Error, nsave failed", nsave(nn, path));
+	loaded = nload(path);
+	mu_assert("Error, nload returned NULL", loaded);
+	mu_assert("Error, nload has the wrong layers", loaded->n_layers == nn->n_layers);
+	mu_assert("Error, nload has the wrong activations", loaded->hidden_activ == arelu && loaded->hidden_deriv == drelu
+			  && loaded->output_activ == asmax);
+	for(i = 0; i < nn->n_layers - 1; i++){
+		mu_assert("Error, loaded weights != saved weights", mcmp(loaded->weights[i], nn->weights[i]));
+		mu_assert("Error, loaded biases != saved biases", mcmp(loaded->biases[i], nn->biases[i]));
+		mu_assert("Error, loaded weights are not mapped", loaded->weights[i]->flags & MATRIX_EXTERN);
+		mu_assert("Error, loaded weights are not aligned", (size_t)loaded->weights[i]->buf % NFILE_ALIGN == 0);
+	}
+
+	MDUP(iris_X, X_rows, N_TESTS, 4);
+	X = mtrns(X_rows, NULL);
+	expected = npred_batch(nn, X, NULL);
+	out = npred_batch(loaded, X, NULL);
+	mu_assert("Error, loaded network predicts differently", mcmp(out, expected));
+
+	/* Writes to a loaded network stay private to it */
+	loaded->weights[0]->data[0][0] += 1.0;
+	reloaded = nload(path);
+	mu_assert("Error, writing to loaded weights changed the file", reloaded
+			  && reloaded->weights[0]->data[0][0] == nn->weights[0]->data[0][0]);
+
+	/* Files cut short of the last bias blob, or with a corrupted neuron count, are rejected */
+	file = fopen(path, "rb");
+	mu_assert("Error, could not read the saved network", file != NULL);
+	size = fread(saved, 1, sizeof(saved), file);
+	fclose(file);
+	mu_assert("Error, saved network is not as expected", size > sizeof(nfile_header) + 4 * sizeof(int)
+			  && size < sizeof(saved));
+	file = fopen(path, "wb");
+	fwrite(saved, 1, size - 8, file);
+	fclose(file);
+	mu_assert("Error, nload accepted a truncated file", !nload(path));
+	neurons = 1 << 20;
+	memcpy(saved + sizeof(nfile_header) + sizeof(int), &neurons, sizeof(int));
+	file = fopen(path, "wb");
+	fwrite(saved, 1, size, file);
+	fclose(file);
+	mu_assert("Error, nload accepted a corrupted neuron count", !nload(path));
+	neurons = -4;
+	memcpy(saved + sizeof(nfile_header) + sizeof(int), &neurons, sizeof(int));
+	file = fopen(path, "wb");
+	fwrite(saved, 1, size, file);
+	fclose(file);
+	mu_assert("Error, nload accepted a negative neuron count", !nload(path));
+	remove(path);
+
+	/* Activations without an ID cannot be saved */
+	nn->hidden_activ = tanh;
+	mu_assert("Error, nsave accepted an activation with no ID", !nsave(nn, path));
+	nn->hidden_activ = arelu;
+
+	mfree(X_rows);
+	mfree(X);
+	mfree(expected);
+	mfree(out);
+	nfree(reloaded);
+	nfree(loaded);
+	nfree(nn);
+
+	return NULL;
+}
+
+/* Reads a whole (small) text file, or returns NULL */
+static char* read_text(const char* path){
+	FILE* file = fopen(path, "rb");
+	char* text;
+	long size;
+
+	if(!file)return NULL;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	text = malloc(size + 1);
+	if(text && fread(text, 1, size, file) != (size_t)size){
+		free(text);
+		text = NULL;
+	}
+	if(text)text[size] = '\0';
+	fclose(file);
+	return text;
+}
+
+static char* test_ngen(){
+	neural_network* nn = iris_nn();
+	char *source, *header;
+
+	mu_assert("Error, ngen failed", ngen(nn, "enn_test_gen", "."));
+	source = read_text("enn_test_gen.c");
+	header = read_text("enn_test_gen.h");
+	mu_assert("Error, ngen did not write its files", source && header);
+	mu_assert("Error, ngen header is wrong", strstr(header, "#define ENN_TEST_GEN_INPUTS 4\n")
+			  && strstr(header, "#define ENN_TEST_GEN_OUTPUTS 3\n")
+			  && strstr(header, "void enn_test_gen_pred(const double* x, double* out);"));
+	mu_assert("Error, ngen source has no prediction function",
+			  strstr(source, "void enn_test_gen_pred(const double* x, double* out){"));
+	/* The iris layers are small enough to unroll: the only loops left are the softmax ones */
+	mu_assert("Error, ngen did not unroll the layers", !strstr(source, "j++") && strstr(source, "h1[3] = z;")
+			  && strstr(source, "z = (z >= 0) ? z : 0;") && strstr(source, "exp(out[i] - max)"));
+	free(source);
+	free(header);
+	remove("enn_test_gen.c");
+	remove("enn_test_gen.h");
+
+	mu_assert("Error, ngen accepted a name that is not a C identifier", !ngen(nn, "9gen", "."));
+	nn->hidden_activ = tanh;
+	mu_assert("Error, ngen accepted an activation with no ID", !ngen(nn, "enn_test_gen", "."));
+	nn->hidden_activ = arelu;
+	nfree(nn);
+
+	return NULL;
+}
+
+static char* test_dataset(){
+	const char* csv_path = "enn_test_data.csv";
+	const char* bin_path = "enn_test_data.bin";
+	const char* numbers[] = {"0", "-0.25", "1.5e2", "3.14159", "1e-3", "0.1234567890123456789", "-7E+4", "0.000123",
+							 "123456789012345", "2.5e-30", "6.02214076e23", "+42"};
+	const Matrix *bx, *by;
+	Matrix *X, *Y;
+	dataset* ds;
+	FILE* file;
+	char* end;
+	int i, j, rows, epoch, total;
+
+	/* The fast parser must agree exactly with strtod */
+	for(i = 0; i < (int)(sizeof(numbers) / sizeof(numbers[0])); i++){
+		mu_assert("Error, dsparse != strtod", dsparse(numbers[i], &end) == strtod(numbers[i], NULL) && !*end);
+	}
+	mu_assert("Error, dsparse accepted a non-number", dsparse(" x", &end) == 0.0 && *end == ' ');
+
+	/* 7 samples of 3 inputs and 1 output, after a header and with CRLF line ends and a blank line */
+	X = mnew(7, 3);
+	Y = mnew(7, 1);
+	file = fopen(csv_path, "wb");
+	mu_assert("Error, could not write the test CSV", file);
+	fprintf(file, "a,b,c,label\r\n");
+	for(i = 0; i < 7; i++){
+		for(j = 0; j < 3; j++){
+			X->data[i][j] = dsparse(numbers[(i + j) % 12], NULL);
+			fprintf(file, "%s%s", numbers[(i + j) % 12], (j < 2) ? ", " : ",");
+		}
+		Y->data[i][0] = i % 3;
+		fprintf(file, "%d\r\n%s", i % 3, (i == 3) ? "\n" : "");
+	}
+	fclose(file);
+	mu_assert("Error, dssave failed", dssave(bin_path, X, Y));
+
+	for(i = 0; i < 2; i++){
+		ds = dsopen(i ? bin_path : csv_path, i ? DATASET_BINARY : DATASET_CSV, 3, 1, 3);
+		mu_assert("Error, dsopen returned NULL", ds);
+		for(epoch = 0; epoch < 2; epoch++){
+			total = 0;
+			while((rows = dsnext(ds, &bx, &by)) > 0){
+				mu_assert("Error, dsnext returned a wrong batch", rows == (total < 6 ? 3 : 1) && bx->rows == rows
+						  && bx->cols == 3 && by->rows == rows && by->cols == 1);
+				for(j = 0; j < rows; j++){
+					mu_assert("Error, dsnext inputs are wrong", !memcmp(bx->data[j], X->data[total + j], 3 * sizeof(double)));
+					mu_assert("Error, dsnext outputs are wrong", by->data[j][0] == Y->data[total + j][0]);
+				}
+				total += rows;
+			}
+			mu_assert("Error, dsnext failed", rows == 0 && total == 7);
+			mu_assert("Error, dsnext did not stay at the end", dsnext(ds, &bx, &by) == 0);
+			mu_assert("Error, dsrewind failed", dsrewind(ds));
+		}
+		dsclose(ds);
+	}
+
+	/* Malformed lines are reported, and binary files of another shape are rejected */
+	file = fopen(csv_path, "wb");
+	fprintf(file, "1,2,3,0\n4,5,0\n");
+	fclose(file);
+	ds = dsopen(csv_path, DATASET_CSV, 3, 1, 3);
+	mu_assert("Error, dsnext accepted a short line", ds && dsnext(ds, &bx, &by) == -1);
+	dsclose(ds);
+	mu_assert("Error, dsopen accepted a binary file of another shape", !dsopen(bin_path, DATASET_BINARY, 2, 2, 3));
+	remove(csv_path);
+	remove(bin_path);
+
+	mfree(X);
+	mfree(Y);
+
+	return NULL;
+}
+
+static char* test_nplan(){
+	Matrix *X_rows, *X, *expected, *column;
+	const Matrix* out;
+	neural_network* nn;
+	nplan* plan;
+	int i, j;
+
+	nn = iris_nn();
+	plan = nplan_new(nn, N_TESTS);
+	mu_assert("Error, nplan_new returned NULL", plan);
+
+	/* Whole batch, run twice to make sure the buffers are reused correctly */
+	MDUP(iris_X, X_rows, N_TESTS, 4);
+	X = mtrns(X_rows, NULL);
+	expected = npred_batch(nn, X, NULL);
+	for(i = 0; i < 2; i++){
+		out = nplan_pred(plan, X);
+		mu_assert("Error, nplan_pred returned NULL", out);
+		mu_assert("Error, nplan_pred != npred_batch", mcmp(out, expected));
+	}
+
+	/* A single sample uses the same plan with fewer columns */
+	column = mnew(4, 1);
+	for(j = 0; j < 4; j++){
+		column->data[j][0] = X->data[j][2];
+	}
+	out = nplan_pred(plan, column);
+	mu_assert("Error, nplan_pred (single sample) has wrong shape", out && out->rows == 3 && out->cols == 1);
+	for(j = 0; j < 3; j++){
+		mu_assert("Error, nplan_pred (single sample) != npred_batch", out->data[j][0] == expected->data[j][2]);
+	}
+
+	mfree(column);
+	mfree(X_rows);
+	mfree(X);
+	mfree(expected);
+	nplan_free(plan);
+	nfree(nn);
 
 	return NULL;
 }
@@ -342,6 +1257,123 @@ static char* test_mfree(){
 	return NULL;
 }
 
+static char* test_arena(){
+	arena* a = arena_new(256);
+	arena_mark mark;
+	char *first, *second, *big;
+	Matrix *x, *y, *heap, *pred;
+	neural_network* nn = iris_nn();
+
+	mu_assert("Error, arena_new failed", a != NULL);
+	first = arena_alloc(a, 1);
+	second = arena_alloc(a, 1);
+	mu_assert("Error, arena allocation is not aligned", ((size_t)first % ENN_ALIGN) == 0);
+	mu_assert("Error, arena allocations are not consecutive", second == first + ENN_ALIGN);
+
+	/* Growing past the first block and restoring the mark gives the memory back */
+	mark = arena_save(a);
+	big = arena_alloc(a, 4096);
+	mu_assert("Error, arena did not grow", big != NULL);
+	arena_restore(a, mark);
+	mu_assert("Error, arena_restore did not rewind", arena_alloc(a, 1) == second + ENN_ALIGN);
+	arena_reset(a);
+	mu_assert("Error, arena_reset did not rewind", arena_alloc(a, 1) == first);
+
+	/* mnew allocates from the active arena, and mfree leaves those matrices alone */
+	arena_reset(a);
+	mu_assert("Error, an arena is active by default", arena_use(a) == NULL);
+	x = mconst(3, 3, 2.0, NULL);
+	y = mconst(3, 3, 2.0, NULL);
+	mfree(x);
+	mu_assert("Error, arena matrix is not flagged", x->flags & MATRIX_ARENA);
+	mu_assert("Error, arena matrix is wrong", mcmp(x, y) && x->data[2][2] == 2.0);
+	mu_assert("Error, arena matrix did not come from the arena", (char*)x == first);
+	mu_assert("Error, arena_use did not return the active arena", arena_use(NULL) == a);
+	heap = mnew(3, 3);
+	mu_assert("Error, heap matrix is flagged", !(heap->flags & MATRIX_ARENA));
+	mfree(heap);
+	arena_free(a);
+
+	/* npred gives its temporaries back to the scratch arena, while the result is the caller's */
+	mark = arena_save(arena_scratch());
+	x = mnew(4, 1);
+	x->data[0][0] = 5.1;
+	x->data[1][0] = 3.5;
+	x->data[2][0] = 1.4;
+	x->data[3][0] = 0.2;
+	pred = npred(nn, x);
+	mu_assert("Error, npred failed", pred && !(pred->flags & MATRIX_ARENA));
+	mu_assert("Error, npred kept scratch memory", arena_save(arena_scratch()).block == mark.block &&
+			  arena_save(arena_scratch()).used == mark.used);
+	mfree(pred);
+	mfree(x);
+	nfree(nn);
+
+	return NULL;
+}
+
+static char* test_mpool(){
+	Matrix *x, *y, *big, *many[MPOOL_DEPTH + 1], *wide[64];
+	mpool_stats before, after;
+	int i;
+
+	/* A freed matrix is handed out again for the same shape */
+	mpool_clear();
+	mpool_stats_get(&before);
+	x = mnew(7, 13);
+	mfree(x);
+	y = mnew(7, 13);
+	mpool_stats_get(&after);
+	mu_assert("Error, mpool did not reuse the matrix", x == y);
+	mu_assert("Error, mpool hits are wrong", after.hits == before.hits + 1);
+	mu_assert("Error, mpool misses are wrong", after.misses == before.misses + 1);
+	mu_assert("Error, mpool recycled is wrong", after.recycled == before.recycled + 1);
+	mu_assert("Error, reused matrix has the wrong shape", y->rows == 7 && y->cols == 13 && y->stride == 13);
+	mconst(7, 13, 1.0, y);
+	mu_assert("Error, reused matrix is wrong", y->data[6][12] == 1.0 && y->buf[90] == 1.0);
+	mfree(y);
+
+	/* Only MPOOL_DEPTH matrices of a shape are kept, and large matrices are never kept */
+	mpool_clear();
+	mpool_stats_get(&before);
+	for(i = 0; i <= MPOOL_DEPTH; i++){
+		many[i] = mnew(3, 5);
+	}
+	for(i = 0; i <= MPOOL_DEPTH; i++){
+		mfree(many[i]);
+	}
+	big = mnew(MPOOL_MAX + 1, 1);
+	mfree(big);
+	mpool_stats_get(&after);
+	mu_assert("Error, mpool kept too many matrices", after.recycled == before.recycled + MPOOL_DEPTH);
+	mu_assert("Error, mpool released is wrong", after.released == before.released + 2);
+	mu_assert("Error, mpool bytes are wrong", after.bytes == MPOOL_DEPTH * 3 * 5 * sizeof(double));
+
+	/* No more than MPOOL_BYTES are kept, however many shapes are freed */
+	mpool_clear();
+	for(i = 0; i < 64; i++){
+		wide[i] = mnew(i + 1, MPOOL_MAX / (i + 1));
+	}
+	mpool_stats_get(&before);
+	for(i = 0; i < 64; i++){
+		mfree(wide[i]);
+	}
+	mpool_stats_get(&after);
+	mu_assert("Error, mpool kept more than MPOOL_BYTES", after.bytes > 0 && after.bytes <= (size_t)MPOOL_BYTES);
+	mu_assert("Error, mpool did not release past MPOOL_BYTES", after.released > before.released);
+
+	/* mpool_clear gives everything back */
+	mpool_clear();
+	mpool_stats_get(&before);
+	x = mnew(3, 5);
+	mpool_stats_get(&after);
+	mu_assert("Error, mpool_clear kept matrices", after.misses == before.misses + 1);
+	mfree(x);
+	mpool_clear();
+
+	return NULL;
+}
+
 static char* test_nbprop(){
 	Matrix *test_X2, *test_y2, *test_X, *test_y;
 	Matrix *cur_X, *cur_y, *preds, *pred, *x_in;
@@ -355,6 +1387,7 @@ static char* test_nbprop(){
 	Weights correspond to a transformation between layers, not a layer itself.
 	*/
 	neural_network* nn = ninit(1, 2, 2, 1, &alrelu, NULL);
+	arena* epoch_arena = arena_new(0);
 	int current_index = 0, i, epoch;
 	double mse;
 	double learning_rate = 0.0025;
@@ -372,6 +1405,8 @@ static char* test_nbprop(){
 
 	for(epoch = 0; epoch < 2000; epoch++){
 		int current_index = epoch % test_X->rows;
+		/* Everything made during the epoch is given back by the reset at its end */
+		arena_use(epoch_arena);
 		printf("Current epoch: %d, index: %d\n", epoch, current_index);
 		/* Get current X and y values to train on */
 		MDUP(&test_X->data[current_index], cur_X, 1, 1); /* One row, one col */
@@ -422,8 +1457,619 @@ static char* test_nbprop(){
 		mprint(test_y);*/
 		mse = lmse(test_y, preds);
 		printf("mse: %f\n",mse);
+		ngrad_free(nn, gradients);
+		arena_use(NULL);
+		arena_reset(epoch_arena);
+	}
+
+	arena_free(epoch_arena);
+	mfree(test_X);
+	mfree(test_y);
+	nfree(nn);
+	return NULL;
+}
+
+/* Backprop on a mini-batch must give the sum of the gradients of its samples */
+static char* test_nbprop_batch(){
+	Matrix *X, *Y, *x_row, *y_row;
+	Matrix ***batch_grads, ***sample_grads, ***summed_grads;
+	neural_network* nn = ninit(2, 2, 3, 2, &asigm, NULL);
+	double X_data[5][2] = {{0.5, -1.0}, {1.5, 0.25}, {-0.75, 2.0}, {0.1, 0.2}, {3.0, -2.0}};
+	double Y_data[5][2] = {{1.0, 0.0}, {0.0, 1.0}, {0.5, 0.5}, {1.0, 1.0}, {0.0, 0.0}};
+	int i, layer, row, col;
+
+	/* Break the symmetry of the all-ones initialization */
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		for(row = 0; row < nn->weights[layer]->rows; row++){
+			for(col = 0; col < nn->weights[layer]->cols; col++){
+				nn->weights[layer]->data[row][col] = 0.1 * ((row * 3 + col * 5 + layer) % 7) - 0.3;
+			}
+		}
+	}
+
+	MDUP(X_data, X, 5, 2);
+	MDUP(Y_data, Y, 5, 2);
+	batch_grads = ngrad_new(nn);
+	summed_grads = ngrad_new(nn);
+	mu_assert("Error, nbprop_batch failed", nbprop_batch(nn, X, Y, dmse, batch_grads));
+
+	/* Add up the gradients of the samples one at a time */
+	for(i = 0; i < 5; i++){
+		MDUP(&X_data[i], x_row, 1, 2);
+		MDUP(&Y_data[i], y_row, 1, 2);
+		sample_grads = nbprop(nn, x_row, y_row, lmse, dmse);
+		mu_assert("Error, nbprop failed", sample_grads);
+		for(layer = 0; layer < nn->n_layers - 1; layer++){
+			madd(summed_grads[0][layer], sample_grads[0][layer], summed_grads[0][layer]);
+			madd(summed_grads[1][layer], sample_grads[1][layer], summed_grads[1][layer]);
+		}
+		ngrad_free(nn, sample_grads);
+		mfree(x_row);
+		mfree(y_row);
+	}
+
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		for(i = 0; i < 2; i++){
+			Matrix *batch = batch_grads[i][layer], *summed = summed_grads[i][layer];
+			for(row = 0; row < batch->rows; row++){
+				for(col = 0; col < batch->cols; col++){
+					mu_assert("Error, nbprop_batch != sum of nbprop",
+							  fabs(batch->data[row][col] - summed->data[row][col]) < 1e-9);
+				}
+			}
+		}
+	}
+
+	ngrad_free(nn, batch_grads);
+	ngrad_free(nn, summed_grads);
+	mfree(X);
+	mfree(Y);
+	nfree(nn);
+
+	return NULL;
+}
+
+/* Half the sum of squared errors of a network over a batch (the loss whose derivative is dmse) */
+static double sse_loss(const neural_network* nn, const Matrix* X, const Matrix* Y){
+	Matrix *Xt, *out;
+	double loss = 0.0;
+	int row, col;
+
+	Xt = mtrns(X, NULL);
+	out = npred_batch(nn, Xt, NULL);
+	for(row = 0; row < out->rows; row++){
+		for(col = 0; col < out->cols; col++){
+			loss += 0.5 * SQR(out->data[row][col] - Y->data[col][row]);
+		}
+	}
+	mfree(Xt);
+	mfree(out);
+	return loss;
+}
+
+/* Compares the analytic gradients from backprop with central differences of the loss */
+static char* test_nbprop_gradcheck(){
+	Matrix *X, *Y, ***grads;
+	neural_network* nn = ninit(2, 1, 3, 2, &asigm, NULL);
+	double X_data[3][2] = {{0.5, -1.0}, {1.5, 0.25}, {-0.75, 2.0}};
+	double Y_data[3][2] = {{1.0, 0.0}, {0.0, 1.0}, {0.5, 0.5}};
+	double h = 1e-5, saved, loss_plus, loss_minus;
+	int layer, row, col;
+
+	mu_assert("Error, asigm is not paired with dsigm", nn->hidden_deriv == &dsigm);
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		for(row = 0; row < nn->weights[layer]->rows; row++){
+			for(col = 0; col < nn->weights[layer]->cols; col++){
+				nn->weights[layer]->data[row][col] = 0.2 * ((row * 3 + col * 5 + layer) % 7) - 0.6;
+			}
+		}
+	}
+
+	MDUP(X_data, X, 3, 2);
+	MDUP(Y_data, Y, 3, 2);
+	grads = ngrad_new(nn);
+	mu_assert("Error, nbprop_batch failed", nbprop_batch(nn, X, Y, dmse, grads));
+
+	for(layer = 0; layer < nn->n_layers - 1; layer++){
+		Matrix* weight = nn->weights[layer];
+		for(row = 0; row < weight->rows; row++){
+			for(col = 0; col < weight->cols; col++){
+				saved = weight->data[row][col];
+				weight->data[row][col] = saved + h;
+				loss_plus = sse_loss(nn, X, Y);
+				weight->data[row][col] = saved - h;
+				loss_minus = sse_loss(nn, X, Y);
+				weight->data[row][col] = saved;
+				mu_assert("Error, backprop gradient != numerical gradient",
+						  fabs(grads[0][layer]->data[row][col] - (loss_plus - loss_minus) / (2 * h)) < 1e-8);
+			}
+		}
+	}
+
+	ngrad_free(nn, grads);
+	mfree(X);
+	mfree(Y);
+	nfree(nn);
+
+	return NULL;
+}
+
+/* Fills X and Y with samples of y = 3x + 5 for x in [-1, 1] */
+static void linear_data(Matrix** X, Matrix** Y, int samples){
+	int i;
+	*X = mnew(samples, 1);
+	*Y = mnew(samples, 1);
+	for(i = 0; i < samples; i++){
+		(*X)->data[i][0] = -1.0 + 2.0 * i / (samples - 1);
+		(*Y)->data[i][0] = 3.0 * (*X)->data[i][0] + 5.0;
+	}
+}
+
+/* Fills X and Y with samples for wide_nn() */
+static void wide_data(Matrix** X, Matrix** Y, int samples){
+	int row, col;
+
+	*X = mnew(samples, 1024);
+	*Y = mnew(samples, 4);
+	for(row = 0; row < samples; row++){
+		for(col = 0; col < 1024; col++){
+			(*X)->data[row][col] = ((row * 5 + col) % 7 - 3) * 0.1;
+		}
+		for(col = 0; col < 4; col++){
+			(*Y)->data[row][col] = ((row + col) % 3 - 1) * 0.5;
+		}
+	}
+}
+
+/* Returns a 1024-1024-4 network with fixed weights. Its layers are wide enough that the products in a
+shard or a Hogwild! worker exceed GEMM_PARALLEL */
+static neural_network* wide_nn(void){
+	neural_network* nn;
+	int layer, row, col;
+
+	nn = ninit(1024, 1, 1024, 4, &alin, NULL);
+	for(layer = 0; layer < 2; layer++){
+		for(row = 0; row < nn->weights[layer]->rows; row++){
+			for(col = 0; col < nn->weights[layer]->cols; col++){
+				nn->weights[layer]->data[row][col] = ((row * 7 + col * 3 + layer) % 11 - 5) * 0.001;
+			}
+		}
+	}
+	return nn;
+}
+
+static char* test_ntrain(){
+	Matrix *X, *Y;
+	neural_network *nn_serial, *nn_sharded;
+	train_opts opts;
+	double loss_before, loss_after;
+	int layer, row, col, threads;
+
+	linear_data(&X, &Y, 64);
+	nn_serial = ninit(1, 1, 4, 1, &alin, NULL);
+	nn_sharded = ninit(1, 1, 4, 1, &alin, NULL);
+	for(layer = 0; layer < 2; layer++){
+		for(row = 0; row < nn_serial->weights[layer]->rows; row++){
+			for(col = 0; col < nn_serial->weights[layer]->cols; col++){
+				nn_serial->weights[layer]->data[row][col] = 0.1 * (row + col + layer) - 0.2;
+				nn_sharded->weights[layer]->data[row][col] = 0.1 * (row + col + layer) - 0.2;
+			}
+		}
+	}
+	loss_before = sse_loss(nn_serial, X, Y);
+
+	ntrain_defaults(&opts);
+	opts.epochs = 200;
+	opts.batch_size = 16;
+	opts.learning_rate = 0.05;
+	opts.shuffle = 1;
+	opts.shards = 1;
+	mu_assert("Error, ntrain (1 shard) failed", ntrain(nn_serial, X, Y, &opts));
+	opts.shards = 4;
+	mu_assert("Error, ntrain (4 shards) failed", ntrain(nn_sharded, X, Y, &opts));
+
+	/* Sharding only changes the order the gradients are summed in */
+	loss_after = sse_loss(nn_serial, X, Y);
+	mu_assert("Error, ntrain did not reduce the loss", loss_after < loss_before / 1000);
+	for(layer = 0; layer < 2; layer++){
+		for(row = 0; row < nn_serial->weights[layer]->rows; row++){
+			for(col = 0; col < nn_serial->weights[layer]->cols; col++){
+				mu_assert("Error, sharded training != serial training",
+						  fabs(nn_serial->weights[layer]->data[row][col] -
+							   nn_sharded->weights[layer]->data[row][col]) < 1e-9);
+			}
+		}
+	}
+	mfree(X);
+	mfree(Y);
+	nfree(nn_serial);
+	nfree(nn_sharded);
+
+	/* Shards of a wide network multiply over GEMM_PARALLEL from inside their pool tasks */
+	wide_data(&X, &Y, 64);
+	nn_serial = wide_nn();
+	nn_sharded = wide_nn();
+	opts.epochs = 2;
+	opts.batch_size = 64;
+	opts.learning_rate = 0.01;
+	opts.shuffle = 0;
+	threads = pool_threads();
+	mu_assert("Error, could not start 4 threads", pool_set_threads(4) == 4);
+	opts.shards = 1;
+	mu_assert("Error, ntrain (wide, 1 shard) failed", ntrain(nn_serial, X, Y, &opts));
+	opts.shards = 2;
+	mu_assert("Error, ntrain (wide, 2 shards) failed", ntrain(nn_sharded, X, Y, &opts));
+	pool_set_threads(threads);
+	for(layer = 0; layer < 2; layer++){
+		for(row = 0; row < nn_serial->weights[layer]->rows; row++){
+			for(col = 0; col < nn_serial->weights[layer]->cols; col++){
+				mu_assert("Error, sharded training != serial training (wide)",
+						  fabs(nn_serial->weights[layer]->data[row][col] -
+							   nn_sharded->weights[layer]->data[row][col]) < 1e-9);
+			}
+		}
+	}
+
+	mfree(X);
+	mfree(Y);
+	nfree(nn_serial);
+	nfree(nn_sharded);
+
+	return NULL;
+}
+
+static char* test_ntrain_stream(){
+	const char* path = "enn_test_stream.bin";
+	const Matrix *bx, *by;
+	Matrix *X, *Y, *shift, *scale;
+	neural_network *nn, *nn_stream;
+	dataset* ds;
+	dataset_stats stats;
+	train_opts opts;
+	clock_t start;
+	double sum = 0.0, sum_sq = 0.0;
+	int layer, row, col, rows, moved = 0, seen = 0;
+
+	linear_data(&X, &Y, 64);
+	mu_assert("Error, dssave failed", dssave(path, X, Y));
+	nn = ninit(1, 1, 4, 1, &alin, NULL);
+	nn_stream = ninit(1, 1, 4, 1, &alin, NULL);
+	for(layer = 0; layer < 2; layer++){
+		for(row = 0; row < nn->weights[layer]->rows; row++){
+			for(col = 0; col < nn->weights[layer]->cols; col++){
+				nn->weights[layer]->data[row][col] = 0.1 * (row + col + layer) - 0.2;
+				nn_stream->weights[layer]->data[row][col] = 0.1 * (row + col + layer) - 0.2;
+			}
+		}
+	}
+
+	/* The same batches in the same order train the same network as ntrain() */
+	ntrain_defaults(&opts);
+	opts.epochs = 50;
+	opts.batch_size = 16;
+	opts.learning_rate = 0.05;
+	ds = dsopen(path, DATASET_BINARY, 1, 1, 16);
+	mu_assert("Error, dsopen returned NULL", ds);
+	mu_assert("Error, ntrain failed", ntrain(nn, X, Y, &opts));
+	/* ntrain_stream() takes the batch size from the dataset */
+	opts.batch_size = 0;
+	mu_assert("Error, ntrain_stream failed", ntrain_stream(nn_stream, ds, &opts));
+	for(layer = 0; layer < 2; layer++){
+		mu_assert("Error, ntrain_stream != ntrain", mcmp(nn->weights[layer], nn_stream->weights[layer])
+				  && mcmp(nn->biases[layer], nn_stream->biases[layer]));
+	}
+	dsstats(ds, &stats);
+	mu_assert("Error, dsstats counted the wrong number of batches", stats.batches == 50 * 4);
+
+	/* A shuffled, normalized epoch holds every sample once, in another order */
+	shift = mconst(1, 1, 1.0, NULL);
+	scale = mconst(1, 1, 0.5, NULL);
+	mu_assert("Error, dsnormalize failed", dsnormalize(ds, shift, scale));
+	mu_assert("Error, dsshuffle failed", dsshuffle(ds, 24, 7));
+	while((rows = dsnext(ds, &bx, &by)) > 0){
+		for(row = 0; row < rows; row++, seen++){
+			double x = X->data[seen][0];
+			/* The outputs are not normalized, y = 3x + 5 still gives the original input */
+			mu_assert("Error, dsnormalize did not normalize",
+					  fabs(bx->data[row][0] - ((by->data[row][0] - 5.0) / 3.0 - 1.0) * 0.5) < 1e-12);
+			moved += bx->data[row][0] != (x - 1.0) * 0.5;
+			sum += bx->data[row][0];
+			sum_sq += bx->data[row][0] * bx->data[row][0];
+			sum -= (x - 1.0) * 0.5;
+			sum_sq -= (x - 1.0) * 0.5 * ((x - 1.0) * 0.5);
+		}
+	}
+	mu_assert("Error, shuffled epoch has the wrong samples", rows == 0 && seen == 64 && fabs(sum) < 1e-9
+			  && fabs(sum_sq) < 1e-9);
+	mu_assert("Error, dsshuffle did not shuffle", moved > 32);
+	dsclose(ds);
+
+	/* Once the prefetch thread has filled the ring it idles, and the first batch is there without waiting */
+	ds = dsopen(path, DATASET_BINARY, 1, 1, 16);
+	mu_assert("Error, dsopen returned NULL", ds);
+	start = clock();
+	do{
+		dsstats(ds, &stats);
+	}while(!stats.idle && clock() - start < 10 * CLOCKS_PER_SEC);
+	mu_assert("Error, dsstats did not count the prefetch thread idling", stats.idle > 0);
+	mu_assert("Error, dsnext failed", dsnext(ds, &bx, &by) == 16);
+	dsstats(ds, &stats);
+	mu_assert("Error, dsstats counted a stall on a full ring", stats.stalls == 0 && stats.stall_seconds == 0.0
+			  && stats.batches == 1);
+	dsclose(ds);
+	remove(path);
+
+	mfree(X);
+	mfree(Y);
+	mfree(shift);
+	mfree(scale);
+	nfree(nn);
+	nfree(nn_stream);
+
+	return NULL;
+}
+
+static char* test_optim(){
+	int kinds[] = {OPTIM_SGD, OPTIM_MOMENTUM, OPTIM_NESTEROV, OPTIM_ADAM, OPTIM_ADAMW};
+	Matrix ***grads, *X, *Y;
+	neural_network* nn;
+	optim_opts settings;
+	optim* opt;
+	train_opts opts;
+	double lr, mu, decay, w, b, v, loss_before;
+	int k, layer, part, step;
+
+	/* Two steps with a constant gradient of 1 (2, scaled by 0.5) from weights and biases of 1 */
+	for(k = 0; k < (int)(sizeof(kinds) / sizeof(kinds[0])); k++){
+		nn = ninit(1, 1, 2, 1, &alin, NULL);
+		grads = ngrad_new(nn);
+		for(layer = 0; layer < 2; layer++){
+			for(part = 0; part < 2; part++){
+				Matrix* g = grads[part][layer];
+				simd()->fill((size_t)g->rows * g->stride, 2.0, g->buf);
+			}
+		}
+		optim_defaults(&settings, kinds[k]);
+		lr = settings.learning_rate;
+		mu = settings.momentum;
+		opt = optim_new(nn, &settings);
+		mu_assert("Error, optim_new failed", opt);
+		for(step = 0; step < 2; step++){
+			mu_assert("Error, optim_step failed", optim_step(opt, nn, grads, 0.5));
+		}
+
+		switch(kinds[k]){
+		case OPTIM_MOMENTUM:
+			w = b = 1 - lr + (-mu * lr - lr);
+			break;
+		case OPTIM_NESTEROV:
+			v = -lr;
+			w = 1 + mu * v - lr;
+			v = mu * v - lr;
+			w = b = w + mu * v - lr;
+			break;
+		case OPTIM_ADAM:
+			/* With a constant gradient the bias corrected step is the learning rate */
+			w = b = 1 - 2 * lr;
+			break;
+		case OPTIM_ADAMW:
+			decay = 1 - lr * settings.weight_decay;
+			w = (decay - lr) * decay - lr;
+			b = 1 - 2 * lr;
+			break;
+		default:
+			w = b = 1 - 2 * lr;
+		}
+		for(layer = 0; layer < 2; layer++){
+			mu_assert("Error, optim_step weight update is wrong", fabs(nn->weights[layer]->data[0][0] - w) < 1e-8);
+			mu_assert("Error, optim_step bias update is wrong", fabs(nn->biases[layer]->data[0][0] - b) < 1e-8);
+		}
+		optim_free(opt);
+		ngrad_free(nn, grads);
+		nfree(nn);
+	}
+
+	/* Adam through ntrain(), keeping its state between calls */
+	linear_data(&X, &Y, 64);
+	nn = ninit(1, 1, 4, 1, &alin, NULL);
+	for(layer = 0; layer < 2; layer++){
+		for(step = 0; step < nn->weights[layer]->rows * nn->weights[layer]->cols; step++){
+			nn->weights[layer]->buf[step] = 0.1 * step - 0.2;
+		}
+	}
+	loss_before = sse_loss(nn, X, Y);
+	optim_defaults(&settings, OPTIM_ADAM);
+	settings.learning_rate = 0.05;
+	opt = optim_new(nn, &settings);
+	ntrain_defaults(&opts);
+	opts.epochs = 100;
+	opts.batch_size = 16;
+	opts.optim = opt;
+	mu_assert("Error, ntrain with Adam failed", ntrain(nn, X, Y, &opts) && ntrain(nn, X, Y, &opts));
+	mu_assert("Error, Adam did not keep its state", opt->steps == 2 * 100 * 4);
+	mu_assert("Error, Adam did not reduce the loss", sse_loss(nn, X, Y) < loss_before / 1000);
+	opts.async = 1;
+	mu_assert("Error, ntrain accepted an optimizer for asynchronous training", !ntrain(nn, X, Y, &opts));
+	optim_free(opt);
+	nfree(nn);
+
+	/* Without inputs the first weight matrix has no columns */
+	nn = ninit(0, 1, 4, 1, &alin, NULL);
+	grads = ngrad_new(nn);
+	opt = optim_new(nn, &settings);
+	mu_assert("Error, could not set up a network without inputs", grads && opt && nn->weights[0]->cols == 0);
+	mu_assert("Error, optim_step failed on an empty weight matrix", optim_step(opt, nn, grads, 1.0));
+
+	optim_free(opt);
+	ngrad_free(nn, grads);
+	nfree(nn);
+	mfree(X);
+	mfree(Y);
+
+	return NULL;
+}
+
+static char* test_lxent(){
+	Matrix *logits, *Y, *grad, *logits_t, *Y_t, *grad_t, *X_rows, *X, *Y_iris, *Y_iris_t, *out;
+	neural_network* nn;
+	train_opts opts;
+	double loss, loss_t, expected = 0.0, plus, minus, before, after;
+	int row, col;
+
+	/* 3 classes x 4 samples, the last sample with logits that overflow a plain exp */
+	logits = mnew(3, 4);
+	Y = mconst(3, 4, 0.0, NULL);
+	for(row = 0; row < 3; row++){
+		for(col = 0; col < 4; col++){
+			logits->data[row][col] = 0.5 * row - 0.3 * col + ((col == 3) ? 1000.0 : 0.0);
+		}
+	}
+	for(col = 0; col < 4; col++){
+		Y->data[col % 3][col] = 1.0;
 	}
-	
+	for(col = 0; col < 4; col++){
+		double max = logits->data[2][col], sum = 0.0;
+		for(row = 0; row < 3; row++){
+			sum += exp(logits->data[row][col] - max);
+		}
+		expected += (max + log(sum) - logits->data[col % 3][col]) / 4;
+	}
+	grad = mnew(3, 4);
+	loss = lxent2(logits, Y, ASMAX_COLS, grad);
+	mu_assert("Error, lxent2 is wrong", fabs(loss - expected) < 1e-12 && fabs(lxent(logits, Y) - expected) < 1e-12);
+
+	/* The gradient of the mean loss is (softmax - y) / samples */
+	for(row = 0; row < 3; row++){
+		for(col = 0; col < 4; col++){
+			double saved = logits->data[row][col];
+			logits->data[row][col] = saved + 1e-5;
+			plus = lxent(logits, Y);
+			logits->data[row][col] = saved - 1e-5;
+			minus = lxent(logits, Y);
+			logits->data[row][col] = saved;
+			mu_assert("Error, lxent2 gradient is wrong", fabs((plus - minus) / 2e-5 - grad->data[row][col] / 4) < 1e-7);
+		}
+	}
+	out = dxent(logits, Y);
+	mu_assert("Error, dxent != lxent2 gradient", out && mcmp(out, grad));
+	mfree(out);
+
+	/* Samples as rows give the same loss and gradient */
+	logits_t = mtrns(logits, NULL);
+	Y_t = mtrns(Y, NULL);
+	grad_t = mnew(4, 3);
+	loss_t = lxent2(logits_t, Y_t, ASMAX_ROWS, grad_t);
+	out = mtrns(grad_t, NULL);
+	mu_assert("Error, lxent2 rows != lxent2 cols", fabs(loss_t - loss) < 1e-12);
+	for(row = 0; row < 3; row++){
+		for(col = 0; col < 4; col++){
+			mu_assert("Error, lxent2 rows gradient != cols gradient", fabs(out->data[row][col] - grad->data[row][col]) < 1e-15);
+		}
+	}
+
+	/* Training the iris classifier with it lowers its cross-entropy */
+	nn = iris_nn();
+	MDUP(iris_X, X_rows, N_TESTS, 4);
+	X = mtrns(X_rows, NULL);
+	Y_iris = mconst(N_TESTS, 3, 0.0, NULL);
+	for(row = 0; row < N_TESTS; row++){
+		Y_iris->data[row][iris_y[row]] = 1.0;
+	}
+	Y_iris_t = mtrns(Y_iris, NULL);
+	nn->output_activ = NULL;
+	mfree(out);
+	out = npred_batch(nn, X, NULL);
+	before = lxent(out, Y_iris_t);
+	ntrain_defaults(&opts);
+	opts.epochs = 20;
+	opts.batch_size = N_TESTS;
+	opts.learning_rate = 0.01;
+	opts.dloss_func = dxent;
+	mu_assert("Error, ntrain with dxent failed", ntrain(nn, X_rows, Y_iris, &opts));
+	npred_batch(nn, X, out);
+	after = lxent(out, Y_iris_t);
+	mu_assert("Error, training with dxent did not lower the loss", after < before);
+
+	mfree(logits);
+	mfree(Y);
+	mfree(grad);
+	mfree(logits_t);
+	mfree(Y_t);
+	mfree(grad_t);
+	mfree(out);
+	mfree(X_rows);
+	mfree(X);
+	mfree(Y_iris);
+	mfree(Y_iris_t);
+	nfree(nn);
+
+	return NULL;
+}
+
+static char* test_ntrain_async(){
+	Matrix *X, *Y;
+	neural_network *nn_sync, *nn_async;
+	train_opts opts;
+	double loss_before, loss_sync, loss_async;
+	int layer, row, col, threads;
+
+	linear_data(&X, &Y, 64);
+	nn_sync = ninit(1, 1, 4, 1, &alin, NULL);
+	nn_async = ninit(1, 1, 4, 1, &alin, NULL);
+	for(layer = 0; layer < 2; layer++){
+		for(row = 0; row < nn_sync->weights[layer]->rows; row++){
+			for(col = 0; col < nn_sync->weights[layer]->cols; col++){
+				nn_sync->weights[layer]->data[row][col] = 0.1 * (row + col + layer) - 0.2;
+				nn_async->weights[layer]->data[row][col] = 0.1 * (row + col + layer) - 0.2;
+			}
+		}
+	}
+	loss_before = sse_loss(nn_sync, X, Y);
+
+	ntrain_defaults(&opts);
+	opts.epochs = 50;
+	opts.batch_size = 1;
+	opts.learning_rate = 0.005;
+	opts.shuffle = 1;
+	opts.shards = 1;
+	mu_assert("Error, ntrain (synchronous) failed", ntrain(nn_sync, X, Y, &opts));
+	/* Four threads even on a single core host, so the workers really update the weights concurrently */
+	threads = pool_threads();
+	mu_assert("Error, could not start 4 threads", pool_set_threads(4) == 4);
+	opts.async = 1;
+	opts.shards = 4;
+	mu_assert("Error, ntrain (asynchronous) failed", ntrain(nn_async, X, Y, &opts));
+	pool_set_threads(threads);
+
+	/* The updates interleave differently, but both runs must converge */
+	loss_sync = sse_loss(nn_sync, X, Y);
+	loss_async = sse_loss(nn_async, X, Y);
+	mu_assert("Error, synchronous ntrain did not reduce the loss", loss_sync < loss_before / 1000);
+	mu_assert("Error, asynchronous ntrain did not reduce the loss", loss_async < loss_before / 1000);
+	mfree(X);
+	mfree(Y);
+	nfree(nn_sync);
+	nfree(nn_async);
+
+	/* Every worker backpropagates a wide network, multiplying over GEMM_PARALLEL inside its pool task */
+	wide_data(&X, &Y, 16);
+	nn_async = wide_nn();
+	opts.epochs = 1;
+	opts.learning_rate = 0.001;
+	mu_assert("Error, could not start 4 threads", pool_set_threads(4) == 4);
+	mu_assert("Error, ntrain (asynchronous, wide) failed", ntrain(nn_async, X, Y, &opts));
+	pool_set_threads(threads);
+	for(row = 0; row < 4; row++){
+		for(col = 0; col < 1024; col++){
+			mu_assert("Error, asynchronous ntrain (wide) diverged",
+					  fabs(nn_async->weights[1]->data[row][col]) < 1);
+		}
+	}
+
+	mfree(X);
+	mfree(Y);
+	nfree(nn_async);
+
 	return NULL;
 }
 
@@ -433,12 +2079,36 @@ static char* all_tests(){;
 	mu_run_test(test_mcmp);
 	mu_run_test(test_mconst);
 	mu_run_test(test_mmul);
+	mu_run_test(test_mmul_blocked);
+	mu_run_test(test_mmult);
+	mu_run_test(test_blas);
+	mu_run_test(test_mdense);
+	mu_run_test(test_simd);
+	mu_run_test(test_pool);
 	mu_run_test(test_mhad);
 	mu_run_test(test_mscale);
 	mu_run_test(test_arelu);
+	mu_run_test(test_asmax);
+	mu_run_test(test_avec);
+	mu_run_test(test_lxent);
 	mu_run_test(test_npred);
+	mu_run_test(test_npred_batch);
+	mu_run_test(test_nplan);
+	mu_run_test(test_nconvf);
+	mu_run_test(test_nquant);
+	mu_run_test(test_nsave);
+	mu_run_test(test_ngen);
+	mu_run_test(test_dataset);
 	mu_run_test(test_mfree);
+	mu_run_test(test_arena);
+	mu_run_test(test_mpool);
 	mu_run_test(test_nbprop);
+	mu_run_test(test_nbprop_batch);
+	mu_run_test(test_nbprop_gradcheck);
+	mu_run_test(test_ntrain);
+	mu_run_test(test_ntrain_stream);
+	mu_run_test(test_optim);
+	mu_run_test(test_ntrain_async);
 	return NULL;
 }
 